@@ -0,0 +1,354 @@
+/*
+ * This file is part of fitbitd.
+ *
+ * fitbitd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fitbitd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fitbitd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Exposes a local ANT base over TCP, so that fitbitd on another machine can
+ * drive it with --remote. One client is served at a time. The device's byte
+ * stream is relayed untouched, framed as described in ant-net.h, & pings are
+ * answered so that the client can measure the link.
+ */
+
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <ant-net.h>
+#include <ant-private.h>
+#include <ant-serial.h>
+#include "util.h"
+
+#define LOG_TAG "antbridge"
+#include "log.h"
+
+/* time to wait for data from the device before checking it's alive, in ms */
+#define BRIDGE_READ_TIMEOUT 100
+
+typedef struct {
+    ant_t *ant;
+
+    /*
+     * the connected client or -1. lock serialises frames sent to it by the
+     * device reader & the pongs sent by the client handler.
+     */
+    pthread_mutex_t lock;
+    int client;
+
+    int listener;
+} bridge_t;
+
+static int send_frame(int fd, uint8_t type, const uint8_t *data, size_t sz)
+{
+    uint8_t hdr[ANT_NET_HDR_SZ] = { type, sz & 0xff, sz >> 8 };
+    struct iovec iov[2];
+    size_t done = 0, total = sizeof(hdr) + sz;
+    ssize_t ret;
+    int i;
+
+    while (done < total) {
+        i = 0;
+        if (done < sizeof(hdr)) {
+            iov[i].iov_base = &hdr[done];
+            iov[i++].iov_len = sizeof(hdr) - done;
+            iov[i].iov_base = (void*)data;
+            iov[i++].iov_len = sz;
+        } else {
+            iov[i].iov_base = (void*)&data[done - sizeof(hdr)];
+            iov[i++].iov_len = total - done;
+        }
+
+        ret = writev(fd, iov, i);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+        done += ret;
+    }
+
+    return 0;
+}
+
+static int recv_all(int fd, uint8_t *buf, size_t sz)
+{
+    size_t done = 0;
+    ssize_t ret;
+
+    while (done < sz) {
+        ret = recv(fd, &buf[done], sz - done, 0);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+        done += ret;
+    }
+
+    return 0;
+}
+
+/*
+ * Relays whatever the device sends to the client. Each read returns all that
+ * the device had ready, which is sent on as a single frame.
+ */
+static void *device_thread(void *user)
+{
+    bridge_t *bridge = user;
+    uint8_t buf[ANT_NET_PAYLOAD_MAX];
+    ssize_t sz;
+
+    while (!ant_is_dead(bridge->ant)) {
+        sz = bridge->ant->read(bridge->ant, buf, sizeof(buf), BRIDGE_READ_TIMEOUT);
+        if (sz <= 0)
+            continue;
+
+        pthread_mutex_lock(&bridge->lock);
+        if (bridge->client >= 0 && send_frame(bridge->client, ANT_NET_DATA, buf, sz)) {
+            /* let the client handler notice & clean up */
+            DBG("failed to send to client\n");
+            shutdown(bridge->client, SHUT_RDWR);
+        }
+        pthread_mutex_unlock(&bridge->lock);
+    }
+
+    ERR("base %s died\n", bridge->ant->name);
+
+    /* wake the main thread, whether serving a client or waiting for one */
+    pthread_mutex_lock(&bridge->lock);
+    if (bridge->client >= 0)
+        shutdown(bridge->client, SHUT_RDWR);
+    pthread_mutex_unlock(&bridge->lock);
+    shutdown(bridge->listener, SHUT_RDWR);
+
+    return NULL;
+}
+
+/* relays frames from the client to the device until it disconnects */
+static void serve_client(bridge_t *bridge, int fd)
+{
+    uint8_t hdr[ANT_NET_HDR_SZ], payload[ANT_NET_PAYLOAD_MAX];
+    size_t len;
+    int ret;
+
+    while (!ant_is_dead(bridge->ant)) {
+        if (recv_all(fd, hdr, sizeof(hdr)))
+            break;
+
+        len = hdr[1] | (hdr[2] << 8);
+        if (len > ANT_NET_PAYLOAD_MAX) {
+            ERR("bad frame length %zu\n", len);
+            break;
+        }
+        if (recv_all(fd, payload, len))
+            break;
+
+        switch (hdr[0]) {
+        case ANT_NET_DATA:
+            if (bridge->ant->write(bridge->ant, payload, len) != len)
+                ERR("failed to write to base\n");
+            break;
+
+        case ANT_NET_PING:
+            pthread_mutex_lock(&bridge->lock);
+            ret = send_frame(fd, ANT_NET_PONG, payload, len);
+            pthread_mutex_unlock(&bridge->lock);
+            if (ret)
+                goto out;
+            break;
+
+        default:
+            DBG("ignoring frame type %u\n", hdr[0]);
+            break;
+        }
+    }
+out:
+    return;
+}
+
+static int listen_on(const char *addr, const char *port)
+{
+    struct addrinfo hints, *res, *ai;
+    int fd = -1, one = 1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if (getaddrinfo(addr, port, &hints, &res)) {
+        ERR("failed to resolve %s\n", addr ? addr : "listen address");
+        return -1;
+    }
+
+    for (ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (!bind(fd, ai->ai_addr, ai->ai_addrlen) && !listen(fd, 1))
+            break;
+
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (fd < 0)
+        ERR("failed to listen on port %s\n", port);
+    return fd;
+}
+
+static void found_base(ant_t *ant, void *user)
+{
+    ant_t **antptr = user;
+
+    /* bridge the first base found */
+    if (*antptr) {
+        DBG("ignoring base %s\n", ant->name);
+        ant_destroy(ant);
+        return;
+    }
+
+    *antptr = ant;
+}
+
+static void print_usage(FILE *f)
+{
+    fprintf(f, "Usage: antbridge <args>\n"
+          "\n"
+          "Where args is any of:\n"
+          "  --help             Output this message\n"
+          "  --listen <addr>    Accept connections on <addr> only\n"
+          "  --port <port>      Listen on <port>, rather than " ANT_NET_PORT_DEFAULT "\n"
+          "  --serial <tty>     Bridge the ANT device on <tty>, rather than the\n"
+          "                     first USB base found\n");
+}
+
+int main(int argc, char *argv[])
+{
+    bridge_t bridge = { NULL, PTHREAD_MUTEX_INITIALIZER, -1, -1 };
+    char *opt_listen = NULL, *opt_serial = NULL;
+    char *opt_port = ANT_NET_PORT_DEFAULT;
+    pthread_t thread;
+    int argi, fd, one = 1;
+
+    for (argi = 1; argi < argc; argi++) {
+        if (!strcmp(argv[argi], "--help")) {
+            print_usage(stdout);
+            return EXIT_SUCCESS;
+        }
+
+        if (!strcmp(argv[argi], "--listen")) {
+            if (++argi >= argc) {
+                ERR("--listen requires an address\n");
+                goto out;
+            }
+            opt_listen = argv[argi];
+            continue;
+        }
+
+        if (!strcmp(argv[argi], "--port")) {
+            if (++argi >= argc) {
+                ERR("--port requires a port\n");
+                goto out;
+            }
+            opt_port = argv[argi];
+            continue;
+        }
+
+        if (!strcmp(argv[argi], "--serial")) {
+            if (++argi >= argc) {
+                ERR("--serial requires a tty\n");
+                goto out;
+            }
+            opt_serial = argv[argi];
+            continue;
+        }
+
+        ERR("Unknown argument '%s'\n", argv[argi]);
+        print_usage(stderr);
+        goto out;
+    }
+
+    /* a client disconnecting mid write shouldn't kill us */
+    signal(SIGPIPE, SIG_IGN);
+
+    if (opt_serial)
+        bridge.ant = ant_serial_open(opt_serial, ANT_SERIAL_BAUD_DEFAULT);
+    else
+        ant_find_nodes(found_base, &bridge.ant);
+    if (!bridge.ant) {
+        ERR("no base found\n");
+        goto out;
+    }
+
+    bridge.listener = listen_on(opt_listen, opt_port);
+    if (bridge.listener < 0)
+        goto out;
+
+    if (pthread_create(&thread, NULL, device_thread, &bridge)) {
+        ERR("failed to create device thread\n");
+        goto out;
+    }
+
+    INFO("bridging %s on port %s\n", bridge.ant->name, opt_port);
+
+    while (!ant_is_dead(bridge.ant)) {
+        fd = accept(bridge.listener, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            ERR("accept failed %d\n", errno);
+            /* stop the device thread too */
+            bridge.ant->dead = true;
+            break;
+        }
+
+        /* exchanges are small & latency bound, so never delay a frame */
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        INFO("client connected\n");
+        pthread_mutex_lock(&bridge.lock);
+        bridge.client = fd;
+        pthread_mutex_unlock(&bridge.lock);
+
+        serve_client(&bridge, fd);
+
+        pthread_mutex_lock(&bridge.lock);
+        bridge.client = -1;
+        pthread_mutex_unlock(&bridge.lock);
+        close(fd);
+        INFO("client disconnected\n");
+    }
+
+    pthread_join(thread, NULL);
+out:
+    /* the bridge only stops when the base or the listener fails */
+    if (bridge.listener >= 0)
+        close(bridge.listener);
+    if (bridge.ant)
+        ant_destroy(bridge.ant);
+    return EXIT_FAILURE;
+}
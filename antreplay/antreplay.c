@@ -0,0 +1,590 @@
+/*
+ * This file is part of fitbitd.
+ *
+ * fitbitd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fitbitd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fitbitd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Replays an ANT capture taken with fitbitd --capture, either decoding it or
+ * feeding it back through libfitbit in place of the base.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <ant-capture.h>
+#include <ant-private.h>
+#include <fitbit.h>
+#include "util.h"
+
+#define LOG_TAG "antreplay"
+#include "log.h"
+
+typedef struct {
+    ant_capture_record_t *recs;
+    size_t nrecs;
+} capture_t;
+
+typedef enum {
+    REPLAY_OP_INFO = 0,         /* tracker info, run by libfitbit itself */
+    REPLAY_OP,
+    REPLAY_OP_SLEEP,
+} replay_op_type_t;
+
+typedef struct {
+    replay_op_type_t type;
+    uint8_t op[7];
+    uint8_t *payload;
+    size_t payload_sz;
+    uint32_t sleep;
+} replay_op_t;
+
+typedef struct {
+    replay_op_t *ops;
+    size_t nops, next;
+    int run, failed;
+} replay_sync_t;
+
+/*
+ * Transport replaying a capture in lockstep with what is written to it: data
+ * read by the base is returned once everything written before it in the
+ * capture has been written again, after the same delay as in the capture.
+ */
+typedef struct {
+    ant_t ant;
+    capture_t *cap;
+    bool fast;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    /* next RX record, how much of it has been read & the next TX record */
+    size_t rx_next, rx_off;
+    size_t tx_next;
+
+    /* time of the last write & the capture time it corresponds to */
+    struct timespec anchor;
+    uint64_t anchor_ts;
+
+    unsigned long writes, mismatched;
+} antreplay_t;
+
+static int load_capture(const char *filename, const char *base, capture_t *cap)
+{
+    ant_capture_record_t rec, *recs;
+    char name[sizeof(rec.name)];
+    size_t alloced = 0;
+    FILE *f;
+    int ret;
+
+    f = fopen(filename, "rb");
+    if (!f) {
+        ERR("failed to open %s\n", filename);
+        return -1;
+    }
+
+    CHAINERR_LTZ(ant_capture_read_header(f), err);
+
+    while (!(ret = ant_capture_read_record(f, &rec))) {
+        /* replay the first base in the capture unless told otherwise */
+        if (!base) {
+            snprintf(name, sizeof(name), "%s", rec.name);
+            base = name;
+        }
+        if (strcmp(rec.name, base)) {
+            free(rec.data);
+            continue;
+        }
+
+        if (cap->nrecs == alloced) {
+            alloced = alloced ? alloced * 2 : 256;
+            recs = realloc(cap->recs, alloced * sizeof(*recs));
+            if (!recs) {
+                ERR("failed to alloc records\n");
+                free(rec.data);
+                goto err;
+            }
+            cap->recs = recs;
+        }
+        cap->recs[cap->nrecs++] = rec;
+    }
+    if (ret < 0)
+        goto err;
+
+    fclose(f);
+
+    if (!cap->nrecs) {
+        ERR("no records to replay\n");
+        return -1;
+    }
+
+    INFO("replaying %d records from %s\n", (int)cap->nrecs, cap->recs[0].name);
+    return 0;
+err:
+    fclose(f);
+    return -1;
+}
+
+static void decode_capture(capture_t *cap)
+{
+    static const char *dirs[] = { "<<", ">>" };
+    unsigned long counts[2][256];
+    ant_decoder_t dec[2];
+    ant_capture_record_t *rec;
+    ant_message_t msgs[2], *msg;
+    size_t i, off, used;
+    int d, id, b;
+
+    memset(counts, 0, sizeof(counts));
+    memset(dec, 0, sizeof(dec));
+    ant_decoder_reset(&dec[ANT_CAPTURE_RX]);
+    ant_decoder_reset(&dec[ANT_CAPTURE_TX]);
+
+    for (i = 0; i < cap->nrecs; i++) {
+        rec = &cap->recs[i];
+        d = rec->dir ? ANT_CAPTURE_TX : ANT_CAPTURE_RX;
+
+        msg = &msgs[d];
+
+        for (off = 0; off < rec->len; off += used) {
+            if (!ant_decoder_feed(&dec[d], &rec->data[off], rec->len - off, &used, msg))
+                continue;
+
+            counts[d][msg->id]++;
+
+            printf("%12.6f %s 0x%02x", (rec->timestamp - cap->recs[0].timestamp) / 1e9,
+                   dirs[d], msg->id);
+            for (b = 0; b < msg->len; b++)
+                printf(" %02x", msg->data[b]);
+            printf("\n");
+        }
+    }
+
+    for (d = 0; d < 2; d++) {
+        printf("\n%s messages:\n", d == ANT_CAPTURE_RX ? "received" : "sent");
+        for (id = 0; id < 256; id++) {
+            if (counts[d][id])
+                printf("  0x%02x %lu\n", id, counts[d][id]);
+        }
+        printf("  skipped bytes %lu, bad checksums %lu\n",
+               dec[d].skipped, dec[d].bad_cksum);
+    }
+}
+
+/* gather the ops which were run on trackers, so they can be run again */
+static int parse_ops(capture_t *cap, replay_sync_t *sync)
+{
+    ant_decoder_t dec;
+    ant_message_t msg;
+    ant_capture_record_t *rec;
+    replay_op_t *op, *ops;
+    uint8_t burst[4096], *d;
+    size_t i, off, used, burst_len = 0, len;
+
+    memset(&dec, 0, sizeof(dec));
+    ant_decoder_reset(&dec);
+
+    for (i = 0; i < cap->nrecs; i++) {
+        rec = &cap->recs[i];
+        if (rec->dir != ANT_CAPTURE_TX)
+            continue;
+
+        for (off = 0; off < rec->len; off += used) {
+            if (!ant_decoder_feed(&dec, &rec->data[off], rec->len - off, &used, &msg))
+                continue;
+            if (msg.len != 9)
+                continue;
+            d = &msg.data[1];
+
+            if (msg.id == 0x50) {
+                /* payload bursts start with a header giving their length */
+                if (!(msg.data[0] & 0x60))
+                    burst_len = 0;
+                if (burst_len + 8 <= sizeof(burst)) {
+                    memcpy(&burst[burst_len], d, 8);
+                    burst_len += 8;
+                }
+                if (!(msg.data[0] & 0x80) || burst_len < 8 || burst[1] != 0x80 || !sync->nops)
+                    continue;
+
+                /* attach it to the op which asked for it, once */
+                op = &sync->ops[sync->nops - 1];
+                len = MIN(burst[2] | (burst[3] << 8), burst_len - 8);
+                if (op->type != REPLAY_OP || op->payload)
+                    continue;
+                op->payload = malloc(len);
+                if (!op->payload)
+                    return -1;
+                memcpy(op->payload, &burst[8], len);
+                op->payload_sz = len;
+                continue;
+            }
+
+            if (msg.id != 0x4f)
+                continue;
+
+            if (d[0] != 0x7f && ((d[0] & 0xf8) != 0x38 || d[1] == 0x70))
+                continue;
+            if (d[0] == 0x7f && d[1] != 0x03)
+                continue;
+
+            /* retried ops are retried by libfitbit again */
+            op = sync->nops ? &sync->ops[sync->nops - 1] : NULL;
+            if (d[0] != 0x7f && op && op->type != REPLAY_OP_SLEEP &&
+                !memcmp(op->op, &d[1], 7))
+                continue;
+
+            ops = realloc(sync->ops, (sync->nops + 1) * sizeof(*ops));
+            if (!ops)
+                return -1;
+            sync->ops = ops;
+            op = &sync->ops[sync->nops++];
+            memset(op, 0, sizeof(*op));
+
+            if (d[0] == 0x7f) {
+                op->type = REPLAY_OP_SLEEP;
+                op->sleep = d[7] * 15;
+            } else {
+                op->type = (d[1] == 0x24) ? REPLAY_OP_INFO : REPLAY_OP;
+                memcpy(op->op, &d[1], 7);
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* run the ops which followed this tracker's info in the capture */
+static void replay_sync_tracker(fitbit_t *fb, fitbit_tracker_info_t *tracker, void *user)
+{
+    replay_sync_t *sync = user;
+    uint8_t response[32768];
+    replay_op_t *op;
+    size_t len;
+
+    while (sync->next < sync->nops && sync->ops[sync->next].type != REPLAY_OP_INFO)
+        sync->next++;
+    sync->next++;
+
+    for (; sync->next < sync->nops; sync->next++) {
+        op = &sync->ops[sync->next];
+
+        if (op->type == REPLAY_OP_INFO)
+            break;
+
+        if (op->type == REPLAY_OP_SLEEP) {
+            fitbit_tracker_sleep(fb, op->sleep);
+            sync->next++;
+            break;
+        }
+
+        sync->run++;
+        if (fitbit_run_op(fb, op->op, op->payload, op->payload_sz, response, sizeof(response), &len)) {
+            ERR("op 0x%02x failed\n", op->op[0]);
+            sync->failed++;
+            continue;
+        }
+        DBG("op 0x%02x response %d bytes\n", op->op[0], (int)len);
+    }
+}
+
+static uint64_t replay_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static size_t replay_next_dir(capture_t *cap, size_t i, uint8_t dir)
+{
+    while (i < cap->nrecs && cap->recs[i].dir != dir)
+        i++;
+    return i;
+}
+
+static ssize_t replay_read(ant_t *ant, uint8_t *buf, size_t sz, int timeout_ms)
+{
+    antreplay_t *ar = (antreplay_t*)ant;
+    ant_capture_record_t *rec;
+    struct timespec deadline, wake;
+    uint64_t due, anchor;
+    size_t cpy;
+
+    ant_deadline_set(&deadline, timeout_ms);
+
+    pthread_mutex_lock(&ar->lock);
+
+    while (true) {
+        if (ar->rx_next >= ar->cap->nrecs) {
+            /* nothing more to read, end the replay */
+            ant->dead = true;
+            pthread_mutex_unlock(&ar->lock);
+            return -1;
+        }
+
+        wake = deadline;
+
+        /* wait for whatever was written before it to be written again */
+        if (ar->rx_next < ar->tx_next) {
+            rec = &ar->cap->recs[ar->rx_next];
+            if (ar->fast)
+                break;
+
+            anchor = (uint64_t)ar->anchor.tv_sec * 1000000000ULL + ar->anchor.tv_nsec;
+            due = anchor + (rec->timestamp - ar->anchor_ts);
+            if (replay_now() >= due)
+                break;
+
+            if (due < (uint64_t)wake.tv_sec * 1000000000ULL + wake.tv_nsec) {
+                wake.tv_sec = due / 1000000000ULL;
+                wake.tv_nsec = due % 1000000000ULL;
+            }
+        }
+
+        if (!ant_deadline_remaining(&deadline)) {
+            pthread_mutex_unlock(&ar->lock);
+            return -1;
+        }
+        pthread_cond_timedwait(&ar->cond, &ar->lock, &wake);
+    }
+
+    cpy = MIN(sz, rec->len - ar->rx_off);
+    memcpy(buf, &rec->data[ar->rx_off], cpy);
+    ar->rx_off += cpy;
+    if (ar->rx_off == rec->len) {
+        ar->rx_off = 0;
+        ar->rx_next = replay_next_dir(ar->cap, ar->rx_next + 1, ANT_CAPTURE_RX);
+    }
+
+    pthread_mutex_unlock(&ar->lock);
+    return cpy;
+}
+
+static ssize_t replay_write(ant_t *ant, uint8_t *buf, size_t sz)
+{
+    antreplay_t *ar = (antreplay_t*)ant;
+    ant_capture_record_t *rec;
+
+    pthread_mutex_lock(&ar->lock);
+
+    ar->writes++;
+
+    if (ar->tx_next < ar->cap->nrecs) {
+        rec = &ar->cap->recs[ar->tx_next];
+        if (rec->len != sz || memcmp(rec->data, buf, sz))
+            ar->mismatched++;
+
+        /* what follows is timed relative to this write */
+        clock_gettime(CLOCK_MONOTONIC, &ar->anchor);
+        ar->anchor_ts = rec->timestamp;
+
+        ar->tx_next = replay_next_dir(ar->cap, ar->tx_next + 1, ANT_CAPTURE_TX);
+        pthread_cond_broadcast(&ar->cond);
+    } else {
+        ar->mismatched++;
+    }
+
+    pthread_mutex_unlock(&ar->lock);
+    return sz;
+}
+
+static void replay_destroy(ant_t *ant)
+{
+    antreplay_t *ar = (antreplay_t*)ant;
+
+    pthread_cond_destroy(&ar->cond);
+    pthread_mutex_destroy(&ar->lock);
+    free(ar);
+}
+
+static antreplay_t *replay_create(capture_t *cap, bool fast)
+{
+    pthread_condattr_t attr;
+    antreplay_t *ar;
+
+    ar = calloc(1, sizeof(*ar));
+    if (!ar)
+        return NULL;
+
+    ant_init(&ar->ant);
+    snprintf(ar->ant.name, sizeof(ar->ant.name), "%.9s", cap->recs[0].name);
+    ar->ant.destroy = replay_destroy;
+    ar->ant.read = replay_read;
+    ar->ant.write = replay_write;
+
+    ar->cap = cap;
+    ar->fast = fast;
+    ar->rx_next = replay_next_dir(cap, 0, ANT_CAPTURE_RX);
+    ar->tx_next = replay_next_dir(cap, 0, ANT_CAPTURE_TX);
+
+    /* data read before anything was written is timed from the start */
+    clock_gettime(CLOCK_MONOTONIC, &ar->anchor);
+    ar->anchor_ts = cap->recs[0].timestamp;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&ar->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&ar->lock, NULL);
+
+    return ar;
+}
+
+static int replay_capture(capture_t *cap, bool fast, int sessions)
+{
+    replay_sync_t sync;
+    antreplay_t *ar;
+    fitbit_t *fb;
+    uint64_t start, end;
+    unsigned long writes, mismatched;
+    size_t left;
+    int synced;
+
+    memset(&sync, 0, sizeof(sync));
+    if (parse_ops(cap, &sync)) {
+        ERR("failed to parse ops\n");
+        return -1;
+    }
+
+    ar = replay_create(cap, fast);
+    if (!ar) {
+        ERR("failed to create replay\n");
+        return -1;
+    }
+
+    fb = fitbit_create(&ar->ant);
+    if (!fb) {
+        replay_destroy(&ar->ant);
+        return -1;
+    }
+    fitbit_set_max_sessions(fb, sessions);
+
+    start = replay_now();
+    synced = fitbit_sync_trackers(fb, replay_sync_tracker, &sync);
+    end = replay_now();
+
+    pthread_mutex_lock(&ar->lock);
+    writes = ar->writes;
+    mismatched = ar->mismatched;
+    left = cap->nrecs - MIN(ar->rx_next, ar->tx_next);
+    pthread_mutex_unlock(&ar->lock);
+
+    /* the sync fails once the replay ends, which is expected */
+    printf("sync returned %d after %.3fs\n", synced, (end - start) / 1e9);
+    printf("ran %d ops, %d failed\n", sync.run, sync.failed);
+    printf("%lu writes, %lu differed from the capture\n", writes, mismatched);
+    printf("%d records not replayed\n", (int)left);
+
+    fitbit_destroy(fb);
+
+    while (sync.nops--)
+        free(sync.ops[sync.nops].payload);
+    free(sync.ops);
+
+    return 0;
+}
+
+static void print_usage(FILE *f)
+{
+    fprintf(f, "Usage: antreplay <args> <capture>\n"
+          "\n"
+          "Where args is any of:\n"
+          "  --help             Output this message\n"
+          "  --base <name>      Replay the base <name>, rather than the first captured\n"
+          "  --sync             Sync trackers with libfitbit rather than decoding\n"
+          "  --fast             Don't wait for the captured delays when syncing\n"
+          "  --sessions <n>     Sync up to <n> trackers at once, which may reorder\n"
+          "                     traffic & cause the replay to diverge\n");
+}
+
+int main(int argc, char *argv[])
+{
+    capture_t cap = { NULL, 0 };
+    char *opt_base = NULL, *opt_capture = NULL;
+    bool opt_sync = false, opt_fast = false;
+    int opt_sessions = 1;
+    int argi, ret = EXIT_FAILURE;
+
+    for (argi = 1; argi < argc; argi++) {
+        if (!strcmp(argv[argi], "--help")) {
+            print_usage(stdout);
+            return EXIT_SUCCESS;
+        }
+
+        if (!strcmp(argv[argi], "--base")) {
+            if (++argi >= argc) {
+                ERR("--base requires a name\n");
+                goto out;
+            }
+            opt_base = argv[argi];
+            continue;
+        }
+
+        if (!strcmp(argv[argi], "--sync")) {
+            opt_sync = true;
+            continue;
+        }
+
+        if (!strcmp(argv[argi], "--fast")) {
+            opt_fast = true;
+            continue;
+        }
+
+        if (!strcmp(argv[argi], "--sessions")) {
+            if (++argi >= argc) {
+                ERR("--sessions requires a number\n");
+                goto out;
+            }
+            opt_sessions = atoi(argv[argi]);
+            continue;
+        }
+
+        if (argv[argi][0] != '-' && !opt_capture) {
+            opt_capture = argv[argi];
+            continue;
+        }
+
+        ERR("Unknown argument '%s'\n", argv[argi]);
+        print_usage(stderr);
+        goto out;
+    }
+
+    if (!opt_capture) {
+        print_usage(stderr);
+        goto out;
+    }
+
+    if (load_capture(opt_capture, opt_base, &cap))
+        goto out;
+
+    if (opt_sync) {
+        if (replay_capture(&cap, opt_fast, opt_sessions))
+            goto out;
+    } else {
+        decode_capture(&cap);
+    }
+
+    ret = EXIT_SUCCESS;
+out:
+    while (cap.nrecs--)
+        free(cap.recs[cap.nrecs].data);
+    free(cap.recs);
+    return ret;
+}
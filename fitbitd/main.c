@@ -23,13 +23,17 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <sched.h>
 #include <unistd.h>
 #include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 #include <curl/curl.h>
 #include <mxml.h>
 
+#include <ant-net.h>
+#include <ant-serial.h>
 #include <fitbit.h>
 #include "base64.h"
 #include "control.h"
@@ -86,6 +90,84 @@ static void found_fitbit_base(fitbit_t *fb, void *user)
     *listptr = new;
 }
 
+/* bases on a tty can't be discovered, so are opened explicitly */
+static fitbit_t *open_serial_base(const char *path, fitbit_list_t **listptr)
+{
+    fitbit_t *fb;
+    ant_t *ant;
+
+    ant = ant_serial_open(path, ANT_SERIAL_BAUD_DEFAULT);
+    if (!ant)
+        return NULL;
+
+    fb = fitbit_create(ant);
+    if (!fb) {
+        ant_destroy(ant);
+        return NULL;
+    }
+
+    found_fitbit_base(fb, listptr);
+    return fb;
+}
+
+/* bases reached through antbridge, given with --remote */
+#define MAX_REMOTES 64
+
+typedef struct {
+    char *host;
+    char *port;
+    fitbit_t *fb;
+} remote_base_t;
+
+/* split host[:port] or [host]:port in place, port is NULL if not given */
+static int parse_remote(char *addr, remote_base_t *remote)
+{
+    char *sep;
+
+    remote->port = NULL;
+    remote->fb = NULL;
+
+    if (addr[0] == '[') {
+        /* bracketed IPv6 address */
+        remote->host = addr + 1;
+        sep = strchr(addr, ']');
+        if (!sep || (sep[1] && sep[1] != ':'))
+            return -1;
+        *sep++ = 0;
+    } else {
+        remote->host = addr;
+        sep = strchr(addr, ':');
+        if (sep != strrchr(addr, ':'))
+            return -1;
+    }
+
+    if (sep && *sep == ':') {
+        *sep = 0;
+        remote->port = sep + 1;
+    }
+
+    return remote->host[0] ? 0 : -1;
+}
+
+static fitbit_t *open_remote_base(remote_base_t *remote, fitbit_list_t **listptr)
+{
+    fitbit_t *fb;
+    ant_t *ant;
+
+    ant = ant_net_connect(remote->host, remote->port);
+    if (!ant)
+        return NULL;
+
+    fb = fitbit_create(ant);
+    if (!fb) {
+        ant_destroy(ant);
+        return NULL;
+    }
+
+    found_fitbit_base(fb, listptr);
+    return fb;
+}
+
 static size_t upload_response_write(void *buf, size_t sz, size_t num, void *user)
 {
     upload_response_t *resp = user;
@@ -515,6 +597,32 @@ out:
         curl_easy_cleanup(curl);
 }
 
+/* log how long each kind of exchange with the base took */
+static void log_latency(fitbit_t *fb)
+{
+#if DEBUG == 1
+    ant_latency_t lat;
+    int id, bucket;
+
+    for (id = 0; id < 256; id++) {
+        fitbit_get_latency(fb, id, &lat);
+        if (!lat.count && !lat.timeouts)
+            continue;
+
+        DBG("0x%02x: %lu exchanges, avg %lluus, max %luus, %lu timeouts, %lu retries\n",
+            id, lat.count, lat.count ? lat.total_us / lat.count : 0, lat.max_us,
+            lat.timeouts, lat.retries);
+    }
+
+    /* how late the base's reader woke, the last bucket with any is the worst */
+    fitbit_get_jitter(fb, &lat);
+    for (bucket = ANT_LATENCY_BUCKETS - 1; bucket > 0 && !lat.buckets[bucket]; bucket--);
+    DBG("jitter: %lu wakeups, avg %lluus, max %luus, %lu over %uus\n",
+        lat.count, lat.count ? lat.total_us / lat.count : 0, lat.max_us,
+        lat.buckets[bucket], bucket ? ANT_LATENCY_BUCKET0_US << (bucket - 1) : 0);
+#endif
+}
+
 static int daemonize(void)
 {
     pid_t pid, sid;
@@ -568,13 +676,26 @@ static void print_usage(FILE *f)
           "  --no-dbus          Disable DBUS control\n"
           "  --dump <dir>       Dump all sync operations to the directory <dir>\n"
           "  --log <filename>   Write log messages to <filename>\n"
+          "  --sessions <n>     Sync up to <n> trackers at once per base\n"
+          "  --advanced-burst   Use ANT advanced bursts where the base supports them\n"
+          "  --capture <file>   Record all ANT traffic to <file>\n"
+          "  --serial <tty>     Also sync using the ANT device attached to <tty>\n"
+          "  --remote <addr>    Also sync using the base exposed by antbridge at\n"
+          "                     <addr>, as host[:port]. May be given repeatedly\n"
+          "  --rt-priority <n>  Read from bases on threads with SCHED_FIFO priority <n>\n"
+          "  --mlock            Lock fitbitd's memory, so that it's never paged out\n"
           "  --exit             Request that fitbitd exits\n");
 }
 
 int main(int argc, char *argv[])
 {
     fitbit_list_t *fblist = NULL, *curr;
+    fitbit_t *serial_fb = NULL;
+    remote_base_t remotes[MAX_REMOTES];
+    int nremotes = 0, i;
     fitbitd_prefs_t *prefs = NULL;
+    ant_context_t *ant_ctx = NULL;
+    ant_capture_t *capture = NULL;
     int argi, ret = EXIT_FAILURE;
     int synced, lockfile = -1;
     bool opt_version = false;
@@ -582,8 +703,14 @@ int main(int argc, char *argv[])
     bool opt_nodbus = false;
     bool opt_exit = false;
     bool opt_help = false;
+    bool opt_advanced_burst = false;
     char *opt_dump = NULL;
     char *opt_log = NULL;
+    char *opt_capture = NULL;
+    char *opt_serial = NULL;
+    int opt_sessions = 0;
+    int opt_rt_priority = 0;
+    bool opt_mlock = false;
 
     for (argi = 1; argi < argc; argi++) {
         if (!strcmp(argv[argi], "--version")) {
@@ -629,6 +756,78 @@ int main(int argc, char *argv[])
             continue;
         }
 
+        if (!strcmp(argv[argi], "--capture")) {
+            if (++argi >= argc) {
+                ERR("--capture requires filename\n");
+                goto out;
+            }
+            opt_capture = argv[argi];
+            continue;
+        }
+
+        if (!strcmp(argv[argi], "--serial")) {
+            if (++argi >= argc) {
+                ERR("--serial requires a tty\n");
+                goto out;
+            }
+            opt_serial = argv[argi];
+            continue;
+        }
+
+        if (!strcmp(argv[argi], "--remote")) {
+            if (++argi >= argc) {
+                ERR("--remote requires an address\n");
+                goto out;
+            }
+            if (nremotes >= MAX_REMOTES) {
+                ERR("too many remote bases\n");
+                goto out;
+            }
+            if (parse_remote(argv[argi], &remotes[nremotes])) {
+                ERR("invalid remote address '%s'\n", argv[argi]);
+                goto out;
+            }
+            nremotes++;
+            continue;
+        }
+
+        if (!strcmp(argv[argi], "--sessions")) {
+            if (++argi >= argc) {
+                ERR("--sessions requires a number\n");
+                goto out;
+            }
+            opt_sessions = atoi(argv[argi]);
+            if (opt_sessions < 1) {
+                ERR("invalid session count '%s'\n", argv[argi]);
+                goto out;
+            }
+            continue;
+        }
+
+        if (!strcmp(argv[argi], "--advanced-burst")) {
+            opt_advanced_burst = true;
+            continue;
+        }
+
+        if (!strcmp(argv[argi], "--rt-priority")) {
+            if (++argi >= argc) {
+                ERR("--rt-priority requires a number\n");
+                goto out;
+            }
+            opt_rt_priority = atoi(argv[argi]);
+            if (opt_rt_priority < sched_get_priority_min(SCHED_FIFO) ||
+                opt_rt_priority > sched_get_priority_max(SCHED_FIFO)) {
+                ERR("invalid real time priority '%s'\n", argv[argi]);
+                goto out;
+            }
+            continue;
+        }
+
+        if (!strcmp(argv[argi], "--mlock")) {
+            opt_mlock = true;
+            continue;
+        }
+
         ERR("Unknown argument '%s'\n", argv[argi]);
         print_usage(stderr);
         goto out;
@@ -671,6 +870,15 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (opt_sessions)
+        prefs->max_sessions = opt_sessions;
+    if (opt_advanced_burst)
+        prefs->advanced_burst = true;
+    if (opt_rt_priority)
+        prefs->rt_priority = opt_rt_priority;
+    if (opt_mlock)
+        prefs->lock_memory = true;
+
     mkfiledir(prefs->lock_filename);
     lockfile = open(prefs->lock_filename, O_RDWR | O_CREAT, 0640);
     if (lockfile < 0) {
@@ -682,24 +890,62 @@ int main(int argc, char *argv[])
         goto out;
     }
 
+    /* opened before daemonizing, so relative paths work */
+    if (opt_capture) {
+        capture = ant_capture_open(opt_capture);
+        if (!capture)
+            goto out;
+    }
+
     if (!opt_nodaemon && daemonize())
         goto out;
 
+    /* memory locks aren't inherited, so this follows daemonizing */
+    if (prefs->lock_memory && mlockall(MCL_CURRENT | MCL_FUTURE))
+        ERR("failed to lock memory %d\n", errno);
+
     if (opt_log) {
       if (!freopen(opt_log, "w", stderr))
          ERR("failed to freopen stderr for log %s\n", opt_log);
       setvbuf(stderr, NULL, _IONBF, 0);
     }
 
+    /* trackers are synced from multiple threads */
+    if (curl_global_init(CURL_GLOBAL_ALL)) {
+        ERR("failed to init curl\n");
+        goto out;
+    }
+
     if (!opt_nodbus && control_start()) {
         ERR("failed to start control\n");
         goto out;
     }
 
+    ant_ctx = ant_context_create();
+    if (!ant_ctx) {
+        ERR("failed to create ANT context\n");
+        goto out;
+    }
+
     while (!control_exited()) {
-        fitbit_find_bases(found_fitbit_base, &fblist);
+        fitbit_find_bases_ctx(ant_ctx, found_fitbit_base, &fblist);
+
+        /* open the serial base again if it was lost */
+        if (opt_serial && !serial_fb)
+            serial_fb = open_serial_base(opt_serial, &fblist);
+
+        /* likewise any remote bases whose bridges have come back */
+        for (i = 0; i < nremotes; i++) {
+            if (!remotes[i].fb)
+                remotes[i].fb = open_remote_base(&remotes[i], &fblist);
+        }
 
         for (curr = fblist; curr; curr = curr->next) {
+            fitbit_set_max_sessions(curr->fb, prefs->max_sessions);
+            fitbit_set_advanced_burst(curr->fb, prefs->advanced_burst);
+            fitbit_start_io_thread(curr->fb, prefs->rt_priority);
+            if (capture)
+                fitbit_set_capture(curr->fb, capture);
             synced = fitbit_sync_trackers(curr->fb, sync_tracker, prefs);
 
             if (synced < 0) {
@@ -717,6 +963,12 @@ int main(int argc, char *argv[])
                 }
 
                 /* cleanup */
+                if (curr->fb == serial_fb)
+                    serial_fb = NULL;
+                for (i = 0; i < nremotes; i++) {
+                    if (curr->fb == remotes[i].fb)
+                        remotes[i].fb = NULL;
+                }
                 fitbit_destroy(curr->fb);
                 free(curr);
 
@@ -727,22 +979,29 @@ int main(int argc, char *argv[])
                 break;
 
             DBG("synced %d trackers\n", synced);
+            log_latency(curr->fb);
         }
 
         devstate_clean(get_uptime() - ((prefs->sync_delay * 3) / 2));
+        /* scan again after scan_delay, or as soon as a new base arrives */
         if (!control_exited())
-           sleep(prefs->scan_delay);
+           fitbit_wait_for_bases_ctx(ant_ctx, prefs->scan_delay * 1000);
     }
 
     ret = EXIT_SUCCESS;
 
 out:
     control_stop();
+    curl_global_cleanup();
     while (fblist) {
         fitbit_list_t *curr = fblist;
         fblist = curr->next;
         fitbit_destroy(curr->fb);
     }
+    if (ant_ctx)
+        ant_context_destroy(ant_ctx);
+    if (capture)
+        ant_capture_close(capture);
     if (prefs)
         prefs_destroy(prefs);
     if (lockfile >= 0)
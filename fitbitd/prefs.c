@@ -99,6 +99,10 @@ fitbitd_prefs_t *prefs_create(void)
 
     prefs->scan_delay = 10;
     prefs->sync_delay = 15 * 60;
+    prefs->max_sessions = 3;
+    prefs->advanced_burst = false;
+    prefs->rt_priority = 0;
+    prefs->lock_memory = false;
 
     return prefs;
 
@@ -18,11 +18,16 @@
 #ifndef __prefs_h__
 #define __prefs_h__
 
+#include <stdbool.h>
 #include <stdint.h>
 
 typedef struct {
     uint32_t scan_delay;
     uint32_t sync_delay;
+    uint32_t max_sessions;
+    bool advanced_burst;
+    int rt_priority;
+    bool lock_memory;
     char *upload_url;
     char *client_id;
     char *client_version;
@@ -0,0 +1,320 @@
+/*
+ * This file is part of fitbitd.
+ *
+ * fitbitd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fitbitd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fitbitd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "ant-capture.h"
+#include "ant-private.h"
+#include "util.h"
+
+#define LOG_TAG "ant-capture"
+#include "log.h"
+
+/* size of each of the buffers records are gathered in before being written */
+#define ANT_CAPTURE_BUF_SZ 65536
+
+/* size of a record without the name or data */
+#define ANT_CAPTURE_RECORD_HDR 12
+
+/* buffered records are written at least this often, in ns */
+#define ANT_CAPTURE_FLUSH_NS 1000000000ULL
+
+/*
+ * Records from any number of devices, each of which may be used from several
+ * threads, so lock protects everything below. Records are gathered in
+ * bufs[fill] whilst the writer thread writes out the other buffer, so that
+ * recording never waits for the disk. If both buffers fill up before the
+ * writer is done, records are dropped.
+ */
+struct ant_capture_s {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t writer;
+    int fd;
+    bool failed, closing;
+
+    uint8_t bufs[2][ANT_CAPTURE_BUF_SZ];
+    size_t lens[2];
+    int fill;
+    bool writing;
+    uint64_t last_flush;
+    unsigned long dropped;
+};
+
+static void put_le16(uint8_t *buf, uint16_t val)
+{
+    buf[0] = val;
+    buf[1] = val >> 8;
+}
+
+static void put_le64(uint8_t *buf, uint64_t val)
+{
+    int i;
+
+    for (i = 0; i < 8; i++)
+        buf[i] = val >> (i * 8);
+}
+
+static uint16_t get_le16(const uint8_t *buf)
+{
+    return buf[0] | (buf[1] << 8);
+}
+
+static uint64_t get_le64(const uint8_t *buf)
+{
+    uint64_t val = 0;
+    int i;
+
+    for (i = 7; i >= 0; i--)
+        val = (val << 8) | buf[i];
+
+    return val;
+}
+
+static int ant_capture_write(int fd, const uint8_t *buf, size_t len)
+{
+    size_t done = 0;
+    ssize_t ret;
+
+    while (done < len) {
+        ret = write(fd, &buf[done], len - done);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+        done += ret;
+    }
+
+    return 0;
+}
+
+/* writes out buffers handed over by ant_capture_flush until closed */
+static void *ant_capture_writer(void *user)
+{
+    ant_capture_t *cap = user;
+    int idx, ret;
+
+    pthread_mutex_lock(&cap->lock);
+
+    while (true) {
+        while (!cap->writing && !cap->closing)
+            pthread_cond_wait(&cap->cond, &cap->lock);
+        if (!cap->writing)
+            break;
+
+        idx = !cap->fill;
+        pthread_mutex_unlock(&cap->lock);
+        ret = ant_capture_write(cap->fd, cap->bufs[idx], cap->lens[idx]);
+        pthread_mutex_lock(&cap->lock);
+
+        if (ret) {
+            ERR("capture write failed, capture stopped\n");
+            cap->failed = true;
+        }
+        cap->lens[idx] = 0;
+        cap->writing = false;
+        pthread_cond_broadcast(&cap->cond);
+    }
+
+    pthread_mutex_unlock(&cap->lock);
+    return NULL;
+}
+
+/*
+ * Hand the records gathered so far to the writer thread & gather into the
+ * other buffer. Fails if the writer is still busy with the other buffer.
+ * Called with the lock held.
+ */
+static int ant_capture_flush(ant_capture_t *cap)
+{
+    if (cap->writing)
+        return -1;
+    if (!cap->lens[cap->fill])
+        return 0;
+
+    cap->fill = !cap->fill;
+    cap->writing = true;
+    pthread_cond_broadcast(&cap->cond);
+    return 0;
+}
+
+ant_capture_t *ant_capture_open(const char *filename)
+{
+    ant_capture_t *cap;
+
+    cap = calloc(1, sizeof(*cap));
+    if (!cap) {
+        ERR("failed to alloc capture\n");
+        return NULL;
+    }
+
+    cap->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (cap->fd < 0) {
+        ERR("failed to open capture %s\n", filename);
+        goto err_free;
+    }
+
+    pthread_mutex_init(&cap->lock, NULL);
+    pthread_cond_init(&cap->cond, NULL);
+
+    memcpy(cap->bufs[0], ANT_CAPTURE_MAGIC, strlen(ANT_CAPTURE_MAGIC));
+    cap->lens[0] = strlen(ANT_CAPTURE_MAGIC);
+    put_le16(&cap->bufs[0][cap->lens[0]], ANT_CAPTURE_VERSION);
+    cap->lens[0] += 2;
+
+    if (pthread_create(&cap->writer, NULL, ant_capture_writer, cap)) {
+        ERR("failed to create capture writer\n");
+        goto err_close;
+    }
+
+    return cap;
+err_close:
+    pthread_cond_destroy(&cap->cond);
+    pthread_mutex_destroy(&cap->lock);
+    close(cap->fd);
+err_free:
+    free(cap);
+    return NULL;
+}
+
+void ant_capture_close(ant_capture_t *cap)
+{
+    pthread_mutex_lock(&cap->lock);
+
+    /* the last records have to wait for the writer to be free */
+    while (cap->writing)
+        pthread_cond_wait(&cap->cond, &cap->lock);
+    if (!cap->failed)
+        ant_capture_flush(cap);
+
+    cap->closing = true;
+    pthread_cond_broadcast(&cap->cond);
+    pthread_mutex_unlock(&cap->lock);
+
+    pthread_join(cap->writer, NULL);
+
+    if (cap->dropped)
+        ERR("capture dropped %lu records\n", cap->dropped);
+
+    close(cap->fd);
+    pthread_cond_destroy(&cap->cond);
+    pthread_mutex_destroy(&cap->lock);
+    free(cap);
+}
+
+void ant_capture_record(ant_capture_t *cap, const char *name, uint8_t dir, const uint8_t *data, size_t len)
+{
+    struct timespec ts;
+    size_t name_len, rec_len;
+    uint64_t now;
+    uint8_t *rec;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+    name_len = strlen(name);
+    rec_len = ANT_CAPTURE_RECORD_HDR + name_len + len;
+    ASSERT(rec_len <= ANT_CAPTURE_BUF_SZ);
+
+    pthread_mutex_lock(&cap->lock);
+
+    if (cap->failed)
+        goto out;
+
+    if (cap->lens[cap->fill] + rec_len > ANT_CAPTURE_BUF_SZ && ant_capture_flush(cap)) {
+        cap->dropped++;
+        goto out;
+    }
+
+    rec = &cap->bufs[cap->fill][cap->lens[cap->fill]];
+    put_le64(&rec[0], now);
+    rec[8] = dir;
+    rec[9] = name_len;
+    put_le16(&rec[10], len);
+    memcpy(&rec[ANT_CAPTURE_RECORD_HDR], name, name_len);
+    memcpy(&rec[ANT_CAPTURE_RECORD_HDR + name_len], data, len);
+    cap->lens[cap->fill] += rec_len;
+
+    /* don't hold on to records for long in case we don't exit cleanly */
+    if (now - cap->last_flush >= ANT_CAPTURE_FLUSH_NS && !ant_capture_flush(cap))
+        cap->last_flush = now;
+
+out:
+    pthread_mutex_unlock(&cap->lock);
+}
+
+int ant_capture_read_header(FILE *f)
+{
+    uint8_t hdr[8];
+
+    if (fread(hdr, sizeof(hdr), 1, f) != 1)
+        goto err;
+    if (memcmp(hdr, ANT_CAPTURE_MAGIC, strlen(ANT_CAPTURE_MAGIC)))
+        goto err;
+    if (get_le16(&hdr[6]) != ANT_CAPTURE_VERSION) {
+        ERR("unsupported capture version %d\n", get_le16(&hdr[6]));
+        return -1;
+    }
+
+    return 0;
+err:
+    ERR("not an ANT capture\n");
+    return -1;
+}
+
+/*
+ * Read the next record, whose data is malloced & must be freed by the caller.
+ * Returns 1 at the end of the capture.
+ */
+int ant_capture_read_record(FILE *f, ant_capture_record_t *rec)
+{
+    uint8_t hdr[ANT_CAPTURE_RECORD_HDR], name[256];
+    size_t name_len;
+
+    if (fread(hdr, sizeof(hdr), 1, f) != 1)
+        return feof(f) ? 1 : -1;
+
+    rec->timestamp = get_le64(&hdr[0]);
+    rec->dir = hdr[8];
+    name_len = hdr[9];
+    rec->len = get_le16(&hdr[10]);
+
+    if (name_len && fread(name, name_len, 1, f) != 1)
+        goto err;
+    name_len = MIN(name_len, sizeof(rec->name) - 1);
+    memcpy(rec->name, name, name_len);
+    rec->name[name_len] = 0;
+
+    rec->data = malloc(rec->len ? rec->len : 1);
+    if (!rec->data)
+        goto err;
+    if (rec->len && fread(rec->data, rec->len, 1, f) != 1) {
+        free(rec->data);
+        goto err;
+    }
+
+    return 0;
+err:
+    ERR("truncated capture record\n");
+    return -1;
+}
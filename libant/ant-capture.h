@@ -0,0 +1,58 @@
+/*
+ * This file is part of fitbitd.
+ *
+ * fitbitd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fitbitd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fitbitd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __ant_capture_h__
+#define __ant_capture_h__
+
+#include <stdint.h>
+#include <stdio.h>
+#include "ant.h"
+
+/*
+ * A capture file is ANT_CAPTURE_MAGIC followed by a 16 bit version, then a
+ * record for each read from or write to a device:
+ *
+ *   u64 timestamp, CLOCK_MONOTONIC ns
+ *   u8  direction, ANT_CAPTURE_RX or ANT_CAPTURE_TX
+ *   u8  length of the device name
+ *   u16 length of the data
+ *   device name, not NUL terminated
+ *   data
+ *
+ * All values are little endian. The data is the raw bytes of the read or
+ * write, rather than a decoded message, so a record may hold several messages
+ * or part of one, & garbage or corrupt messages are captured as they were.
+ * ant_decoder_feed recovers the messages, as antreplay does.
+ */
+#define ANT_CAPTURE_MAGIC "ANTCAP"
+#define ANT_CAPTURE_VERSION 1
+
+#define ANT_CAPTURE_RX 0
+#define ANT_CAPTURE_TX 1
+
+typedef struct {
+    uint64_t timestamp;
+    uint8_t dir;
+    char name[16];
+    uint16_t len;
+    uint8_t *data;
+} ant_capture_record_t;
+
+int ant_capture_read_header(FILE *f);
+int ant_capture_read_record(FILE *f, ant_capture_record_t *rec);
+
+#endif /* __ant_capture_h__ */
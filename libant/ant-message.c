@@ -27,28 +27,22 @@
 #define LOG_TAG "ant-message"
 #include "log.h"
 
+void ant_message_init(ant_message_t *msg, uint8_t id, uint8_t len)
+{
+    msg->id = id;
+    msg->len = len;
+}
+
 ant_message_t *ant_message_create(uint8_t id, uint8_t len)
 {
     ant_message_t *msg;
 
-    msg = calloc(1, sizeof(*msg));
+    msg = malloc(sizeof(*msg));
     if (!msg)
-        goto oom_msg;
-
-    msg->id = id;
-    msg->len = len;
-
-    if (len) {
-        msg->data = malloc(len);
-        if (!msg->data)
-            goto oom_data;
-    }
+        return NULL;
 
+    ant_message_init(msg, id, len);
     return msg;
-oom_data:
-    free(msg);
-oom_msg:
-    return NULL;
 }
 
 ant_message_t *ant_message_vcreate(uint8_t id, ...)
@@ -83,7 +77,6 @@ ant_message_t *ant_message_vcreate(uint8_t id, ...)
 
 void ant_message_destroy(ant_message_t *msg)
 {
-    free(msg->data);
     free(msg);
 }
 
@@ -112,84 +105,72 @@ int ant_message_encode(ant_message_t *msg, uint8_t *buf, size_t sz, size_t *len)
     return 0;
 }
 
-ant_message_t *ant_message_decode(uint8_t *buf, size_t sz, size_t *len)
+void ant_decoder_reset(ant_decoder_t *dec)
 {
-    uint8_t *dat = buf, msgid, *msgdata, cksum;
-    size_t rem = sz, datalen, skipped = 0;
-    ant_message_t *msg;
-    int i;
-
-    if (len)
-        *len = 0;
-
-    /* find SYNC */
-    if (rem < 1) {
-        DBG("missing SYNC\n");
-        return NULL;
-    }
-    while (rem >= 1 && *dat != 0xa4) {
-        dat++;
-        rem--;
-        skipped++;
-    }
-    if (len)
-        *len = skipped;
-    if (skipped) {
-        DBG("skipped %d bytes\n", (int)skipped);
-    }
-
-    if (rem < 1 || *dat != 0xa4) {
-        DBG("missing or invalid SYNC\n");
-        return NULL;
-    }
-    dat++; rem--;
-
-    /* get message length */
-    if (rem < 1) {
-        DBG("missing length\n");
-        return NULL;
-    }
-    datalen = *dat;
-    dat++; rem--;
-
-    /* get message ID */
-    if (rem < 1) {
-        DBG("missing ID\n");
-        return NULL;
-    }
-    msgid = *dat;
-    dat++; rem--;
-
-    /* check message length */
-    if (rem < datalen) {
-        DBG("missing data\n");
-        return NULL;
-    }
-    msgdata = dat;
-    dat += datalen; rem -= datalen;
-
-    /* checksum */
-    if (rem < 1) {
-        DBG("missing checksum\n");
-        return NULL;
-    }
-
-    if (len)
-        *len = skipped + 4 + datalen;
+    dec->state = ANT_DECODE_SYNC;
+    dec->cksum = 0;
+    dec->pos = 0;
+}
 
-    /* check checksum */
-    cksum = 0;
-    for (i = 0; i < (sz - rem); i++)
-        cksum ^= buf[i];
-    if (cksum != *dat) {
-        DBG("invalid checksum %02x vs %02x\n", *dat, cksum);
-        return NULL;
+bool ant_decoder_feed(ant_decoder_t *dec, const uint8_t *buf, size_t sz, size_t *used, ant_message_t *msg)
+{
+    const uint8_t *dat = buf, *end = buf + sz;
+    bool complete = false;
+    size_t cpy;
+
+    while (dat < end) {
+        switch (dec->state) {
+        case ANT_DECODE_SYNC:
+            if (*dat != 0xa4) {
+                dec->skipped++;
+                dat++;
+                continue;
+            }
+            dec->cksum = *dat++;
+            dec->state = ANT_DECODE_LEN;
+            continue;
+
+        case ANT_DECODE_LEN:
+            msg->len = *dat;
+            dec->cksum ^= *dat++;
+            dec->state = ANT_DECODE_ID;
+            continue;
+
+        case ANT_DECODE_ID:
+            msg->id = *dat;
+            dec->cksum ^= *dat++;
+            dec->pos = 0;
+            dec->state = msg->len ? ANT_DECODE_DATA : ANT_DECODE_CKSUM;
+            continue;
+
+        case ANT_DECODE_DATA:
+            /* take as much of the payload as is available at once */
+            cpy = MIN((size_t)(end - dat), (size_t)(msg->len - dec->pos));
+            memcpy(&msg->data[dec->pos], dat, cpy);
+            dec->pos += cpy;
+            while (cpy--)
+                dec->cksum ^= *dat++;
+            if (dec->pos == msg->len)
+                dec->state = ANT_DECODE_CKSUM;
+            continue;
+
+        case ANT_DECODE_CKSUM:
+            dec->state = ANT_DECODE_SYNC;
+            if (dec->cksum != *dat) {
+                /* resync from the byte following the bad message */
+                DBG("invalid checksum %02x vs %02x\n", *dat, dec->cksum);
+                dec->bad_cksum++;
+                dat++;
+                continue;
+            }
+            dat++;
+            complete = true;
+            goto out;
+        }
     }
 
-    msg = ant_message_create(msgid, datalen);
-    if (!msg)
-        return NULL;
-
-    memcpy(msg->data, msgdata, datalen);
-    return msg;
+out:
+    if (used)
+        *used = dat - buf;
+    return complete;
 }
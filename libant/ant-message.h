@@ -18,17 +18,50 @@
 #ifndef __ant_message_h__
 #define __ant_message_h__
 
+/* maximum length of the data carried by a message */
+#define ANT_MESSAGE_MAX_DATA 255
+
+/* maximum length of an encoded message, including SYNC, length, ID & checksum */
+#define ANT_MESSAGE_MAX_ENCODED (ANT_MESSAGE_MAX_DATA + 4)
+
 typedef struct {
     uint8_t id;
-	uint8_t len;
-	uint8_t *data;
+    uint8_t len;
+    uint8_t data[ANT_MESSAGE_MAX_DATA];
 } ant_message_t;
 
+void ant_message_init(ant_message_t *msg, uint8_t id, uint8_t len);
 ant_message_t *ant_message_create(uint8_t id, uint8_t len);
 ant_message_t *ant_message_vcreate(uint8_t id, ...);
 void ant_message_destroy(ant_message_t *msg);
 
+typedef enum {
+    ANT_DECODE_SYNC = 0,
+    ANT_DECODE_LEN,
+    ANT_DECODE_ID,
+    ANT_DECODE_DATA,
+    ANT_DECODE_CKSUM,
+} ant_decode_state_t;
+
+/*
+ * Streaming message decoder. Bytes may be fed to it in arbitrarily sized
+ * pieces, it remembers how far through a message it is & the checksum of
+ * the bytes seen so far. The message is decoded straight into the one passed
+ * to ant_decoder_feed, so the same one must be passed until it is complete.
+ */
+typedef struct {
+    ant_decode_state_t state;
+    uint8_t cksum;
+    uint8_t pos;
+
+    /* statistics */
+    unsigned long skipped;
+    unsigned long bad_cksum;
+} ant_decoder_t;
+
 int ant_message_encode(ant_message_t *msg, uint8_t *buf, size_t sz, size_t *len);
-ant_message_t *ant_message_decode(uint8_t *buf, size_t sz, size_t *len);
+
+void ant_decoder_reset(ant_decoder_t *dec);
+bool ant_decoder_feed(ant_decoder_t *dec, const uint8_t *buf, size_t sz, size_t *used, ant_message_t *msg);
 
 #endif /* __ant_message_h__ */
@@ -0,0 +1,456 @@
+/*
+ * This file is part of fitbitd.
+ *
+ * fitbitd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fitbitd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fitbitd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * ANT devices on another machine, reached through antbridge over TCP. The
+ * device's byte stream is carried in frames, see ant-net.h. The link's round
+ * trip time is measured with pings & passed on to libant, which allows for it
+ * in the timeouts of every exchange.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "ant-private.h"
+#include "ant-net.h"
+#include "util.h"
+
+#define LOG_TAG "ant-net"
+#include "log.h"
+
+/* time to wait for the connection & the first ping, in ms */
+#define ANT_NET_CONNECT_TIMEOUT 5000
+
+/* time to wait for the socket to accept more data before giving up, in ms */
+#define ANT_NET_WRITE_TIMEOUT 1000
+
+/* interval between pings whilst reading, in ms */
+#define ANT_NET_PING_INTERVAL 2000
+
+typedef struct {
+    ant_t ant;
+    int fd;
+
+    /* serialises frames written by the device's users & pings by the reader */
+    pthread_mutex_t tx_lock;
+
+    /*
+     * received frames, the first of which may be partially consumed up to
+     * rx_off. rx_lock protects them & the ping state, which the reader
+     * updates whilst get_timeout may be called from elsewhere.
+     */
+    pthread_mutex_t rx_lock;
+    uint8_t rxbuf[ANT_NET_HDR_SZ + ANT_NET_PAYLOAD_MAX];
+    size_t rx_len, rx_off;
+
+    struct timespec next_ping;
+    bool ping_outstanding;
+    unsigned long rtt_us;
+} antnet_t;
+
+static uint64_t ant_net_now_us(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/* write a frame, waiting for the socket to accept all of it */
+static int ant_net_send(antnet_t *netant, uint8_t type, const uint8_t *data, size_t sz)
+{
+    uint8_t hdr[ANT_NET_HDR_SZ] = { type, sz & 0xff, sz >> 8 };
+    struct iovec iov[2];
+    struct pollfd pfd;
+    size_t done = 0, total = sizeof(hdr) + sz;
+    ssize_t ret;
+    int i;
+
+    ASSERT(sz <= ANT_NET_PAYLOAD_MAX);
+
+    pthread_mutex_lock(&netant->tx_lock);
+
+    while (done < total) {
+        /* skip over whatever has already been sent */
+        i = 0;
+        if (done < sizeof(hdr)) {
+            iov[i].iov_base = &hdr[done];
+            iov[i++].iov_len = sizeof(hdr) - done;
+            iov[i].iov_base = (void*)data;
+            iov[i++].iov_len = sz;
+        } else {
+            iov[i].iov_base = (void*)&data[done - sizeof(hdr)];
+            iov[i++].iov_len = total - done;
+        }
+
+        ret = writev(netant->fd, iov, i);
+        if (ret > 0) {
+            done += ret;
+            continue;
+        }
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0 && errno != EAGAIN) {
+            DBG("write failure %d\n", errno);
+            netant->ant.dead = true;
+            goto err;
+        }
+
+        pfd.fd = netant->fd;
+        pfd.events = POLLOUT;
+        ret = poll(&pfd, 1, ANT_NET_WRITE_TIMEOUT);
+        if (!ret || (ret < 0 && errno != EINTR)) {
+            /* a partial frame can't be taken back */
+            DBG("write timed out\n");
+            netant->ant.dead = true;
+            goto err;
+        }
+    }
+
+    pthread_mutex_unlock(&netant->tx_lock);
+    return 0;
+err:
+    pthread_mutex_unlock(&netant->tx_lock);
+    return -1;
+}
+
+static void ant_net_pong(antnet_t *netant, const uint8_t *data, size_t sz)
+{
+    uint64_t sent_us = 0;
+    unsigned long rtt_us;
+    int i;
+
+    if (sz != sizeof(sent_us) || !netant->ping_outstanding)
+        return;
+
+    for (i = 0; i < sizeof(sent_us); i++)
+        sent_us |= (uint64_t)data[i] << (i * 8);
+    rtt_us = ant_net_now_us() - sent_us;
+
+    if (netant->rtt_us)
+        netant->rtt_us = (7 * netant->rtt_us + rtt_us) / 8;
+    else
+        netant->rtt_us = MAX(rtt_us, 1);
+    netant->ping_outstanding = false;
+
+    ant_set_link_rtt(&netant->ant, netant->rtt_us);
+}
+
+/* send a ping if one is due, called with rx_lock held */
+static void ant_net_ping(antnet_t *netant)
+{
+    uint8_t data[8];
+    uint64_t now_us;
+    int i;
+
+    if (netant->ping_outstanding || ant_deadline_remaining(&netant->next_ping))
+        return;
+
+    now_us = ant_net_now_us();
+    for (i = 0; i < sizeof(data); i++)
+        data[i] = now_us >> (i * 8);
+
+    if (!ant_net_send(netant, ANT_NET_PING, data, sizeof(data)))
+        netant->ping_outstanding = true;
+    ant_deadline_set(&netant->next_ping, ANT_NET_PING_INTERVAL);
+}
+
+/*
+ * Consume whatever complete frames have been received, copying up to sz bytes
+ * of device data into buf. Called with rx_lock held.
+ */
+static size_t ant_net_take(antnet_t *netant, uint8_t *buf, size_t sz)
+{
+    uint8_t *payload = &netant->rxbuf[ANT_NET_HDR_SZ];
+    size_t done = 0, len, n;
+
+    while (netant->rx_len >= ANT_NET_HDR_SZ) {
+        len = netant->rxbuf[1] | (netant->rxbuf[2] << 8);
+        if (len > ANT_NET_PAYLOAD_MAX) {
+            ERR("bad frame length %zu\n", len);
+            netant->ant.dead = true;
+            break;
+        }
+        if (netant->rx_len < ANT_NET_HDR_SZ + len)
+            break;
+
+        switch (netant->rxbuf[0]) {
+        case ANT_NET_DATA:
+            n = MIN(sz - done, len - netant->rx_off);
+            memcpy(&buf[done], &payload[netant->rx_off], n);
+            done += n;
+            netant->rx_off += n;
+            break;
+        case ANT_NET_PONG:
+            ant_net_pong(netant, payload, len);
+            break;
+        default:
+            DBG("ignoring frame type %u\n", netant->rxbuf[0]);
+            break;
+        }
+
+        /* buf is full, leave the rest of the frame for next time */
+        if (netant->rxbuf[0] == ANT_NET_DATA && netant->rx_off < len)
+            break;
+
+        netant->rx_len -= ANT_NET_HDR_SZ + len;
+        memmove(netant->rxbuf, &netant->rxbuf[ANT_NET_HDR_SZ + len], netant->rx_len);
+        netant->rx_off = 0;
+    }
+
+    return done;
+}
+
+static ssize_t ant_net_read(ant_t *ant, uint8_t *buf, size_t sz, int timeout_ms)
+{
+    antnet_t *netant = (antnet_t*)ant;
+    struct timespec deadline;
+    struct pollfd pfd;
+    ssize_t ret;
+    int remaining;
+
+    ant_deadline_set(&deadline, timeout_ms);
+    pthread_mutex_lock(&netant->rx_lock);
+
+    while (true) {
+        ret = ant_net_take(netant, buf, sz);
+        if (ret > 0)
+            break;
+        if (ant->dead)
+            goto err;
+
+        ret = recv(netant->fd, &netant->rxbuf[netant->rx_len],
+                   sizeof(netant->rxbuf) - netant->rx_len, 0);
+        if (ret > 0) {
+            netant->rx_len += ret;
+            continue;
+        }
+
+        if (!ret || (errno != EAGAIN && errno != EINTR)) {
+            /* the bridge went away */
+            DBG("read failure %d\n", ret ? errno : 0);
+            ant->dead = true;
+            goto err;
+        }
+
+        remaining = ant_deadline_remaining(&deadline);
+        if (!remaining)
+            goto err;
+
+        /* only ping whilst waiting, so that the pong is seen promptly */
+        ant_net_ping(netant);
+
+        pthread_mutex_unlock(&netant->rx_lock);
+        pfd.fd = netant->fd;
+        pfd.events = POLLIN;
+        ret = poll(&pfd, 1, remaining);
+        pthread_mutex_lock(&netant->rx_lock);
+        if (ret < 0 && errno != EINTR) {
+            DBG("poll failure %d\n", errno);
+            ant->dead = true;
+            goto err;
+        }
+    }
+
+    pthread_mutex_unlock(&netant->rx_lock);
+    return ret;
+err:
+    pthread_mutex_unlock(&netant->rx_lock);
+    return -1;
+}
+
+static ssize_t ant_net_write(ant_t *ant, uint8_t *buf, size_t sz)
+{
+    antnet_t *netant = (antnet_t*)ant;
+    size_t done = 0, currsz;
+
+    /* batches are sent as a single frame where they fit */
+    while (done < sz) {
+        currsz = MIN(sz - done, ANT_NET_PAYLOAD_MAX);
+        CHAINERR_LTZ(ant_net_send(netant, ANT_NET_DATA, &buf[done], currsz), err);
+        done += currsz;
+    }
+
+    return done;
+err:
+    return -1;
+}
+
+static int ant_net_get_pollfds(ant_t *ant, struct pollfd *fds, int nfds)
+{
+    antnet_t *netant = (antnet_t*)ant;
+
+    if (nfds >= 1) {
+        fds[0].fd = netant->fd;
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+    }
+
+    return 1;
+}
+
+static int ant_net_get_timeout(ant_t *ant)
+{
+    antnet_t *netant = (antnet_t*)ant;
+    int timeout;
+
+    /* frames already received won't make the socket readable */
+    pthread_mutex_lock(&netant->rx_lock);
+    timeout = netant->rx_len ? 0 : -1;
+    pthread_mutex_unlock(&netant->rx_lock);
+
+    return timeout;
+}
+
+static void ant_net_destroy(ant_t *ant)
+{
+    antnet_t *netant = (antnet_t*)ant;
+
+    DBG("destroy %s\n", ant->name);
+
+    if (netant->fd >= 0)
+        close(netant->fd);
+
+    pthread_mutex_destroy(&netant->tx_lock);
+    pthread_mutex_destroy(&netant->rx_lock);
+    free(netant);
+}
+
+static int ant_net_connect_addr(antnet_t *netant, struct addrinfo *ai)
+{
+    struct pollfd pfd;
+    socklen_t errlen;
+    int one = 1, err;
+
+    netant->fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                        ai->ai_protocol);
+    if (netant->fd < 0)
+        return -1;
+
+    /* frames are written whole, so there's nothing for Nagle to coalesce */
+    setsockopt(netant->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (!connect(netant->fd, ai->ai_addr, ai->ai_addrlen))
+        return 0;
+    if (errno != EINPROGRESS)
+        goto err;
+
+    pfd.fd = netant->fd;
+    pfd.events = POLLOUT;
+    if (poll(&pfd, 1, ANT_NET_CONNECT_TIMEOUT) != 1)
+        goto err;
+
+    errlen = sizeof(err);
+    if (getsockopt(netant->fd, SOL_SOCKET, SO_ERROR, &err, &errlen) || err)
+        goto err;
+
+    return 0;
+err:
+    close(netant->fd);
+    netant->fd = -1;
+    return -1;
+}
+
+/* connect to the device exposed by the antbridge at host & port */
+ant_t *ant_net_connect(const char *host, const char *port)
+{
+    struct addrinfo hints, *res, *ai;
+    struct timespec deadline;
+    antnet_t *netant;
+    uint8_t discard[64];
+
+    netant = calloc(1, sizeof(*netant));
+    if (!netant) {
+        ERR("failed to alloc net device\n");
+        return NULL;
+    }
+    netant->fd = -1;
+    pthread_mutex_init(&netant->tx_lock, NULL);
+    pthread_mutex_init(&netant->rx_lock, NULL);
+
+    ant_init(&netant->ant);
+    snprintf(netant->ant.name, sizeof(netant->ant.name), "%.9s", host);
+    netant->ant.destroy = ant_net_destroy;
+    netant->ant.read = ant_net_read;
+    netant->ant.write = ant_net_write;
+    netant->ant.get_pollfds = ant_net_get_pollfds;
+    netant->ant.get_timeout = ant_net_get_timeout;
+
+    if (!port)
+        port = ANT_NET_PORT_DEFAULT;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res)) {
+        ERR("failed to resolve %s\n", host);
+        goto err;
+    }
+
+    for (ai = res; ai; ai = ai->ai_next) {
+        if (!ant_net_connect_addr(netant, ai))
+            break;
+    }
+    freeaddrinfo(res);
+
+    if (netant->fd < 0) {
+        ERR("failed to connect to %s:%s\n", host, port);
+        goto err;
+    }
+
+    /*
+     * measure the link before anything is sent to the device. Whatever it
+     * sends in the meantime predates us & is of no interest.
+     */
+    ant_deadline_set(&deadline, ANT_NET_CONNECT_TIMEOUT);
+    while (!netant->rtt_us) {
+        if (!ant_deadline_remaining(&deadline) || netant->ant.dead) {
+            ERR("no response from %s:%s\n", host, port);
+            goto err;
+        }
+        ant_net_read(&netant->ant, discard, sizeof(discard), ANT_NET_PING_INTERVAL);
+    }
+
+    DBG("connected to %s:%s, rtt %luus\n", host, port, netant->rtt_us);
+    return &netant->ant;
+err:
+    ant_net_destroy(&netant->ant);
+    return NULL;
+}
+
+/* the smoothed round trip time of the link, in us */
+unsigned long ant_net_get_rtt(ant_t *ant)
+{
+    antnet_t *netant = (antnet_t*)ant;
+    unsigned long rtt_us;
+
+    pthread_mutex_lock(&netant->rx_lock);
+    rtt_us = netant->rtt_us;
+    pthread_mutex_unlock(&netant->rx_lock);
+
+    return rtt_us;
+}
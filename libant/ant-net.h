@@ -0,0 +1,39 @@
+/*
+ * This file is part of fitbitd.
+ *
+ * fitbitd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fitbitd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fitbitd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __ant_net_h__
+#define __ant_net_h__
+
+#include "ant.h"
+
+#define ANT_NET_PORT_DEFAULT "9317"
+
+/*
+ * The bridge & its client exchange frames over TCP, each a 3 byte header of
+ * the frame type & a 16 bit little endian payload length, then the payload.
+ */
+#define ANT_NET_HDR_SZ          3
+#define ANT_NET_PAYLOAD_MAX     4096
+
+#define ANT_NET_DATA            0x00    /* bytes to or from the device */
+#define ANT_NET_PING            0x01    /* echoed back as a pong */
+#define ANT_NET_PONG            0x02
+
+ant_t *ant_net_connect(const char *host, const char *port);
+unsigned long ant_net_get_rtt(ant_t *ant);
+
+#endif /* __ant_net_h__ */
@@ -18,24 +18,195 @@
 #ifndef __ant_private_h__
 #define __ant_private_h__
 
+#include <poll.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <sys/types.h>
+#include <time.h>
 #include "ant.h"
+#include "ant-message.h"
+
+/* size of the receive ring buffer, must be a power of 2 */
+#define ANT_RECVBUF_SZ 4096
+
+/* size of the buffer batched messages are encoded into */
+#define ANT_TXBUF_SZ 512
+
+/* number of responses which may be outstanding within a batch */
+#define ANT_MAX_PENDING 16
+
+/* number of channels which received messages are queued for */
+#define ANT_MAX_CHANNELS 8
+
+/* number of received messages which may be queued at once */
+#define ANT_QUEUE_POOL_SZ 64
+
+typedef enum {
+    ANT_QUEUE_RESPONSE = 0,     /* responses to commands */
+    ANT_QUEUE_EVENT,            /* RF events */
+    ANT_QUEUE_DATA,             /* broadcast, acknowledged & burst data */
+    ANT_QUEUE_CLASSES,
+} ant_queue_class_t;
+
+typedef struct ant_qmsg_s {
+    ant_message_t msg;
+    unsigned long seq;
+    struct ant_qmsg_s *next;
+} ant_qmsg_t;
+
+typedef struct {
+    ant_qmsg_t *head, *tail;
+    unsigned len;
+} ant_queue_t;
+
+/* round trip time estimate for a kind of exchange, see RFC 6298 */
+typedef struct {
+    unsigned long srtt_us;
+    unsigned long rttvar_us;
+    unsigned rto_ms;
+    bool sampled;
+} ant_rto_t;
 
 struct ant_s {
     char name[10];
 
-    uint8_t recvbuf[512];
-    size_t recvbuf_sz;
+    /*
+     * receive ring buffer, recv_head & recv_tail are free running indices
+     * which are masked with (ANT_RECVBUF_SZ - 1) when accessing recvbuf
+     */
+    uint8_t recvbuf[ANT_RECVBUF_SZ];
+    size_t recv_head, recv_tail;
+
+    /* decodes messages from recvbuf into rxmsg, a slot taken from qpool */
+    ant_decoder_t decoder;
+    ant_qmsg_t *rxmsg;
+
+    /*
+     * received messages, sorted into queues by channel & class. Messages
+     * which aren't associated with a channel go in queue_global. seq is
+     * used to order messages across queues.
+     */
+    ant_qmsg_t qpool[ANT_QUEUE_POOL_SZ];
+    ant_qmsg_t *qfree;
+    ant_queue_t queues[ANT_MAX_CHANNELS][ANT_QUEUE_CLASSES];
+    ant_queue_t queue_global;
+    unsigned long qseq;
+    unsigned long qdropped;
+
+    /*
+     * messages sent whilst batching are encoded back to back into txbuf &
+     * written in a single transfer when the batch is flushed
+     */
+    uint8_t txbuf[ANT_TXBUF_SZ];
+    size_t txbuf_sz;
+    int batching;
+
+    /* responses to commands sent within the batch, checked when it ends */
+    struct {
+        uint8_t chan;
+        uint8_t msg_id;
+        uint64_t sent_us;
+    } pending[ANT_MAX_PENDING];
+    int npending;
+
+    /*
+     * burst packets are written as fast as the device accepts them unless it
+     * has reported overflowing, after which the next burst_paced bursts are
+     * paced by burst_gap_us per packet
+     */
+    unsigned burst_gap_us;
+    unsigned burst_paced;
+
+    /* bytes per packet of bursts sent, more than 8 if advanced bursts are on */
+    unsigned burst_packet_sz;
+
+    /* counters for the most recently received burst on each channel */
+    ant_burst_stats_t burst_stats[ANT_MAX_CHANNELS];
+
+    /* round trip times of exchanges, by message ID */
+    ant_latency_t latency[256];
+
+    /* how late reads from the device returned after timing out */
+    ant_latency_t jitter;
+
+    /* timeouts for each kind of exchange */
+    ant_rto_t rto[ANT_XCHG_TYPES];
+
+    /* round trip time of the link to a remote device, 0 for local ones */
+    unsigned long link_rtt_us;
+
+    /* records everything read & written, if set */
+    ant_capture_t *capture;
 
     /* true if an unrecoverable error has occurred */
     bool dead;
 
+    /*
+     * lock protects all of the above, allowing each channel to be used from
+     * a different thread. Whilst waiting for messages one thread at a time
+     * reads from the device with lock released, the others wait on cond
+     * until it has dispatched whatever it received.
+     */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool reading;
+
+    /*
+     * a thread dedicated to reading from the device, started with
+     * ant_start_io_thread. Whilst it runs other threads only ever wait.
+     * It stops running if the device dies, but is only joined & io_created
+     * cleared by ant_stop_io_thread.
+     */
+    pthread_t io_thread;
+    bool io_created, io_running, io_stop;
+
+    /* the thread whose batch is in progress, valid whilst batching */
+    pthread_t batch_owner;
+
     /* transport functions */
     void (*destroy)(ant_t *ant);
-    ssize_t (*read)(ant_t *ant, uint8_t *buf, size_t sz);
+    ssize_t (*read)(ant_t *ant, uint8_t *buf, size_t sz, int timeout_ms);
     ssize_t (*write)(ant_t *ant, uint8_t *buf, size_t sz);
+
+    /* optional, for driving the device from an event loop */
+    int (*get_pollfds)(ant_t *ant, struct pollfd *fds, int nfds);
+    int (*get_timeout)(ant_t *ant);
+};
+
+typedef struct ant_usb_context_s ant_usb_context_t;
+
+/*
+ * State shared by the nodes found through a context. lock protects next_id
+ * & the transports' device registries, which hotplug callbacks may modify
+ * from any thread.
+ */
+struct ant_context_s {
+    pthread_mutex_t lock;
+    int next_id;
+
+    ant_usb_context_t *usb;
 };
 
+int ant_context_next_id(ant_context_t *ctx);
+
+void ant_capture_record(ant_capture_t *cap, const char *name, uint8_t dir, const uint8_t *data, size_t len);
+
+void ant_init(ant_t *ant);
+void ant_set_link_rtt(ant_t *ant, unsigned long rtt_us);
+
+/* deadlines are absolute CLOCK_MONOTONIC times */
+void ant_deadline_set(struct timespec *deadline, unsigned timeout_ms);
+int ant_deadline_remaining(const struct timespec *deadline);
+
+static inline size_t ant_recvbuf_used(ant_t *ant)
+{
+    return ant->recv_tail - ant->recv_head;
+}
+
+static inline size_t ant_recvbuf_free(ant_t *ant)
+{
+    return ANT_RECVBUF_SZ - ant_recvbuf_used(ant);
+}
+
 #endif /* __ant_private_h__ */
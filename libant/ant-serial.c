@@ -0,0 +1,266 @@
+/*
+ * This file is part of fitbitd.
+ *
+ * fitbitd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fitbitd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fitbitd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * ANT devices attached through a tty, such as ANT USB sticks using a
+ * USB serial driver or radios on a UART. The tty is non-blocking & waited on
+ * with epoll, so reads return as soon as data arrives.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include "ant-private.h"
+#include "ant-serial.h"
+#include "util.h"
+
+#define LOG_TAG "ant-serial"
+#include "log.h"
+
+/* time to wait for the tty to accept more data before giving up, in ms */
+#define ANT_SERIAL_WRITE_TIMEOUT 1000
+
+typedef struct {
+    ant_t ant;
+    int fd;
+    int epfd;
+} antserial_t;
+
+static const struct {
+    unsigned baud;
+    speed_t speed;
+} ant_serial_speeds[] = {
+    { 4800, B4800 },
+    { 9600, B9600 },
+    { 19200, B19200 },
+    { 38400, B38400 },
+    { 57600, B57600 },
+    { 115200, B115200 },
+};
+
+static ssize_t ant_serial_read(ant_t *ant, uint8_t *buf, size_t sz, int timeout_ms)
+{
+    antserial_t *serant = (antserial_t*)ant;
+    struct timespec deadline;
+    struct epoll_event ev;
+    ssize_t ret;
+    int remaining;
+
+    ant_deadline_set(&deadline, timeout_ms);
+
+    while (true) {
+        ret = read(serant->fd, buf, sz);
+        if (ret > 0)
+            return ret;
+
+        if (!ret || (errno != EAGAIN && errno != EINTR)) {
+            /* the tty hung up or the device went away */
+            DBG("read failure %d\n", ret ? errno : 0);
+            ant->dead = true;
+            return -1;
+        }
+
+        remaining = ant_deadline_remaining(&deadline);
+        if (!remaining)
+            return -1;
+
+        ret = epoll_wait(serant->epfd, &ev, 1, remaining);
+        if (ret < 0 && errno != EINTR) {
+            DBG("epoll failure %d\n", errno);
+            ant->dead = true;
+            return -1;
+        }
+    }
+}
+
+static ssize_t ant_serial_write(ant_t *ant, uint8_t *buf, size_t sz)
+{
+    antserial_t *serant = (antserial_t*)ant;
+    struct pollfd pfd;
+    size_t done = 0;
+    ssize_t ret;
+
+    while (done < sz) {
+        ret = write(serant->fd, &buf[done], sz - done);
+        if (ret > 0) {
+            done += ret;
+            continue;
+        }
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0 && errno != EAGAIN) {
+            DBG("write failure %d\n", errno);
+            if (errno == EIO || errno == ENXIO || errno == ENODEV)
+                ant->dead = true;
+            return -1;
+        }
+
+        /*
+         * the output buffer is full. Reads are waited for through epfd, so
+         * whilst they may be in progress on another thread poll the fd here.
+         */
+        pfd.fd = serant->fd;
+        pfd.events = POLLOUT;
+        ret = poll(&pfd, 1, ANT_SERIAL_WRITE_TIMEOUT);
+        if (!ret || (ret < 0 && errno != EINTR)) {
+            DBG("write timed out\n");
+            return -1;
+        }
+        if (ret > 0 && (pfd.revents & (POLLERR | POLLHUP))) {
+            ant->dead = true;
+            return -1;
+        }
+    }
+
+    return done;
+}
+
+static int ant_serial_get_pollfds(ant_t *ant, struct pollfd *fds, int nfds)
+{
+    antserial_t *serant = (antserial_t*)ant;
+
+    if (nfds >= 1) {
+        fds[0].fd = serant->fd;
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+    }
+
+    return 1;
+}
+
+static int ant_serial_get_timeout(ant_t *ant)
+{
+    /* nothing happens other than through the fd */
+    return -1;
+}
+
+static void ant_serial_destroy(ant_t *ant)
+{
+    antserial_t *serant = (antserial_t*)ant;
+
+    DBG("destroy %s\n", ant->name);
+
+    if (serant->epfd >= 0)
+        close(serant->epfd);
+    if (serant->fd >= 0)
+        close(serant->fd);
+
+    free(serant);
+}
+
+static int ant_serial_setup(antserial_t *serant, unsigned baud)
+{
+    struct termios tio;
+    speed_t speed = 0;
+    int i;
+
+    for (i = 0; i < ARRAY_LENGTH(ant_serial_speeds); i++) {
+        if (ant_serial_speeds[i].baud == baud)
+            speed = ant_serial_speeds[i].speed;
+    }
+    if (!speed) {
+        ERR("unsupported baud rate %u\n", baud);
+        return -1;
+    }
+
+    if (tcgetattr(serant->fd, &tio)) {
+        ERR("failed to get tty attributes\n");
+        return -1;
+    }
+
+    /*
+     * raw 8N1 without flow control. VMIN of 1 makes reads with nothing
+     * available fail with EAGAIN rather than return 0, which is then left
+     * to mean the tty hung up.
+     */
+    cfmakeraw(&tio);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tio.c_cflag &= ~(CSTOPB | CRTSCTS);
+    tio.c_iflag &= ~(IXON | IXOFF | IXANY);
+    tio.c_cc[VMIN] = 1;
+    tio.c_cc[VTIME] = 0;
+    cfsetispeed(&tio, speed);
+    cfsetospeed(&tio, speed);
+
+    if (tcsetattr(serant->fd, TCSANOW, &tio)) {
+        ERR("failed to set tty attributes\n");
+        return -1;
+    }
+
+    /* discard anything left over from a previous user */
+    tcflush(serant->fd, TCIOFLUSH);
+
+    return 0;
+}
+
+/* open an ANT device attached to the tty at path */
+ant_t *ant_serial_open(const char *path, unsigned baud)
+{
+    struct epoll_event ev;
+    antserial_t *serant;
+    const char *name;
+
+    serant = calloc(1, sizeof(*serant));
+    if (!serant) {
+        ERR("failed to alloc serial device\n");
+        return NULL;
+    }
+    serant->fd = serant->epfd = -1;
+
+    ant_init(&serant->ant);
+    name = strrchr(path, '/');
+    snprintf(serant->ant.name, sizeof(serant->ant.name), "%.9s", name ? name + 1 : path);
+    serant->ant.destroy = ant_serial_destroy;
+    serant->ant.read = ant_serial_read;
+    serant->ant.write = ant_serial_write;
+    serant->ant.get_pollfds = ant_serial_get_pollfds;
+    serant->ant.get_timeout = ant_serial_get_timeout;
+
+    serant->fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (serant->fd < 0) {
+        ERR("failed to open %s\n", path);
+        goto err;
+    }
+
+    CHAINERR_LTZ(ant_serial_setup(serant, baud), err);
+
+    serant->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (serant->epfd < 0) {
+        ERR("failed to create epoll fd\n");
+        goto err;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    if (epoll_ctl(serant->epfd, EPOLL_CTL_ADD, serant->fd, &ev)) {
+        ERR("failed to add %s to epoll fd\n", path);
+        goto err;
+    }
+
+    DBG("opened %s at %u baud\n", path, baud);
+    return &serant->ant;
+err:
+    ant_serial_destroy(&serant->ant);
+    return NULL;
+}
@@ -0,0 +1,28 @@
+/*
+ * This file is part of fitbitd.
+ *
+ * fitbitd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fitbitd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fitbitd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __ant_serial_h__
+#define __ant_serial_h__
+
+#include "ant.h"
+
+/* the rate ANT USB sticks & most serial ANT modules default to */
+#define ANT_SERIAL_BAUD_DEFAULT 57600
+
+ant_t *ant_serial_open(const char *path, unsigned baud);
+
+#endif /* __ant_serial_h__ */
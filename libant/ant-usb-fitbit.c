@@ -15,9 +15,11 @@
  * along with fitbitd.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "ant-private.h"
 #include "ant-usb.h"
 #include "ant-usb-fitbit.h"
@@ -26,56 +28,160 @@
 #define LOG_TAG "ant-usb-fitbit"
 #include "log.h"
 
-int ant_usb_fitbit_init(antusb_t *usbant)
+/* CP210x vendor requests */
+#define CP210X_IFC_ENABLE   0x00
+#define CP210X_SET_BAUDDIV  0x01
+#define CP210X_GET_BAUDDIV  0x02
+#define CP210X_SET_LINE_CTL 0x03
+#define CP210X_GET_LINE_CTL 0x04
+#define CP210X_PURGE        0x12
+#define CP210X_SET_FLOW     0x13
+#define CP210X_GET_FLOW     0x14
+#define CP210X_VENDOR       0xff
+
+/* the configuration the base is set up with */
+#define FITBIT_BAUDDIV      0x004a
+#define FITBIT_LINE_CTL     0x0800
+
+static const uint8_t fitbit_flow[16] = { 0x08, 0x00, 0x00, 0x00, 0x40 };
+
+/* timeout for draining data left in the device, in ms */
+#define FITBIT_DRAIN_TIMEOUT_COLD   100
+#define FITBIT_DRAIN_TIMEOUT_WARM   10
+
+/* returns the us since *ts, which is updated to now */
+static long ant_usb_fitbit_lap(struct timespec *ts)
 {
-    uint8_t buf[4096];
+    struct timespec now;
+    long us;
 
-    usbant->ep = 1;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    us = (now.tv_sec - ts->tv_sec) * 1000000 + (now.tv_nsec - ts->tv_nsec) / 1000;
+    *ts = now;
 
-    DBG("init %s\n", usbant->ant.name);
+    return us;
+}
 
-    CHAINERR_LTZ(libusb_reset_device(usbant->dev), err);
+static int ant_usb_fitbit_ctrl(antusb_t *usbant, uint8_t type, uint8_t req, uint16_t val, uint8_t *buf, uint16_t len)
+{
+#if DEBUG == 1
+    struct timespec ts;
+    int ret;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ret = libusb_control_transfer(usbant->dev, type, req, val, 0, buf, len, 0);
+    DBG("request 0x%02x value 0x%04x took %ldus\n", req, val, ant_usb_fitbit_lap(&ts));
+
+    return ret;
+#else
+    return libusb_control_transfer(usbant->dev, type, req, val, 0, buf, len, 0);
+#endif
+}
 
-    CHAINERR_LTZ(libusb_control_transfer(usbant->dev, 0x40, 0, 0xffff, 0, NULL, 0, 0), err);
-    CHAINERR_LTZ(libusb_control_transfer(usbant->dev, 0x40, 1, 0x2000, 0, NULL, 0, 0), err);
+static int ant_usb_fitbit_check(antusb_t *usbant)
+{
+    uint8_t val;
 
-    CHAINERR_LTZ(libusb_control_transfer(usbant->dev, 0xc0, 255, 0x370b, 0, buf, 1, 0), err);
-    if (buf[0] != 0x02) {
+    CHAINERR_LTZ(ant_usb_fitbit_ctrl(usbant, 0xc0, CP210X_VENDOR, 0x370b, &val, 1), err);
+    if (val != 0x02) {
         ERR("Received incorrect value\n");
         return -1;
     }
 
-    CHAINERR_LTZ(libusb_control_transfer(usbant->dev, 0x40, 0, 0x0000, 0, NULL, 0, 0), err);
-    CHAINERR_LTZ(libusb_control_transfer(usbant->dev, 0x40, 0, 0xffff, 0, NULL, 0, 0), err);
-    CHAINERR_LTZ(libusb_control_transfer(usbant->dev, 0x40, 1, 0x2000, 0, NULL, 0, 0), err);
+    return 0;
+err:
+    return -1;
+}
 
-    CHAINERR_LTZ(libusb_control_transfer(usbant->dev, 0xc0, 255, 0x370b, 0, buf, 1, 0), err);
-    if (buf[0] != 0x02) {
-        ERR("Received incorrect value\n");
-        return -1;
-    }
+/*
+ * Check whether the CP210x is still configured from a previous open, in which
+ * case the reset & configuration can be skipped.
+ */
+static bool ant_usb_fitbit_configured(antusb_t *usbant)
+{
+    uint8_t buf[16];
 
-    CHAINERR_LTZ(libusb_control_transfer(usbant->dev, 0x40, 1, 0x004a, 0, NULL, 0, 0), err);
+    if (ant_usb_fitbit_ctrl(usbant, 0xc1, CP210X_GET_BAUDDIV, 0, buf, 2) != 2)
+        return false;
+    if ((buf[0] | (buf[1] << 8)) != FITBIT_BAUDDIV)
+        return false;
 
-    CHAINERR_LTZ(libusb_control_transfer(usbant->dev, 0xc0, 255, 0x370b, 0, buf, 1, 0), err);
-    if (buf[0] != 0x02) {
-        ERR("Received incorrect value\n");
-        return -1;
-    }
+    if (ant_usb_fitbit_ctrl(usbant, 0xc1, CP210X_GET_LINE_CTL, 0, buf, 2) != 2)
+        return false;
+    if ((buf[0] | (buf[1] << 8)) != FITBIT_LINE_CTL)
+        return false;
 
-    CHAINERR_LTZ(libusb_control_transfer(usbant->dev, 0x40, 3, 0x0800, 0, NULL, 0, 0), err);
+    if (ant_usb_fitbit_ctrl(usbant, 0xc1, CP210X_GET_FLOW, 0, buf, sizeof(buf)) != sizeof(buf))
+        return false;
+    if (memcmp(buf, fitbit_flow, sizeof(buf)))
+        return false;
 
-    memset(buf, 0, sizeof(buf));
-    buf[0] = 0x08;
-    buf[4] = 0x40;
-    CHAINERR_LTZ(libusb_control_transfer(usbant->dev, 0x41, 19, 0x0000, 0, buf, 16, 0), err);
+    if (ant_usb_fitbit_ctrl(usbant, 0xc0, CP210X_VENDOR, 0x370b, buf, 1) != 1)
+        return false;
 
-    CHAINERR_LTZ(libusb_control_transfer(usbant->dev, 0x40, 18, 0x000c, 0, NULL, 0, 0), err);
+    return buf[0] == 0x02;
+}
 
-    usbant->ant.read(&usbant->ant, buf, 4096);
+static int ant_usb_fitbit_configure(antusb_t *usbant)
+{
+    uint8_t flow[16];
+
+    CHAINERR_LTZ(libusb_reset_device(usbant->dev), err);
+
+    CHAINERR_LTZ(ant_usb_fitbit_ctrl(usbant, 0x40, CP210X_IFC_ENABLE, 0xffff, NULL, 0), err);
+    CHAINERR_LTZ(ant_usb_fitbit_ctrl(usbant, 0x40, CP210X_SET_BAUDDIV, 0x2000, NULL, 0), err);
+    CHAINERR_LTZ(ant_usb_fitbit_check(usbant), err);
+
+    CHAINERR_LTZ(ant_usb_fitbit_ctrl(usbant, 0x40, CP210X_IFC_ENABLE, 0x0000, NULL, 0), err);
+    CHAINERR_LTZ(ant_usb_fitbit_ctrl(usbant, 0x40, CP210X_IFC_ENABLE, 0xffff, NULL, 0), err);
+    CHAINERR_LTZ(ant_usb_fitbit_ctrl(usbant, 0x40, CP210X_SET_BAUDDIV, 0x2000, NULL, 0), err);
+    CHAINERR_LTZ(ant_usb_fitbit_check(usbant), err);
+
+    CHAINERR_LTZ(ant_usb_fitbit_ctrl(usbant, 0x40, CP210X_SET_BAUDDIV, FITBIT_BAUDDIV, NULL, 0), err);
+    CHAINERR_LTZ(ant_usb_fitbit_check(usbant), err);
+
+    CHAINERR_LTZ(ant_usb_fitbit_ctrl(usbant, 0x40, CP210X_SET_LINE_CTL, FITBIT_LINE_CTL, NULL, 0), err);
+
+    memcpy(flow, fitbit_flow, sizeof(flow));
+    CHAINERR_LTZ(ant_usb_fitbit_ctrl(usbant, 0x41, CP210X_SET_FLOW, 0x0000, flow, sizeof(flow)), err);
 
     return 0;
+err:
+    return -1;
+}
+
+int ant_usb_fitbit_init(antusb_t *usbant)
+{
+    uint8_t buf[4096];
+    struct timespec start;
+    unsigned drain_timeout;
+    bool warm;
+    int trans;
+
+    usbant->ep = 1;
+
+    DBG("init %s\n", usbant->ant.name);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
+    warm = ant_usb_fitbit_configured(usbant);
+
+    if (warm) {
+        /* make sure the UART is enabled, it's otherwise as we left it */
+        CHAINERR_LTZ(ant_usb_fitbit_ctrl(usbant, 0x40, CP210X_IFC_ENABLE, 0xffff, NULL, 0), err);
+        drain_timeout = FITBIT_DRAIN_TIMEOUT_WARM;
+    } else {
+        CHAINERR_LTZ(ant_usb_fitbit_configure(usbant), err);
+        drain_timeout = FITBIT_DRAIN_TIMEOUT_COLD;
+    }
+
+    CHAINERR_LTZ(ant_usb_fitbit_ctrl(usbant, 0x40, CP210X_PURGE, 0x000c, NULL, 0), err);
+
+    /* discard anything left over in the device */
+    libusb_bulk_transfer(usbant->dev, usbant->ep | LIBUSB_ENDPOINT_IN, buf, sizeof(buf), &trans, drain_timeout);
+
+    INFO("%s init of %s took %ldus\n", warm ? "warm" : "cold", usbant->ant.name, ant_usb_fitbit_lap(&start));
+    return 0;
 err:
     return -1;
 }
@@ -15,8 +15,11 @@
  * along with fitbitd.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include "ant-private.h"
 #include "ant-usb.h"
 #include "ant-usb-fitbit.h"
@@ -25,10 +28,15 @@
 #define LOG_TAG "ant-usb"
 #include "log.h"
 
+/* time to wait for a write to complete, & then for its cancellation, in ms */
+#define ANT_USB_WRITE_TIMEOUT 1000
+
+typedef int (ant_usb_init_fn)(antusb_t *usbant);
+
 static struct {
     uint16_t vid;
     uint16_t pid;
-    int (*init)(antusb_t *usbant);
+    ant_usb_init_fn *init;
 } usb_devices[] = {
     { 0x10c4, 0x84c4, ant_usb_fitbit_init },
 };
@@ -36,188 +44,731 @@ static struct {
 typedef struct devlist_s {
     libusb_device *dev;
     antusb_t *usbant;
+
+    /* true once an open device has been unplugged */
+    bool left;
+
     struct devlist_s *prev, *next;
 } devlist_t;
 
-static int _id = 0;
-static devlist_t *opendevices;
-static libusb_context *_usb;
+/*
+ * USB state of an ant_context_t. Hotplug callbacks run in whichever thread
+ * handles events, so the device lists are protected by the context's lock.
+ */
+struct ant_usb_context_s {
+    libusb_context *usb;
+
+    /* devices which have been opened */
+    devlist_t *opendevices;
+
+    /* devices which have arrived but not yet been opened */
+    devlist_t *arriveddevices;
+    int arrived;
 
-static ssize_t ant_usb_read(ant_t *ant, uint8_t *buf, size_t sz)
+    /*
+     * devices which are still plugged in but were closed or failed to open,
+     * opened again by the next find without waking anyone waiting for nodes
+     */
+    devlist_t *retrydevices;
+
+    bool hotplug;
+    libusb_hotplug_callback_handle hotplug_handles[ARRAY_LENGTH(usb_devices)];
+};
+
+static void devlist_add(devlist_t **list, devlist_t *devlist)
 {
-    antusb_t *usbant = (antusb_t*)ant;
-    int ret, trans;
+    devlist->prev = NULL;
+    devlist->next = *list;
+    if (devlist->next)
+        devlist->next->prev = devlist;
+    *list = devlist;
+}
+
+static void devlist_remove(devlist_t **list, devlist_t *devlist)
+{
+    if (devlist == *list) {
+        *list = devlist->next;
+        if (*list)
+            (*list)->prev = NULL;
+    } else {
+        devlist->prev->next = devlist->next;
+        if (devlist->next)
+            devlist->next->prev = devlist->prev;
+    }
+}
+
+static devlist_t *devlist_find(devlist_t *list, libusb_device *dev)
+{
+    for (; list; list = list->next) {
+        if (list->dev == dev)
+            return list;
+    }
+    return NULL;
+}
+
+/* free a list of devices which hold a reference */
+static void devlist_release(devlist_t **list)
+{
+    devlist_t *devlist;
+
+    while ((devlist = *list)) {
+        devlist_remove(list, devlist);
+        libusb_unref_device(devlist->dev);
+        free(devlist);
+    }
+}
+
+static void ant_usb_rx_callback(struct libusb_transfer *transfer)
+{
+    antusb_t *usbant = transfer->user_data;
+    size_t used, off, cpy, i;
+    int ret;
+
+    switch (transfer->status) {
+    case LIBUSB_TRANSFER_COMPLETED:
+        pthread_mutex_lock(&usbant->rx_lock);
+
+        used = usbant->rx_tail - usbant->rx_head;
+        if (transfer->actual_length > ANT_USB_RX_DATA_SZ - used) {
+            pthread_mutex_unlock(&usbant->rx_lock);
+            ERR("receive buffer overflow, dropping %d bytes\n", transfer->actual_length);
+            break;
+        }
+
+        /* copy into the ring, in up to 2 pieces if it wraps */
+        for (i = 0; i < transfer->actual_length; i += cpy) {
+            off = usbant->rx_tail & (ANT_USB_RX_DATA_SZ - 1);
+            cpy = MIN(transfer->actual_length - i, ANT_USB_RX_DATA_SZ - off);
+            memcpy(&usbant->rx_data[off], &transfer->buffer[i], cpy);
+            usbant->rx_tail += cpy;
+        }
+
+        pthread_mutex_unlock(&usbant->rx_lock);
+        break;
 
-    ret = libusb_bulk_transfer(usbant->dev, usbant->ep | LIBUSB_ENDPOINT_IN, buf, sz, &trans, 100);
+    case LIBUSB_TRANSFER_TIMED_OUT:
+        break;
+
+    case LIBUSB_TRANSFER_CANCELLED:
+        usbant->rx_active--;
+        return;
+
+    default:
+        DBG("bulk read failure %d\n", transfer->status);
+        usbant->ant.dead = true;
+        usbant->rx_active--;
+        usbant->rx_completed = 1;
+        return;
+    }
+
+    /* keep the transfer in flight */
+    ret = libusb_submit_transfer(transfer);
     if (ret) {
-        if (ret != LIBUSB_ERROR_TIMEOUT) {
-            DBG("bulk read failure %d\n", ret);
+        DBG("bulk read resubmit failure %d\n", ret);
+        usbant->ant.dead = true;
+        usbant->rx_active--;
+    }
+
+    usbant->rx_completed = 1;
+}
+
+static int ant_usb_rx_start(antusb_t *usbant)
+{
+    struct libusb_transfer *transfer;
+    int i;
+
+    for (i = 0; i < ANT_USB_RX_TRANSFERS; i++) {
+        transfer = libusb_alloc_transfer(0);
+        if (!transfer)
+            return -1;
+        usbant->rx_transfers[i] = transfer;
+
+        libusb_fill_bulk_transfer(transfer, usbant->dev, usbant->ep | LIBUSB_ENDPOINT_IN,
+                                  usbant->rx_bufs[i], ANT_USB_RX_TRANSFER_SZ,
+                                  ant_usb_rx_callback, usbant, 0);
+
+        if (libusb_submit_transfer(transfer))
+            return -1;
+        usbant->rx_active++;
+    }
+
+    usbant->tx_transfer = libusb_alloc_transfer(0);
+    if (!usbant->tx_transfer)
+        return -1;
+    usbant->tx_completed = 1;
+
+    return 0;
+}
+
+static void ant_usb_rx_stop(antusb_t *usbant)
+{
+    struct timeval tv;
+    int i, attempts = 10;
+
+    for (i = 0; i < ANT_USB_RX_TRANSFERS; i++) {
+        if (usbant->rx_transfers[i])
+            libusb_cancel_transfer(usbant->rx_transfers[i]);
+    }
+
+    /* wait for the cancellations to complete */
+    while (usbant->rx_active > 0 && attempts--) {
+        tv.tv_sec = 0;
+        tv.tv_usec = 100000;
+        libusb_handle_events_timeout(usbant->usb, &tv);
+    }
+
+    if (usbant->rx_active > 0) {
+        /* freeing an active transfer isn't safe, leak it */
+        ERR("failed to cancel transfers\n");
+        return;
+    }
+
+    for (i = 0; i < ANT_USB_RX_TRANSFERS; i++) {
+        if (usbant->rx_transfers[i])
+            libusb_free_transfer(usbant->rx_transfers[i]);
+        usbant->rx_transfers[i] = NULL;
+    }
+}
+
+static size_t ant_usb_rx_used(antusb_t *usbant)
+{
+    size_t used;
+
+    pthread_mutex_lock(&usbant->rx_lock);
+    used = usbant->rx_tail - usbant->rx_head;
+    pthread_mutex_unlock(&usbant->rx_lock);
+
+    return used;
+}
+
+static ssize_t ant_usb_read(ant_t *ant, uint8_t *buf, size_t sz, int timeout_ms)
+{
+    antusb_t *usbant = (antusb_t*)ant;
+    struct timespec deadline;
+    struct timeval tv;
+    size_t avail, off, cpy, done;
+    int ret, remaining;
+
+    ant_deadline_set(&deadline, timeout_ms);
+
+    /* handle events until data arrives or the deadline passes */
+    while (!ant_usb_rx_used(usbant)) {
+        if (ant->dead || !usbant->rx_active)
+            return -1;
+
+        remaining = ant_deadline_remaining(&deadline);
+        tv.tv_sec = remaining / 1000;
+        tv.tv_usec = (remaining % 1000) * 1000;
+
+        usbant->rx_completed = 0;
+        ret = libusb_handle_events_timeout_completed(usbant->usb, &tv, &usbant->rx_completed);
+        if (ret && ret != LIBUSB_ERROR_INTERRUPTED) {
+            DBG("event handling failure %d\n", ret);
             ant->dead = true;
+            return -1;
         }
+
+        if (!remaining && !ant_usb_rx_used(usbant))
+            return -1;
+    }
+
+    pthread_mutex_lock(&usbant->rx_lock);
+    avail = MIN(sz, usbant->rx_tail - usbant->rx_head);
+    for (done = 0; done < avail; done += cpy) {
+        off = usbant->rx_head & (ANT_USB_RX_DATA_SZ - 1);
+        cpy = MIN(avail - done, ANT_USB_RX_DATA_SZ - off);
+        memcpy(&buf[done], &usbant->rx_data[off], cpy);
+        usbant->rx_head += cpy;
+    }
+    pthread_mutex_unlock(&usbant->rx_lock);
+
+    return avail;
+}
+
+static int ant_usb_get_pollfds(ant_t *ant, struct pollfd *fds, int nfds)
+{
+    antusb_t *usbant = (antusb_t*)ant;
+    const struct libusb_pollfd **usbfds;
+    int i;
+
+    /* these are the context's, shared with the other devices it opened */
+    usbfds = libusb_get_pollfds(usbant->usb);
+    if (!usbfds)
         return -1;
+
+    for (i = 0; usbfds[i]; i++) {
+        if (i >= nfds)
+            continue;
+        fds[i].fd = usbfds[i]->fd;
+        fds[i].events = usbfds[i]->events;
+        fds[i].revents = 0;
     }
 
-    return trans;
+    libusb_free_pollfds(usbfds);
+    return i;
+}
+
+static int ant_usb_get_timeout(ant_t *ant)
+{
+    antusb_t *usbant = (antusb_t*)ant;
+    struct timeval tv;
+    int ret;
+
+    /* data received whilst handling another device's events */
+    if (ant_usb_rx_used(usbant))
+        return 0;
+
+    ret = libusb_get_next_timeout(usbant->usb, &tv);
+    if (ret < 0)
+        return 0;
+    if (!ret)
+        return -1;
+
+    return tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+}
+
+static void ant_usb_tx_callback(struct libusb_transfer *transfer)
+{
+    antusb_t *usbant = transfer->user_data;
+
+    usbant->tx_completed = 1;
 }
 
 static ssize_t ant_usb_write(ant_t *ant, uint8_t *buf, size_t sz)
 {
     antusb_t *usbant = (antusb_t*)ant;
-    int ret, trans;
-    size_t rem = sz;
+    struct libusb_transfer *transfer = usbant->tx_transfer;
+    struct timespec deadline;
+    struct timeval tv;
+    bool cancelled = false;
+    int ret, remaining;
 
-    while (rem) {
-        ret = libusb_bulk_transfer(usbant->dev, usbant->ep | LIBUSB_ENDPOINT_OUT, buf, sz, &trans, 100);
-        if (ret) {
-            DBG("bulk write failure %d\n", ret);
-            return -1;
+    libusb_fill_bulk_transfer(transfer, usbant->dev, usbant->ep | LIBUSB_ENDPOINT_OUT,
+                              buf, sz, ant_usb_tx_callback, usbant, 100);
+
+    usbant->tx_completed = 0;
+    ret = libusb_submit_transfer(transfer);
+    if (ret) {
+        DBG("bulk write submit failure %d\n", ret);
+        return -1;
+    }
+
+    /* received data continues to be handled whilst waiting */
+    ant_deadline_set(&deadline, ANT_USB_WRITE_TIMEOUT);
+    while (!usbant->tx_completed) {
+        remaining = ant_deadline_remaining(&deadline);
+        if (!remaining) {
+            if (cancelled) {
+                /* the transfer still owns buf, so the device can't be used */
+                ERR("failed to cancel stalled write\n");
+                ant->dead = true;
+                return -1;
+            }
+
+            DBG("bulk write timed out\n");
+            libusb_cancel_transfer(transfer);
+            cancelled = true;
+            ant_deadline_set(&deadline, ANT_USB_WRITE_TIMEOUT);
+            continue;
         }
 
-        rem -= trans;
+        tv.tv_sec = remaining / 1000;
+        tv.tv_usec = (remaining % 1000) * 1000;
+        ret = libusb_handle_events_timeout_completed(usbant->usb, &tv, &usbant->tx_completed);
+        if (ret && ret != LIBUSB_ERROR_INTERRUPTED && !cancelled) {
+            DBG("event handling failure %d\n", ret);
+            libusb_cancel_transfer(transfer);
+            cancelled = true;
+            ant_deadline_set(&deadline, ANT_USB_WRITE_TIMEOUT);
+        }
+    }
+
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+        DBG("bulk write failure %d\n", transfer->status);
+        if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE)
+            ant->dead = true;
+        return -1;
     }
 
-    return sz;
+    return transfer->actual_length;
 }
 
 static void ant_usb_destroy(ant_t *ant)
 {
     antusb_t *usbant = (antusb_t*)ant;
+    ant_context_t *ctx = usbant->ctx;
     devlist_t *devlist;
-    bool removed = false;
 
     DBG("destroy %s\n", ant->name);
 
-    if (usbant->dev)
-        libusb_close(usbant->dev);
-
-    for (devlist = opendevices; devlist; devlist = devlist->next) {
+    pthread_mutex_lock(&ctx->lock);
+    for (devlist = ctx->usb->opendevices; devlist; devlist = devlist->next) {
         if (devlist->usbant != usbant)
             continue;
 
-        removed = true;
-
-        /* remove from the list of open devices */
-        if (devlist == opendevices) {
-            opendevices = devlist->next;
-            if (opendevices)
-                opendevices->prev = NULL;
+        devlist_remove(&ctx->usb->opendevices, devlist);
+
+        /*
+         * hotplug only reports a device once, so one which is still plugged
+         * in is retried, much as enumerating would find it again. The open
+         * handle keeps the device alive until it's referenced.
+         */
+        if (ctx->usb->hotplug && !devlist->left &&
+            !devlist_find(ctx->usb->arriveddevices, devlist->dev) &&
+            !devlist_find(ctx->usb->retrydevices, devlist->dev)) {
+            devlist->dev = libusb_ref_device(devlist->dev);
+            devlist->usbant = NULL;
+            devlist_add(&ctx->usb->retrydevices, devlist);
+            DBG("%s will be reopened\n", ant->name);
         } else {
-            devlist->prev->next = devlist->next;
-            if (devlist->next)
-                devlist->next->prev = devlist->prev;
+            free(devlist);
         }
-
-        /* cleanup */
-        free(devlist);
-
         break;
     }
+    pthread_mutex_unlock(&ctx->lock);
+
+    if (usbant->dev) {
+        ant_usb_rx_stop(usbant);
+        /* as with reads, a write which couldn't be cancelled is leaked */
+        if (usbant->tx_transfer && usbant->tx_completed)
+            libusb_free_transfer(usbant->tx_transfer);
+        libusb_close(usbant->dev);
+    }
+    pthread_mutex_destroy(&usbant->rx_lock);
 
     free(usbant);
+}
+
+static ant_usb_init_fn *ant_usb_find_init(libusb_device *dev)
+{
+    struct libusb_device_descriptor desc;
+    int usbidx;
+
+    if (libusb_get_device_descriptor(dev, &desc)) {
+        ERR("failed to get device descriptor\n");
+        return NULL;
+    }
 
-    if (removed && !opendevices) {
-        DBG("no open devices, cleaning up libusb\n");
-        libusb_exit(_usb);
+    for (usbidx = 0; usbidx < ARRAY_LENGTH(usb_devices); usbidx++) {
+        if (desc.idVendor != usb_devices[usbidx].vid)
+            continue;
+        if (desc.idProduct != usb_devices[usbidx].pid)
+            continue;
+        return usb_devices[usbidx].init;
     }
+
+    return NULL;
 }
 
-int ant_usb_find_nodes(ant_cb_foundnode *found_node, void *user)
+static int ant_usb_open(ant_context_t *ctx, libusb_device *dev, ant_usb_init_fn *fn_init, ant_cb_foundnode *found_node, void *user)
 {
-    libusb_device **list;
-    struct libusb_device_descriptor desc;
     antusb_t *usbant;
-    ssize_t count, i;
-    int ret, usbidx, found = 0;
-    int (*fn_init)(antusb_t *usbant);
     devlist_t *devlist;
+    int ret;
 
-    if (!opendevices) {
-        DBG("initialising libusb\n");
-        ret = libusb_init(&_usb);
-        if (ret) {
-            ERR("failed to init libusb\n");
-            _usb = NULL;
-            goto out;
-        }
+    usbant = calloc(1, sizeof(*usbant));
+    if (!usbant)
+        goto err;
+
+    devlist = malloc(sizeof(*devlist));
+    if (!devlist)
+        goto err_devlist;
+
+    /* claim the device, unless another thread already has */
+    pthread_mutex_lock(&ctx->lock);
+    if (devlist_find(ctx->usb->opendevices, dev)) {
+        pthread_mutex_unlock(&ctx->lock);
+        DBG("skipping open device\n");
+        free(devlist);
+        free(usbant);
+        return -1;
+    }
+    devlist->dev = dev;
+    devlist->usbant = usbant;
+    devlist->left = false;
+    devlist_add(&ctx->usb->opendevices, devlist);
+    pthread_mutex_unlock(&ctx->lock);
+
+    ant_init(&usbant->ant);
+    pthread_mutex_init(&usbant->rx_lock, NULL);
+    usbant->ctx = ctx;
+    usbant->usb = ctx->usb->usb;
+    snprintf(usbant->ant.name, sizeof(usbant->ant.name), "antusb%d", ant_context_next_id(ctx));
+
+    usbant->ant.destroy = ant_usb_destroy;
+    usbant->ant.read = ant_usb_read;
+    usbant->ant.write = ant_usb_write;
+    usbant->ant.get_pollfds = ant_usb_get_pollfds;
+    usbant->ant.get_timeout = ant_usb_get_timeout;
+
+    ret = libusb_open(dev, &usbant->dev);
+    if (ret) {
+        /* don't retry a device which has gone */
+        pthread_mutex_lock(&ctx->lock);
+        devlist->left = (ret == LIBUSB_ERROR_NO_DEVICE);
+        pthread_mutex_unlock(&ctx->lock);
+        goto err_dev;
     }
 
-    count = libusb_get_device_list(_usb, &list);
-    if (count < 0)
-        goto out;
+    ret = fn_init(usbant);
+    if (ret)
+        goto err_dev;
 
-    for (i = 0; i < count; i++) {
-        for (devlist = opendevices; devlist; devlist = devlist->next) {
-            if (devlist->dev == list[i])
-                break;
+    ret = ant_usb_rx_start(usbant);
+    if (ret)
+        goto err_dev;
+
+    found_node(&usbant->ant, user);
+    return 0;
+
+err_dev:
+    ERR("failed to init device\n");
+    usbant->ant.destroy(&usbant->ant);
+    return -1;
+err_devlist:
+    free(usbant);
+err:
+    ERR("failed to alloc device\n");
+    return -1;
+}
+
+static int ant_usb_hotplug(libusb_context *usb, libusb_device *dev, libusb_hotplug_event event, void *user)
+{
+    ant_context_t *ctx = user;
+    ant_usb_context_t *uctx = ctx->usb;
+    devlist_t *devlist;
+
+    pthread_mutex_lock(&ctx->lock);
+
+    switch (event) {
+    case LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED:
+        if (devlist_find(uctx->opendevices, dev) || devlist_find(uctx->arriveddevices, dev))
+            break;
+
+        /* arriving again supersedes a pending retry */
+        devlist = devlist_find(uctx->retrydevices, dev);
+        if (devlist) {
+            devlist_remove(&uctx->retrydevices, devlist);
+            devlist_add(&uctx->arriveddevices, devlist);
+            uctx->arrived = 1;
+            break;
+        }
+
+        /* devices can't be opened from a hotplug callback, queue it */
+        devlist = malloc(sizeof(*devlist));
+        if (!devlist) {
+            ERR("failed to alloc arrived device\n");
+            break;
         }
+        devlist->dev = libusb_ref_device(dev);
+        devlist->usbant = NULL;
+        devlist_add(&uctx->arriveddevices, devlist);
+        uctx->arrived = 1;
+        DBG("device arrived\n");
+        break;
+
+    case LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT:
+        devlist = devlist_find(uctx->arriveddevices, dev);
         if (devlist) {
-            DBG("skipping open device\n");
-            continue;
+            devlist_remove(&uctx->arriveddevices, devlist);
+            libusb_unref_device(devlist->dev);
+            free(devlist);
         }
 
-        ret = libusb_get_device_descriptor(list[i], &desc);
-        if (ret) {
-            ERR("failed to get device descriptor\n");
-            continue;
+        devlist = devlist_find(uctx->retrydevices, dev);
+        if (devlist) {
+            devlist_remove(&uctx->retrydevices, devlist);
+            libusb_unref_device(devlist->dev);
+            free(devlist);
         }
 
-        fn_init = NULL;
-        for (usbidx = 0; usbidx < ARRAY_LENGTH(usb_devices); usbidx++) {
-            if (desc.idVendor != usb_devices[usbidx].vid)
-                continue;
-            if (desc.idProduct != usb_devices[usbidx].pid)
-                continue;
-            fn_init = usb_devices[usbidx].init;
-            break;
+        /* the user notices the device is dead & destroys it */
+        devlist = devlist_find(uctx->opendevices, dev);
+        if (devlist) {
+            DBG("%s removed\n", devlist->usbant->ant.name);
+            devlist->usbant->ant.dead = true;
+            devlist->left = true;
         }
+        break;
 
-        if (!fn_init)
-            continue;
+    default:
+        break;
+    }
 
-        usbant = calloc(1, sizeof(*usbant));
-        if (!usbant)
-            goto dev_err;
+    pthread_mutex_unlock(&ctx->lock);
+    return 0;
+}
 
-        snprintf(usbant->ant.name, sizeof(usbant->ant.name), "antusb%d", _id++);
+int ant_usb_context_init(ant_context_t *ctx)
+{
+    ant_usb_context_t *uctx;
+    int ret, usbidx;
 
-        usbant->ant.destroy = ant_usb_destroy;
-        usbant->ant.read = ant_usb_read;
-        usbant->ant.write = ant_usb_write;
+    uctx = calloc(1, sizeof(*uctx));
+    if (!uctx)
+        return -1;
+    ctx->usb = uctx;
 
-        ret = libusb_open(list[i], &usbant->dev);
-        if (ret)
-            goto dev_err;
+    ret = libusb_init(&uctx->usb);
+    if (ret) {
+        ERR("failed to init libusb\n");
+        free(uctx);
+        ctx->usb = NULL;
+        return -1;
+    }
 
-        ret = fn_init(usbant);
-        if (ret)
-            goto dev_err;
+    if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+        DBG("no hotplug support, enumerating devices\n");
+        return 0;
+    }
 
-        /* add to open device list */
-        devlist = malloc(sizeof(*devlist));
-        devlist->dev = list[i];
-        devlist->usbant = usbant;
-        devlist->prev = NULL;
-        devlist->next = opendevices;
-        if (devlist->next)
-            devlist->next->prev = devlist;
-        opendevices = devlist;
+    /* devices already present arrive during registration */
+    uctx->hotplug = true;
+    for (usbidx = 0; usbidx < ARRAY_LENGTH(usb_devices); usbidx++) {
+        ret = libusb_hotplug_register_callback(uctx->usb,
+                LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+                LIBUSB_HOTPLUG_ENUMERATE, usb_devices[usbidx].vid,
+                usb_devices[usbidx].pid, LIBUSB_HOTPLUG_MATCH_ANY,
+                ant_usb_hotplug, ctx, &uctx->hotplug_handles[usbidx]);
+        if (ret) {
+            ERR("failed to register hotplug callback %d\n", ret);
+            uctx->hotplug = false;
+        }
+    }
+
+    return 0;
+}
 
-        found++;
-        found_node(&usbant->ant, user);
-        continue;
-dev_err:
-        ERR("failed to init device\n");
-        if (usbant)
-            usbant->ant.destroy(&usbant->ant);
+void ant_usb_context_fini(ant_context_t *ctx)
+{
+    ant_usb_context_t *uctx = ctx->usb;
+    int usbidx;
+
+    if (!uctx)
+        return;
+
+    /* nodes hold references to the libusb context */
+    ASSERT(!uctx->opendevices);
+
+    if (uctx->hotplug) {
+        for (usbidx = 0; usbidx < ARRAY_LENGTH(usb_devices); usbidx++)
+            libusb_hotplug_deregister_callback(uctx->usb, uctx->hotplug_handles[usbidx]);
     }
 
-out:
-    libusb_free_device_list(list, 1);
+    devlist_release(&uctx->arriveddevices);
+    devlist_release(&uctx->retrydevices);
+
+    libusb_exit(uctx->usb);
+    free(uctx);
+    ctx->usb = NULL;
+}
 
-    if (!opendevices && _usb) {
-        DBG("opened no devices, cleaning up libusb\n");
-        libusb_exit(_usb);
+/* open devices which have arrived, or are to be retried, since the last call */
+static int ant_usb_open_arrived(ant_context_t *ctx, ant_cb_foundnode *found_node, void *user)
+{
+    ant_usb_context_t *uctx = ctx->usb;
+    struct timeval tv = { 0, 0 };
+    devlist_t *devlist, *pending = NULL;
+    ant_usb_init_fn *fn_init;
+    int found = 0;
+
+    /* pick up any pending hotplug events without blocking */
+    libusb_handle_events_timeout_completed(uctx->usb, &tv, NULL);
+
+    /*
+     * take both lists at once, devices which fail to open are queued for
+     * retrying again & are left for the next call
+     */
+    pthread_mutex_lock(&ctx->lock);
+    while ((devlist = uctx->arriveddevices) || (devlist = uctx->retrydevices)) {
+        devlist_remove(devlist == uctx->arriveddevices ?
+                       &uctx->arriveddevices : &uctx->retrydevices, devlist);
+        devlist_add(&pending, devlist);
+    }
+    uctx->arrived = 0;
+    pthread_mutex_unlock(&ctx->lock);
+
+    while ((devlist = pending)) {
+        devlist_remove(&pending, devlist);
+
+        fn_init = ant_usb_find_init(devlist->dev);
+        if (fn_init && !ant_usb_open(ctx, devlist->dev, fn_init, found_node, user))
+            found++;
+
+        libusb_unref_device(devlist->dev);
+        free(devlist);
     }
 
     return found;
 }
+
+static int ant_usb_enumerate(ant_context_t *ctx, ant_cb_foundnode *found_node, void *user)
+{
+    libusb_device **list;
+    ant_usb_init_fn *fn_init;
+    ssize_t count, i;
+    int found = 0;
+
+    count = libusb_get_device_list(ctx->usb->usb, &list);
+    if (count < 0)
+        return 0;
+
+    for (i = 0; i < count; i++) {
+        fn_init = ant_usb_find_init(list[i]);
+        if (!fn_init)
+            continue;
+
+        if (!ant_usb_open(ctx, list[i], fn_init, found_node, user))
+            found++;
+    }
+
+    libusb_free_device_list(list, 1);
+    return found;
+}
+
+int ant_usb_find_nodes(ant_context_t *ctx, ant_cb_foundnode *found_node, void *user)
+{
+    if (!ctx->usb)
+        return 0;
+
+    if (ctx->usb->hotplug)
+        return ant_usb_open_arrived(ctx, found_node, user);
+
+    return ant_usb_enumerate(ctx, found_node, user);
+}
+
+int ant_usb_wait_for_nodes(ant_context_t *ctx, unsigned timeout_ms)
+{
+    ant_usb_context_t *uctx = ctx->usb;
+    struct timespec deadline, ts;
+    struct timeval tv;
+    int remaining;
+
+    if (!uctx || !uctx->hotplug) {
+        /* nothing to wait on, the caller enumerates again afterwards */
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+        nanosleep(&ts, NULL);
+        return 0;
+    }
+
+    ant_deadline_set(&deadline, timeout_ms);
+
+    while (true) {
+        pthread_mutex_lock(&ctx->lock);
+        if (uctx->arriveddevices) {
+            pthread_mutex_unlock(&ctx->lock);
+            return 1;
+        }
+        uctx->arrived = 0;
+        pthread_mutex_unlock(&ctx->lock);
+
+        remaining = ant_deadline_remaining(&deadline);
+        if (!remaining)
+            return 0;
+
+        tv.tv_sec = remaining / 1000;
+        tv.tv_usec = (remaining % 1000) * 1000;
+        libusb_handle_events_timeout_completed(uctx->usb, &tv, &uctx->arrived);
+    }
+}
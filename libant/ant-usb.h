@@ -19,15 +19,47 @@
 #define __ant_usb_h__
 
 #include <libusb.h>
+#include <pthread.h>
 #include "ant.h"
 #include "ant-private.h"
 
+/* number & size of bulk IN transfers kept in flight */
+#define ANT_USB_RX_TRANSFERS 4
+#define ANT_USB_RX_TRANSFER_SZ 512
+
+/* size of the buffer holding received data until it is read */
+#define ANT_USB_RX_DATA_SZ 16384
+
 typedef struct {
     ant_t ant;
+    ant_context_t *ctx;
+    libusb_context *usb;
     libusb_device_handle *dev;
     int ep;
+
+    /* bulk IN transfers, resubmitted as soon as they complete */
+    struct libusb_transfer *rx_transfers[ANT_USB_RX_TRANSFERS];
+    uint8_t rx_bufs[ANT_USB_RX_TRANSFERS][ANT_USB_RX_TRANSFER_SZ];
+    int rx_active;
+
+    /*
+     * received data not yet read, a ring indexed like ant_t.recvbuf. Transfers
+     * may complete in whichever thread is handling events, so the indices are
+     * protected by rx_lock.
+     */
+    uint8_t rx_data[ANT_USB_RX_DATA_SZ];
+    size_t rx_head, rx_tail;
+    pthread_mutex_t rx_lock;
+    int rx_completed;
+
+    /* bulk OUT transfer */
+    struct libusb_transfer *tx_transfer;
+    int tx_completed;
 } antusb_t;
 
-int ant_usb_find_nodes(ant_cb_foundnode *found_node, void *user);
+int ant_usb_context_init(ant_context_t *ctx);
+void ant_usb_context_fini(ant_context_t *ctx);
+int ant_usb_find_nodes(ant_context_t *ctx, ant_cb_foundnode *found_node, void *user);
+int ant_usb_wait_for_nodes(ant_context_t *ctx, unsigned timeout_ms);
 
 #endif /* __ant_usb_h__ */
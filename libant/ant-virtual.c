@@ -0,0 +1,845 @@
+/*
+ * This file is part of fitbitd.
+ *
+ * fitbitd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fitbitd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fitbitd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * An in-process Fitbit base with trackers in range, for exercising libant &
+ * libfitbit without hardware. The base answers ANT commands, & trackers
+ * beacon, accept a new device number, answer ops & send data banks in the
+ * same way as the real thing.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ant-private.h"
+#include "ant-virtual.h"
+#include "util.h"
+
+#define LOG_TAG "ant-virtual"
+#include "log.h"
+
+/* time the base takes to restart following a reset, in us */
+#define ANT_VIRTUAL_RESET_US 500000
+
+/* response codes */
+#define RESPONSE_NO_ERROR               0x00
+#define CHANNEL_IN_WRONG_STATE          0x15
+#define INVALID_MESSAGE                 0x28
+
+/* event codes */
+#define EVENT_TRANSFER_TX_COMPLETED     0x05
+#define EVENT_TRANSFER_TX_FAILED        0x06
+#define EVENT_CHANNEL_CLOSED            0x07
+
+/* a message sent by the base, received once ready */
+typedef struct ant_virtual_msg_s {
+    struct timespec ready;
+    uint8_t buf[ANT_MESSAGE_MAX_ENCODED];
+    size_t len, pos;
+    struct ant_virtual_msg_s *next;
+} ant_virtual_msg_t;
+
+typedef enum {
+    TRACKER_SEARCHING = 0,      /* beaconing on the wildcard device number */
+    TRACKER_HANDED_OVER,        /* beaconing on the device number it was given */
+    TRACKER_ASLEEP,             /* synced, silent until next time */
+} ant_virtual_tracker_state_t;
+
+typedef struct {
+    ant_virtual_tracker_state_t state;
+    uint8_t dev_num[2];
+    uint8_t info[12];
+
+    /* data banked by the last op, sent when the base asks for it */
+    uint8_t *bank;
+    size_t bank_len;
+    bool bank_short;
+
+    /* packet ID of an op awaiting its payload, or 0 */
+    uint8_t payload_pid;
+} ant_virtual_tracker_t;
+
+typedef struct {
+    bool assigned, open;
+    uint8_t type, net;
+    uint8_t dev_num[2];
+    uint8_t dev_type, trans_type;
+
+    /* in 1/32768ths of a second */
+    unsigned period;
+    struct timespec next_beacon;
+
+    /* the tracker found by the channel, or -1 */
+    int tracker;
+
+    /* burst being received from the host */
+    uint8_t *burst;
+    size_t burst_len;
+} ant_virtual_chan_t;
+
+typedef struct {
+    ant_t ant;
+    ant_virtual_config_t cfg;
+
+    /*
+     * read & write may be called from different threads at once, lock
+     * protects everything below & cond is signalled when output is queued
+     */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    /* decodes messages written by the host into rxmsg */
+    ant_decoder_t decoder;
+    ant_message_t rxmsg;
+
+    /* messages to be read by the host, in the order they become ready */
+    ant_virtual_msg_t *out_head, *out_tail;
+
+    ant_virtual_chan_t chans[ANT_MAX_CHANNELS];
+    ant_virtual_tracker_t trackers[ANT_VIRTUAL_MAX_TRACKERS];
+
+    /* bytes per burst packet, more than 8 once advanced bursts are enabled */
+    unsigned burst_packet_sz;
+
+    unsigned rand_state;
+    ant_virtual_stats_t stats;
+} antvirtual_t;
+
+static void ant_virtual_time(struct timespec *ts, unsigned delay_us)
+{
+    clock_gettime(CLOCK_MONOTONIC, ts);
+    ts->tv_sec += delay_us / 1000000;
+    ts->tv_nsec += (delay_us % 1000000) * 1000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+static bool ant_virtual_before(const struct timespec *a, const struct timespec *b)
+{
+    if (a->tv_sec != b->tv_sec)
+        return a->tv_sec < b->tv_sec;
+    return a->tv_nsec < b->tv_nsec;
+}
+
+/* time until ts, or 0 if it has passed, in us */
+static unsigned ant_virtual_until(const struct timespec *ts)
+{
+    struct timespec now;
+    int64_t us;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    us = (ts->tv_sec - now.tv_sec) * 1000000LL + (ts->tv_nsec - now.tv_nsec) / 1000;
+    return (us > 0) ? us : 0;
+}
+
+/* decide whether something with a pct percent chance happens */
+static bool ant_virtual_chance(antvirtual_t *av, unsigned pct)
+{
+    return pct && rand_r(&av->rand_state) % 100 < pct;
+}
+
+/* decide whether a packet sent over the air is lost */
+static bool ant_virtual_lost(antvirtual_t *av)
+{
+    if (!ant_virtual_chance(av, av->cfg.loss_pct))
+        return false;
+
+    av->stats.lost++;
+    return true;
+}
+
+static void ant_virtual_emit(antvirtual_t *av, unsigned delay_us, uint8_t id, uint8_t len, const uint8_t *data)
+{
+    ant_virtual_msg_t *vmsg, **pos;
+    ant_message_t msg;
+
+    vmsg = malloc(sizeof(*vmsg));
+    if (!vmsg) {
+        ERR("failed to alloc message\n");
+        return;
+    }
+
+    ant_message_init(&msg, id, len);
+    memcpy(msg.data, data, len);
+    if (ant_message_encode(&msg, vmsg->buf, sizeof(vmsg->buf), &vmsg->len)) {
+        free(vmsg);
+        return;
+    }
+    vmsg->pos = 0;
+    vmsg->next = NULL;
+
+    /*
+     * messages are delivered in the order they become ready, so a burst waiting
+     * for the tracker's channel period doesn't hold up command responses
+     */
+    ant_virtual_time(&vmsg->ready, delay_us);
+    for (pos = &av->out_head; *pos; pos = &(*pos)->next) {
+        if (ant_virtual_before(&vmsg->ready, &(*pos)->ready))
+            break;
+    }
+
+    vmsg->next = *pos;
+    *pos = vmsg;
+    if (!vmsg->next)
+        av->out_tail = vmsg;
+
+    pthread_cond_broadcast(&av->cond);
+}
+
+static void ant_virtual_respond(antvirtual_t *av, uint8_t chan, uint8_t msg_id, uint8_t code)
+{
+    uint8_t data[3] = { chan, msg_id, code };
+
+    ant_virtual_emit(av, av->cfg.latency_us, 0x40, sizeof(data), data);
+}
+
+static void ant_virtual_event(antvirtual_t *av, uint8_t chan, uint8_t code)
+{
+    ant_virtual_respond(av, chan, 0x01, code);
+}
+
+/* the tracker chan is tracking, looking for one if it isn't */
+static ant_virtual_tracker_t *ant_virtual_tracker(antvirtual_t *av, uint8_t chan)
+{
+    ant_virtual_chan_t *ch = &av->chans[chan];
+    ant_virtual_tracker_t *tracker;
+    bool wildcard;
+    int i, c;
+
+    if (!ch->open)
+        return NULL;
+    if (ch->tracker >= 0)
+        return &av->trackers[ch->tracker];
+
+    wildcard = ch->dev_num[0] == 0xff && ch->dev_num[1] == 0xff;
+
+    for (i = 0; i < av->cfg.trackers; i++) {
+        tracker = &av->trackers[i];
+
+        if (wildcard && tracker->state != TRACKER_SEARCHING)
+            continue;
+        if (!wildcard && (tracker->state != TRACKER_HANDED_OVER ||
+                          memcmp(tracker->dev_num, ch->dev_num, 2)))
+            continue;
+
+        /* a tracker only talks to one channel at a time */
+        for (c = 0; c < ANT_MAX_CHANNELS; c++) {
+            if (av->chans[c].open && av->chans[c].tracker == i)
+                break;
+        }
+        if (c < ANT_MAX_CHANNELS)
+            continue;
+
+        ch->tracker = i;
+        return tracker;
+    }
+
+    return NULL;
+}
+
+static void ant_virtual_tracker_acked(antvirtual_t *av, uint8_t chan, uint8_t pid, uint8_t code)
+{
+    uint8_t data[9] = { chan, pid, code };
+
+    if (ant_virtual_lost(av))
+        return;
+
+    ant_virtual_emit(av, av->cfg.latency_us, 0x4f, sizeof(data), data);
+}
+
+static void ant_virtual_tracker_burst(antvirtual_t *av, uint8_t chan, const uint8_t *buf, size_t len)
+{
+    uint8_t data[1 + ANT_BURST_PACKET_MAX];
+    unsigned delay_us = av->cfg.latency_us, when;
+    unsigned packet_sz = av->burst_packet_sz;
+    uint8_t seq = 0, id;
+    bool swapped = false;
+    size_t off;
+
+    av->stats.bursts++;
+
+    /* like a real tracker, the burst only starts on the next channel period */
+    if (av->chans[chan].open)
+        delay_us += ant_virtual_until(&av->chans[chan].next_beacon);
+
+    /* advanced burst packets take as long on air as legacy ones */
+    id = (packet_sz > ANT_BURST_PACKET_LEGACY) ? 0x72 : 0x50;
+
+    for (off = 0; off < len; off += packet_sz) {
+        data[0] = chan | (seq << 5);
+        if (off + packet_sz >= len)
+            data[0] |= 0x80;
+        seq = (seq % 3) + 1;
+
+        memset(&data[1], 0, packet_sz);
+        memcpy(&data[1], &buf[off], MIN(packet_sz, len - off));
+
+        /* a packet swapped with the next takes its slot & vice versa */
+        when = delay_us;
+        if (swapped) {
+            when -= av->cfg.burst_packet_us;
+            swapped = false;
+        } else if (!(data[0] & 0x80) && ant_virtual_chance(av, av->cfg.reorder_pct)) {
+            when += av->cfg.burst_packet_us;
+            swapped = true;
+            av->stats.reordered++;
+        }
+
+        if (!ant_virtual_lost(av)) {
+            ant_virtual_emit(av, when, id, 1 + packet_sz, data);
+
+            /* a duplicate arrives before the packet after it */
+            if (ant_virtual_chance(av, av->cfg.dup_pct)) {
+                ant_virtual_emit(av, when + av->cfg.burst_packet_us / 2, id, 1 + packet_sz, data);
+                av->stats.duplicated++;
+            }
+        }
+        delay_us += av->cfg.burst_packet_us;
+    }
+}
+
+/* send the tracker's banked data, preceded by its header */
+static void ant_virtual_tracker_send_bank(antvirtual_t *av, uint8_t chan, ant_virtual_tracker_t *tracker, uint8_t pid)
+{
+    uint8_t *buf, cksum = 0;
+    size_t i;
+
+    buf = calloc(1, 8 + tracker->bank_len);
+    if (!buf) {
+        ERR("failed to alloc burst\n");
+        return;
+    }
+
+    for (i = 0; i < tracker->bank_len; i++)
+        cksum ^= tracker->bank[i];
+
+    buf[0] = pid;
+    buf[1] = 0x81;
+    buf[2] = tracker->bank_len & 0xff;
+    buf[3] = (tracker->bank_len >> 8) & 0xff;
+    buf[7] = cksum;
+    memcpy(&buf[8], tracker->bank, tracker->bank_len);
+
+    ant_virtual_tracker_burst(av, chan, buf, 8 + (tracker->bank_short ?
+                                                  tracker->bank_len / 2 :
+                                                  tracker->bank_len));
+    free(buf);
+}
+
+/* the tracker's handling of acknowledged data from the base */
+static void ant_virtual_tracker_handle(antvirtual_t *av, uint8_t chan, ant_virtual_tracker_t *tracker, const uint8_t *data)
+{
+    ant_virtual_chan_t *ch = &av->chans[chan];
+    uint8_t pid = data[0];
+    size_t i;
+
+    if (data[0] == 0x78) {
+        if (data[1] == 0x02) {
+            /* move to the given device number */
+            memcpy(tracker->dev_num, &data[2], 2);
+            tracker->state = TRACKER_HANDED_OVER;
+            ch->tracker = -1;
+        }
+        return;
+    }
+
+    if (data[0] == 0x7f && data[1] == 0x03) {
+        /* sleep until the next sync */
+        tracker->state = TRACKER_ASLEEP;
+        ch->tracker = -1;
+        av->stats.synced++;
+        return;
+    }
+
+    switch (data[1]) {
+    case 0x70:
+        /* data bank request */
+        ant_virtual_tracker_send_bank(av, chan, tracker, pid);
+        return;
+
+    case 0x22:
+        /* read data, banked */
+        tracker->bank_len = av->cfg.bank_sz;
+        tracker->bank_short = av->cfg.short_banks;
+        for (i = 0; i < tracker->bank_len; i++)
+            tracker->bank[i] = (i + tracker->info[4]) & 0xff;
+        ant_virtual_tracker_acked(av, chan, pid, 0x42);
+        return;
+
+    case 0x23:
+        /* write data, which follows as a burst */
+        tracker->payload_pid = pid;
+        ant_virtual_tracker_acked(av, chan, pid, 0x61);
+        return;
+
+    case 0x24:
+        /* tracker info, banked */
+        memcpy(tracker->bank, tracker->info, sizeof(tracker->info));
+        tracker->bank_len = sizeof(tracker->info);
+        tracker->bank_short = false;
+        ant_virtual_tracker_acked(av, chan, pid, 0x42);
+        return;
+
+    default:
+        ant_virtual_tracker_acked(av, chan, pid, 0x41);
+        return;
+    }
+}
+
+static void ant_virtual_acked(antvirtual_t *av, uint8_t chan, const uint8_t *data)
+{
+    ant_virtual_tracker_t *tracker;
+
+    tracker = ant_virtual_tracker(av, chan);
+    if (!tracker || ant_virtual_lost(av)) {
+        ant_virtual_event(av, chan, EVENT_TRANSFER_TX_FAILED);
+        return;
+    }
+
+    av->stats.acked++;
+    ant_virtual_event(av, chan, EVENT_TRANSFER_TX_COMPLETED);
+    ant_virtual_tracker_handle(av, chan, tracker, data);
+}
+
+static void ant_virtual_burst_packet(antvirtual_t *av, uint8_t chan, const uint8_t *data, size_t len)
+{
+    ant_virtual_chan_t *ch = &av->chans[chan];
+    ant_virtual_tracker_t *tracker;
+    uint8_t *burst;
+
+    /* a new burst starts with sequence number 0 */
+    if (!(data[0] & 0x60))
+        ch->burst_len = 0;
+
+    burst = realloc(ch->burst, ch->burst_len + len);
+    if (!burst) {
+        ERR("failed to alloc burst\n");
+        return;
+    }
+    ch->burst = burst;
+    memcpy(&ch->burst[ch->burst_len], &data[1], len);
+    ch->burst_len += len;
+
+    if (!(data[0] & 0x80))
+        return;
+
+    tracker = ant_virtual_tracker(av, chan);
+    if (!tracker || ant_virtual_lost(av)) {
+        ant_virtual_event(av, chan, EVENT_TRANSFER_TX_FAILED);
+        return;
+    }
+
+    ant_virtual_event(av, chan, EVENT_TRANSFER_TX_COMPLETED);
+
+    /* the payload of a write op has arrived */
+    if (tracker->payload_pid) {
+        ant_virtual_tracker_acked(av, chan, tracker->payload_pid, 0x41);
+        tracker->payload_pid = 0;
+    }
+}
+
+static void ant_virtual_request(antvirtual_t *av, uint8_t chan, uint8_t msg_id)
+{
+    ant_virtual_chan_t *ch = &av->chans[chan];
+    uint8_t data[8], state;
+
+    switch (msg_id) {
+    case 0x54:
+        if (av->cfg.no_capabilities) {
+            ant_virtual_respond(av, chan, 0x4d, INVALID_MESSAGE);
+            break;
+        }
+
+        /* capabilities, advanced options 3 bit 0 is advanced burst */
+        memset(data, 0, sizeof(data));
+        data[0] = av->cfg.channels;
+        data[1] = 1;
+        data[6] = av->cfg.advanced_burst ? 0x01 : 0;
+        ant_virtual_emit(av, av->cfg.latency_us, 0x54, 8, data);
+        break;
+
+    case 0x51:
+        data[0] = chan;
+        memcpy(&data[1], ch->dev_num, 2);
+        data[3] = ch->dev_type;
+        data[4] = ch->trans_type;
+        ant_virtual_emit(av, av->cfg.latency_us, 0x51, 5, data);
+        break;
+
+    case 0x52:
+        if (av->cfg.no_channel_status) {
+            ant_virtual_respond(av, chan, 0x4d, INVALID_MESSAGE);
+            break;
+        }
+
+        if (ch->open)
+            state = (ch->tracker >= 0) ? ANT_CHANNEL_TRACKING : ANT_CHANNEL_SEARCHING;
+        else
+            state = ch->assigned ? ANT_CHANNEL_ASSIGNED : ANT_CHANNEL_UNASSIGNED;
+
+        data[0] = chan;
+        data[1] = state | (ch->net << 2) | (ch->type << 4);
+        ant_virtual_emit(av, av->cfg.latency_us, 0x52, 2, data);
+        break;
+
+    default:
+        ant_virtual_respond(av, chan, 0x4d, INVALID_MESSAGE);
+        break;
+    }
+}
+
+static void ant_virtual_reset(antvirtual_t *av)
+{
+    ant_virtual_msg_t *vmsg;
+    uint8_t zero = 0;
+    int i;
+
+    /* anything not yet read is lost */
+    while ((vmsg = av->out_head)) {
+        av->out_head = vmsg->next;
+        free(vmsg);
+    }
+    av->out_tail = NULL;
+    av->burst_packet_sz = ANT_BURST_PACKET_LEGACY;
+
+    for (i = 0; i < ANT_MAX_CHANNELS; i++) {
+        free(av->chans[i].burst);
+        memset(&av->chans[i], 0, sizeof(av->chans[i]));
+        av->chans[i].tracker = -1;
+    }
+
+    /* startup message */
+    ant_virtual_emit(av, ANT_VIRTUAL_RESET_US, 0x6f, 1, &zero);
+}
+
+/* the base's handling of a message from the host */
+static void ant_virtual_handle(antvirtual_t *av, ant_message_t *msg)
+{
+    ant_virtual_chan_t *ch;
+    uint8_t chan;
+
+    if (msg->id == 0x4a) {
+        av->stats.resets++;
+        ant_virtual_reset(av);
+        return;
+    }
+
+    if (msg->len < 1) {
+        ant_virtual_respond(av, 0, msg->id, INVALID_MESSAGE);
+        return;
+    }
+
+    /* network key & tx power aren't channel specific */
+    if (msg->id == 0x46 || msg->id == 0x47) {
+        ant_virtual_respond(av, msg->data[0], msg->id, RESPONSE_NO_ERROR);
+        return;
+    }
+
+    chan = msg->data[0] & 0x1f;
+    if (chan >= av->cfg.channels) {
+        ant_virtual_respond(av, chan, msg->id, INVALID_MESSAGE);
+        return;
+    }
+    ch = &av->chans[chan];
+
+    switch (msg->id) {
+    case 0x41:
+        /* unassign */
+        if (!ch->assigned || ch->open)
+            goto wrong_state;
+        ch->assigned = false;
+        break;
+
+    case 0x42:
+        /* assign */
+        if (ch->assigned)
+            goto wrong_state;
+        ch->assigned = true;
+        /* channel status reports the type's upper nibble */
+        ch->type = msg->data[1] >> 4;
+        ch->net = msg->data[2] & 0x03;
+        break;
+
+    case 0x43:
+        /* period */
+        ch->period = msg->data[1] | (msg->data[2] << 8);
+        break;
+
+    case 0x4b:
+        /* open */
+        if (!ch->assigned || ch->open)
+            goto wrong_state;
+        ch->open = true;
+        ch->tracker = -1;
+        ant_virtual_time(&ch->next_beacon, ch->period * 1000000ULL / 32768);
+        break;
+
+    case 0x4c:
+        /* close */
+        if (!ch->open)
+            goto wrong_state;
+        ch->open = false;
+        ch->tracker = -1;
+        ant_virtual_respond(av, chan, msg->id, RESPONSE_NO_ERROR);
+        ant_virtual_event(av, chan, EVENT_CHANNEL_CLOSED);
+        return;
+
+    case 0x4d:
+        ant_virtual_request(av, chan, msg->data[1]);
+        return;
+
+    case 0x4e:
+        /* broadcast data, nobody's listening */
+        return;
+
+    case 0x4f:
+        ant_virtual_acked(av, chan, &msg->data[1]);
+        return;
+
+    case 0x50:
+    case 0x72:
+        if (msg->len < 2)
+            goto invalid;
+        ant_virtual_burst_packet(av, chan, msg->data, msg->len - 1);
+        return;
+
+    case 0x51:
+        /* channel ID */
+        memcpy(ch->dev_num, &msg->data[1], 2);
+        ch->dev_type = msg->data[3];
+        ch->trans_type = msg->data[4];
+        break;
+
+    case 0x78:
+        /* advanced burst config, the first byte isn't a channel */
+        if (!av->cfg.advanced_burst || msg->len < 3 || msg->data[2] < 1 || msg->data[2] > 3)
+            goto invalid;
+        av->burst_packet_sz = msg->data[1] ? msg->data[2] * 8 : ANT_BURST_PACKET_LEGACY;
+        break;
+
+    default:
+        /* search timeout, frequency etc. make no difference here */
+        break;
+    }
+
+    ant_virtual_respond(av, chan, msg->id, RESPONSE_NO_ERROR);
+    return;
+
+invalid:
+    ant_virtual_respond(av, chan, msg->id, INVALID_MESSAGE);
+    return;
+
+wrong_state:
+    ant_virtual_respond(av, chan, msg->id, CHANNEL_IN_WRONG_STATE);
+}
+
+/*
+ * Send beacons from trackers found by open channels, returning the time the
+ * next is due in *next.
+ */
+static void ant_virtual_beacons(antvirtual_t *av, const struct timespec *now, struct timespec *next)
+{
+    ant_virtual_chan_t *ch;
+    uint8_t data[9];
+    int i;
+
+    for (i = 0; i < ANT_MAX_CHANNELS; i++) {
+        ch = &av->chans[i];
+        if (!ch->open)
+            continue;
+
+        if (!ant_virtual_before(now, &ch->next_beacon)) {
+            if (ant_virtual_tracker(av, i) && !ant_virtual_lost(av)) {
+                memset(data, 0, sizeof(data));
+                data[0] = i;
+                ant_virtual_emit(av, 0, 0x4e, sizeof(data), data);
+                av->stats.beacons++;
+            }
+            ant_virtual_time(&ch->next_beacon, ch->period * 1000000ULL / 32768);
+        }
+
+        if (ant_virtual_before(&ch->next_beacon, next))
+            *next = ch->next_beacon;
+    }
+}
+
+static ssize_t ant_virtual_read(ant_t *ant, uint8_t *buf, size_t sz, int timeout_ms)
+{
+    antvirtual_t *av = (antvirtual_t*)ant;
+    ant_virtual_msg_t *vmsg;
+    struct timespec now, deadline, wake;
+    size_t done = 0, cpy;
+
+    ant_virtual_time(&deadline, timeout_ms * 1000);
+
+    pthread_mutex_lock(&av->lock);
+
+    while (true) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        wake = deadline;
+        ant_virtual_beacons(av, &now, &wake);
+
+        if (av->out_head && !ant_virtual_before(&now, &av->out_head->ready))
+            break;
+
+        if (!ant_virtual_before(&now, &deadline)) {
+            pthread_mutex_unlock(&av->lock);
+            return -1;
+        }
+
+        if (av->out_head && ant_virtual_before(&av->out_head->ready, &wake))
+            wake = av->out_head->ready;
+        pthread_cond_timedwait(&av->cond, &av->lock, &wake);
+    }
+
+    /* return as much of whatever is ready as fits */
+    while ((vmsg = av->out_head) && done < sz &&
+           !ant_virtual_before(&now, &vmsg->ready)) {
+        cpy = MIN(sz - done, vmsg->len - vmsg->pos);
+        memcpy(&buf[done], &vmsg->buf[vmsg->pos], cpy);
+        vmsg->pos += cpy;
+        done += cpy;
+
+        if (vmsg->pos < vmsg->len)
+            break;
+
+        av->out_head = vmsg->next;
+        if (!av->out_head)
+            av->out_tail = NULL;
+        free(vmsg);
+    }
+
+    pthread_mutex_unlock(&av->lock);
+    return done;
+}
+
+static ssize_t ant_virtual_write(ant_t *ant, uint8_t *buf, size_t sz)
+{
+    antvirtual_t *av = (antvirtual_t*)ant;
+    size_t off, used;
+
+    pthread_mutex_lock(&av->lock);
+
+    for (off = 0; off < sz; off += used) {
+        if (ant_decoder_feed(&av->decoder, &buf[off], sz - off, &used, &av->rxmsg))
+            ant_virtual_handle(av, &av->rxmsg);
+    }
+
+    pthread_mutex_unlock(&av->lock);
+    return sz;
+}
+
+static void ant_virtual_destroy(ant_t *ant)
+{
+    antvirtual_t *av = (antvirtual_t*)ant;
+    ant_virtual_msg_t *vmsg;
+    int i;
+
+    DBG("destroy %s\n", ant->name);
+
+    while ((vmsg = av->out_head)) {
+        av->out_head = vmsg->next;
+        free(vmsg);
+    }
+
+    for (i = 0; i < ANT_MAX_CHANNELS; i++)
+        free(av->chans[i].burst);
+    for (i = 0; i < ANT_VIRTUAL_MAX_TRACKERS; i++)
+        free(av->trackers[i].bank);
+
+    pthread_cond_destroy(&av->cond);
+    pthread_mutex_destroy(&av->lock);
+    free(av);
+}
+
+ant_t *ant_virtual_create(const ant_virtual_config_t *cfg)
+{
+    antvirtual_t *av;
+    ant_virtual_tracker_t *tracker;
+    pthread_condattr_t attr;
+    int i;
+
+    if (cfg->trackers > ANT_VIRTUAL_MAX_TRACKERS) {
+        ERR("too many trackers\n");
+        return NULL;
+    }
+
+    av = calloc(1, sizeof(*av));
+    if (!av)
+        goto err;
+
+    ant_init(&av->ant);
+    snprintf(av->ant.name, sizeof(av->ant.name), "antvirt");
+    av->ant.destroy = ant_virtual_destroy;
+    av->ant.read = ant_virtual_read;
+    av->ant.write = ant_virtual_write;
+
+    av->cfg = *cfg;
+    if (av->cfg.channels <= 0 || av->cfg.channels > ANT_MAX_CHANNELS)
+        av->cfg.channels = ANT_MAX_CHANNELS;
+    av->rand_state = cfg->seed;
+    ant_decoder_reset(&av->decoder);
+    av->burst_packet_sz = ANT_BURST_PACKET_LEGACY;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&av->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&av->lock, NULL);
+
+    for (i = 0; i < ANT_MAX_CHANNELS; i++)
+        av->chans[i].tracker = -1;
+
+    for (i = 0; i < cfg->trackers; i++) {
+        tracker = &av->trackers[i];
+
+        tracker->bank = malloc(MAX(cfg->bank_sz, sizeof(tracker->info)));
+        if (!tracker->bank) {
+            ant_virtual_destroy(&av->ant);
+            goto err;
+        }
+
+        /* serial, firmware, BSL & app versions, then charging */
+        tracker->info[0] = 0xf1;
+        tracker->info[1] = 0x7b;
+        tracker->info[4] = i;
+        tracker->info[5] = 0x0c;
+        tracker->info[6] = 4;
+        tracker->info[8] = 4;
+        tracker->info[9] = 36;
+    }
+
+    return &av->ant;
+err:
+    ERR("failed to alloc virtual device\n");
+    return NULL;
+}
+
+void ant_virtual_get_stats(ant_t *ant, ant_virtual_stats_t *stats)
+{
+    antvirtual_t *av = (antvirtual_t*)ant;
+
+    pthread_mutex_lock(&av->lock);
+    *stats = av->stats;
+    pthread_mutex_unlock(&av->lock);
+}
@@ -0,0 +1,84 @@
+/*
+ * This file is part of fitbitd.
+ *
+ * fitbitd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fitbitd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fitbitd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __ant_virtual_h__
+#define __ant_virtual_h__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "ant.h"
+
+/* maximum number of trackers a virtual base can have in range */
+#define ANT_VIRTUAL_MAX_TRACKERS 16
+
+typedef struct {
+    /* number of trackers in range */
+    int trackers;
+
+    /* delay before the device's response to anything is received, in us */
+    unsigned latency_us;
+
+    /* time taken by each packet of a burst from a tracker, in us */
+    unsigned burst_packet_us;
+
+    /* percentage of packets sent over the air which are lost */
+    unsigned loss_pct;
+
+    /*
+     * percentages of burst packets from trackers which are received twice,
+     * or swapped with the packet after them
+     */
+    unsigned dup_pct;
+    unsigned reorder_pct;
+
+    /* size of the data bank returned for op 0x22 */
+    size_t bank_sz;
+
+    /* seed for the packet loss, so runs can be repeated */
+    unsigned seed;
+
+    /* the base & trackers support advanced bursts */
+    bool advanced_burst;
+
+    /* channels the base has, up to ANT_MAX_CHANNELS which 0 also means */
+    int channels;
+
+    /* the base doesn't answer channel status requests, as older ones don't */
+    bool no_channel_status;
+
+    /* the base doesn't answer capabilities requests */
+    bool no_capabilities;
+
+    /* trackers end op 0x22's bank halfway, short of what its header says */
+    bool short_banks;
+} ant_virtual_config_t;
+
+typedef struct {
+    unsigned long beacons;
+    unsigned long acked;
+    unsigned long bursts;
+    unsigned long lost;
+    unsigned long duplicated;
+    unsigned long reordered;
+    unsigned long resets;
+    int synced;
+} ant_virtual_stats_t;
+
+ant_t *ant_virtual_create(const ant_virtual_config_t *cfg);
+void ant_virtual_get_stats(ant_t *ant, ant_virtual_stats_t *stats);
+
+#endif /* __ant_virtual_h__ */
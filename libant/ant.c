@@ -15,10 +15,16 @@
  * along with fitbitd.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "ant.h"
+#include "ant-capture.h"
 #include "ant-message.h"
 #include "ant-private.h"
 #include "ant-usb.h"
@@ -27,6 +33,25 @@
 #define LOG_TAG "ant"
 #include "log.h"
 
+/* timeouts for the various exchanges, in ms */
+#define ANT_TIMEOUT_TRANSFER    2000    /* burst transfer event */
+#define ANT_TIMEOUT_RECEIVE     100     /* ant_receive */
+
+/* time to wait for a channel to close once the device has accepted the command */
+#define ANT_TIMEOUT_CLOSE       1000
+
+/* timeout of each read by the I/O thread, so that it notices being stopped */
+#define ANT_IO_PERIOD           20
+
+/* number of burst packets written in a single transfer */
+#define ANT_BURST_BATCH 8
+
+/* default gap between burst packets once pacing is required, in us */
+#define ANT_BURST_GAP_DEFAULT 10000
+
+/* number of bursts paced after the device overflows, unless it does again */
+#define ANT_BURST_PACED 8
+
 static void dump_buffer(char *dir, uint8_t *buf, size_t sz)
 {
 #if DEBUG == 1
@@ -44,18 +69,14 @@ static void dump_buffer(char *dir, uint8_t *buf, size_t sz)
 #endif
 }
 
-static int ant_send_message(ant_t *ant, ant_message_t *msg)
+static int ant_write(ant_t *ant, uint8_t *buf, size_t len)
 {
-    uint8_t buf[256+4];
     ssize_t written;
-    size_t len;
-    int ret;
-
-    ret = ant_message_encode(msg, buf, sizeof(buf), &len);
-    if (ret)
-        return ret;
 
-    dump_buffer(">>", buf, len);
+    if (ant->capture)
+        ant_capture_record(ant->capture, ant->name, ANT_CAPTURE_TX, buf, len);
+    else
+        dump_buffer(">>", buf, len);
 
     written = ant->write(ant, buf, len);
     if (written != len) {
@@ -66,584 +87,1838 @@ static int ant_send_message(ant_t *ant, ant_message_t *msg)
     return 0;
 }
 
-static ant_message_t *ant_read_message(ant_t *ant)
+static int ant_batch_flush(ant_t *ant)
 {
-    ssize_t bytes;
-    size_t len;
-    ant_message_t *msg;
-
-    /* TODO: cyclic buffer? */
-
-    do {
-        msg = NULL;
-        if (ant->recvbuf_sz) {
-            msg = ant_message_decode(ant->recvbuf, ant->recvbuf_sz, &len);
-            if (len) {
-                memmove(ant->recvbuf, &ant->recvbuf[len], ant->recvbuf_sz - len);
-                ant->recvbuf_sz -= len;
-            }
-        }
-        if (msg)
-            return msg;
+    int ret;
 
-        bytes = ant->read(ant, &ant->recvbuf[ant->recvbuf_sz], sizeof(ant->recvbuf) - ant->recvbuf_sz);
-        if (bytes > 0) {
-            dump_buffer("<<", &ant->recvbuf[ant->recvbuf_sz], bytes);
-            ant->recvbuf_sz += bytes;
-        }
-    } while (bytes > 0);
+    if (!ant->txbuf_sz)
+        return 0;
 
-    return NULL;
+    ret = ant_write(ant, ant->txbuf, ant->txbuf_sz);
+    ant->txbuf_sz = 0;
+    return ret;
 }
 
-static int ant_read_response(ant_t *ant, uint8_t msg_id, uint8_t *code)
+/* true if the calling thread is batching messages */
+static bool ant_batch_owned(ant_t *ant)
 {
-    int attempts = 20;
-    struct timespec ts;
-    ant_message_t *msg = NULL;
+    return ant->batching && pthread_equal(ant->batch_owner, pthread_self());
+}
 
-    memset(&ts, 0, sizeof(ts));
-    ts.tv_nsec = 100 * 1000000; /* 100ms */
+static int ant_send_message(ant_t *ant, ant_message_t *msg)
+{
+    uint8_t buf[ANT_MESSAGE_MAX_ENCODED];
+    size_t len;
+    int ret;
 
-    while (attempts--) {
-        msg = ant_read_message(ant);
-        if (!msg) {
-            nanosleep(&ts, NULL);
-            continue;
-        }
+    if (!ant_batch_owned(ant)) {
+        ret = ant_message_encode(msg, buf, sizeof(buf), &len);
+        if (ret)
+            return ret;
 
-        if (msg->id != 0x40) {
-            ant_message_destroy(msg);
-            msg = NULL;
-            nanosleep(&ts, NULL);
-            continue;
-        }
+        return ant_write(ant, buf, len);
+    }
 
-        if (msg->len < 3) {
-            ERR("response too short\n");
-            goto err;
-        }
+    /* make room in the batch if necessary */
+    if (ant->txbuf_sz + msg->len + 4 > ANT_TXBUF_SZ) {
+        ret = ant_batch_flush(ant);
+        if (ret)
+            return ret;
+    }
 
-        if (msg->data[1] != msg_id) {
-            if (msg->data[1] != 1) {
-                /* not an RF event */
-                ERR("response for wrong id=0x%02x\n", msg->data[1]);
-            }
-            goto err;
-        }
+    ret = ant_message_encode(msg, &ant->txbuf[ant->txbuf_sz],
+                             ANT_TXBUF_SZ - ant->txbuf_sz, &len);
+    if (ret)
+        return ret;
 
-        /* valid response */
+    ant->txbuf_sz += len;
+    return 0;
+}
 
-        if (code)
-            *code = msg->data[2];
+void ant_deadline_set(struct timespec *deadline, unsigned timeout_ms)
+{
+    clock_gettime(CLOCK_MONOTONIC, deadline);
 
-        ant_message_destroy(msg);
-        msg = NULL;
-        return 0;
+    deadline->tv_sec += timeout_ms / 1000;
+    deadline->tv_nsec += (timeout_ms % 1000) * 1000000;
+    if (deadline->tv_nsec >= 1000000000) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
     }
-
-err:
-    if (msg != NULL)
-        ant_message_destroy(msg);
-    return -1;
 }
 
-static int ant_check_ok(ant_t *ant, uint8_t msg_id)
+/* returns the number of ms until deadline, rounded up, or 0 if it has passed */
+int ant_deadline_remaining(const struct timespec *deadline)
 {
-    int ret, attempts = 20;
-    struct timespec ts;
-    uint8_t code;
+    struct timespec now;
+    long long ns;
 
-    memset(&ts, 0, sizeof(ts));
-    ts.tv_nsec = 100 * 1000000; /* 100ms */
+    clock_gettime(CLOCK_MONOTONIC, &now);
 
-    while (attempts--) {
-        ret = ant_read_response(ant, msg_id, &code);
-        if (ret) {
-            nanosleep(&ts, NULL);
-            continue;
-        }
+    ns = (deadline->tv_sec - now.tv_sec) * 1000000000LL;
+    ns += deadline->tv_nsec - now.tv_nsec;
+    if (ns <= 0)
+        return 0;
 
-        if (code) {
-            ERR("response code %d\n", code);
-            goto err;
-        }
+    return (ns + 999999) / 1000000;
+}
 
-        /* all good */
-        break;
-    }
+static uint64_t ant_now_us(void)
+{
+    struct timespec now;
 
-    return 0;
-err:
-    return -1;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
 }
 
-int ant_find_nodes(ant_cb_foundnode *found_node, void *user)
+static void ant_histogram_add(ant_latency_t *lat, unsigned long us)
 {
-    int count = 0;
+    int bucket = 0;
 
-    count += ant_usb_find_nodes(found_node, user);
+    while (bucket < ANT_LATENCY_BUCKETS - 1 &&
+           us >= ((unsigned long)ANT_LATENCY_BUCKET0_US << bucket))
+        bucket++;
 
-    return count;
+    lat->count++;
+    lat->total_us += us;
+    lat->max_us = MAX(lat->max_us, us);
+    lat->buckets[bucket]++;
 }
 
-void ant_destroy(ant_t *ant)
+/* record an exchange for msg_id which began at start_us, returning its length */
+static unsigned long ant_latency_record(ant_t *ant, uint8_t msg_id, uint64_t start_us)
 {
-    ant->destroy(ant);
+    unsigned long us = ant_now_us() - start_us;
+
+    ant_histogram_add(&ant->latency[msg_id], us);
+    return us;
 }
 
-bool ant_is_dead(ant_t *ant)
+/*
+ * Timeouts for each kind of exchange, in ms. They start out at initial & are
+ * then derived from the round trip times seen, within min & max.
+ */
+static const struct {
+    unsigned initial, min, max;
+} ant_rto_bounds[ANT_XCHG_TYPES] = {
+    [ANT_XCHG_COMMAND]     = { 2000,   50,  4000 },
+    [ANT_XCHG_TRANSFER]    = { 2000,  250,  4000 },
+    [ANT_XCHG_ACKED]       = { 2000,  250,  4000 },
+    [ANT_XCHG_BURST]       = { 2000,  100,  4000 },
+    /* a tracker only starts a burst on its next channel period, ~125ms */
+    [ANT_XCHG_BURST_START] = { 2000,  250,  4000 },
+    [ANT_XCHG_REQUEST]     = {  500,   50,  2000 },
+    [ANT_XCHG_STARTUP]     = { 1500,  500,  3000 },
+    [ANT_XCHG_BEACON]      = { 5000, 2000, 10000 },
+};
+
+/* granularity of the timeouts, in us */
+#define ANT_RTO_GRANULARITY 1000
+
+/* the round trip of the link to the device, in whole ms */
+static inline unsigned ant_link_ms(ant_t *ant)
 {
-    return ant->dead;
+    return (ant->link_rtt_us + 999) / 1000;
 }
 
-int ant_receive(ant_t *ant, uint8_t *msg_id, uint8_t *len, uint8_t *buf, size_t sz)
+static void ant_rto_update(ant_t *ant, ant_exchange_t xchg, unsigned long rtt_us)
 {
-    ant_message_t *msg;
-
-    msg = ant_read_message(ant);
-    if (!msg)
-        return -1;
+    ant_rto_t *rto = &ant->rto[xchg];
+    unsigned long err, rto_us;
+
+    if (!rto->sampled) {
+        rto->srtt_us = rtt_us;
+        rto->rttvar_us = rtt_us / 2;
+        rto->sampled = true;
+    } else {
+        err = (rto->srtt_us > rtt_us) ? rto->srtt_us - rtt_us : rtt_us - rto->srtt_us;
+        rto->rttvar_us = (3 * rto->rttvar_us + err) / 4;
+        rto->srtt_us = (7 * rto->srtt_us + rtt_us) / 8;
+    }
 
-    DBG("received message 0x%02x\n", msg->id);
+    rto_us = rto->srtt_us + MAX(ANT_RTO_GRANULARITY, 4 * rto->rttvar_us);
+    rto->rto_ms = (rto_us + 999) / 1000;
+    rto->rto_ms = MAX(rto->rto_ms, ant_rto_bounds[xchg].min + ant_link_ms(ant));
+    rto->rto_ms = MIN(rto->rto_ms, ant_rto_bounds[xchg].max + ant_link_ms(ant));
+}
 
-    if (msg_id)
-        *msg_id = msg->id;
-    if (len)
-        *len = msg->len;
-    if (buf)
-        memcpy(buf, msg->data, sz < msg->len ? sz : msg->len);
+/* back off until the next successful exchange */
+static void ant_rto_backoff(ant_t *ant, ant_exchange_t xchg)
+{
+    ant_rto_t *rto = &ant->rto[xchg];
 
-    ant_message_destroy(msg);
-    return 0;
+    rto->rto_ms = MIN(rto->rto_ms * 2, ant_rto_bounds[xchg].max + ant_link_ms(ant));
 }
 
-int ant_poll(ant_t *ant)
+/*
+ * Remote devices add the round trip of their link to every exchange, so the
+ * bounds of each timeout are raised by it. Timeouts which haven't been derived
+ * from any exchange yet are moved along with them.
+ */
+void ant_set_link_rtt(ant_t *ant, unsigned long rtt_us)
 {
-    int count = 0;
+    ant_rto_t *rto;
+    int i;
 
-    while (!ant_receive(ant, NULL, NULL, NULL, 0))
-        count++;
+    pthread_mutex_lock(&ant->lock);
 
-    return count;
+    ant->link_rtt_us = rtt_us;
+
+    for (i = 0; i < ANT_XCHG_TYPES; i++) {
+        rto = &ant->rto[i];
+        if (!rto->sampled)
+            rto->rto_ms = ant_rto_bounds[i].initial + ant_link_ms(ant);
+        rto->rto_ms = MAX(rto->rto_ms, ant_rto_bounds[i].min + ant_link_ms(ant));
+        rto->rto_ms = MIN(rto->rto_ms, ant_rto_bounds[i].max + ant_link_ms(ant));
+    }
+
+    pthread_mutex_unlock(&ant->lock);
 }
 
-int ant_unassign_channel(ant_t *ant, uint8_t chan)
+typedef bool (ant_match_fn)(ant_message_t *msg, void *arg);
+
+static ant_queue_t *ant_queue_for(ant_t *ant, ant_message_t *msg)
 {
-    ant_message_t *msg;
+    ant_queue_class_t cls;
+    uint8_t chan;
+
+    switch (msg->id) {
+    case 0x40:
+        /* channel response or event */
+        if (msg->len < 3)
+            return &ant->queue_global;
+        chan = msg->data[0];
+        cls = (msg->data[1] == 0x01) ? ANT_QUEUE_EVENT : ANT_QUEUE_RESPONSE;
+        break;
 
-    CHAINERR_NULL(msg, ant_message_create(0x41, 1), err);
-    msg->data[0] = chan;
+    case 0x4e:
+    case 0x4f:
+    case 0x50:
+    case 0x72:
+        /* data, burst packets carry a sequence number in the upper bits */
+        if (msg->len < 1)
+            return &ant->queue_global;
+        chan = msg->data[0] & 0x1f;
+        cls = ANT_QUEUE_DATA;
+        break;
 
-    CHAINERR_LTZ(ant_send_message(ant, msg), err);
-    ant_message_destroy(msg);
-    msg = NULL;
-    CHAINERR_LTZ(ant_check_ok(ant, 0x41), err);
+    default:
+        return &ant->queue_global;
+    }
 
-    return 0;
-err:
-    if (msg)
-        ant_message_destroy(msg);
-    return -1;
+    if (chan >= ANT_MAX_CHANNELS)
+        return &ant->queue_global;
+
+    return &ant->queues[chan][cls];
 }
 
-int ant_assign_channel(ant_t *ant, uint8_t chan, uint8_t type, uint8_t net)
+static ant_qmsg_t *ant_queue_oldest(ant_t *ant, ant_queue_t **queue)
 {
-    ant_message_t *msg = NULL;
+    ant_qmsg_t *oldest = NULL;
+    ant_queue_t *q;
+    int chan, cls;
+
+    q = &ant->queue_global;
+    if (q->head) {
+        oldest = q->head;
+        *queue = q;
+    }
 
-    CHAINERR_NULL(msg, ant_message_create(0x42, 4), err);
-    msg->data[0] = chan;
-    msg->data[1] = type;
-    msg->data[2] = net;
-    msg->data[3] = 0x00; /* extended */
+    for (chan = 0; chan < ANT_MAX_CHANNELS; chan++) {
+        for (cls = 0; cls < ANT_QUEUE_CLASSES; cls++) {
+            q = &ant->queues[chan][cls];
+            if (!q->head)
+                continue;
+            if (oldest && oldest->seq < q->head->seq)
+                continue;
+            oldest = q->head;
+            *queue = q;
+        }
+    }
 
-    CHAINERR_LTZ(ant_send_message(ant, msg), err);
-    ant_message_destroy(msg);
-    msg = NULL;
-    CHAINERR_LTZ(ant_check_ok(ant, 0x42), err);
+    return oldest;
+}
 
-    return 0;
-err:
-    if (msg)
-        ant_message_destroy(msg);
-    return -1;
+static void ant_queue_unlink(ant_t *ant, ant_queue_t *q, ant_qmsg_t *prev, ant_qmsg_t *qmsg)
+{
+    if (prev)
+        prev->next = qmsg->next;
+    else
+        q->head = qmsg->next;
+    if (q->tail == qmsg)
+        q->tail = prev;
+    q->len--;
+
+    qmsg->next = ant->qfree;
+    ant->qfree = qmsg;
 }
 
-int ant_set_channel_period(ant_t *ant, uint8_t chan, uint8_t period[2])
+static void ant_queue_flush(ant_t *ant, ant_queue_t *q)
 {
-    ant_message_t *msg = NULL;
+    while (q->head)
+        ant_queue_unlink(ant, q, NULL, q->head);
+}
 
-    CHAINERR_NULL(msg, ant_message_create(0x43, 3), err);
-    msg->data[0] = chan;
-    memcpy(&msg->data[1], period, 2);
+/* whether a batch is yet to check the response to msg_id on chan */
+static bool ant_response_pending(ant_t *ant, uint8_t chan, uint8_t msg_id)
+{
+    int i;
 
-    CHAINERR_LTZ(ant_send_message(ant, msg), err);
-    ant_message_destroy(msg);
-    msg = NULL;
-    CHAINERR_LTZ(ant_check_ok(ant, 0x43), err);
+    for (i = 0; i < ant->npending; i++) {
+        if (ant->pending[i].chan == chan && ant->pending[i].msg_id == msg_id)
+            return true;
+    }
 
-    return 0;
-err:
-    if (msg)
-        ant_message_destroy(msg);
-    return -1;
+    return false;
 }
 
-int ant_set_channel_search_timeout(ant_t *ant, uint8_t chan, uint8_t timeout)
+static void ant_queue_flush_channel(ant_t *ant, uint8_t chan)
 {
-    ant_message_t *msg = NULL;
+    ant_qmsg_t *qmsg, *prev = NULL, *next;
+    ant_queue_t *q;
+    int cls;
 
-    CHAINERR_NULL(msg, ant_message_create(0x44, 2), err);
-    msg->data[0] = chan;
-    msg->data[1] = timeout;
+    if (chan >= ANT_MAX_CHANNELS)
+        return;
 
-    CHAINERR_LTZ(ant_send_message(ant, msg), err);
-    ant_message_destroy(msg);
-    msg = NULL;
-    CHAINERR_LTZ(ant_check_ok(ant, 0x44), err);
+    for (cls = 0; cls < ANT_QUEUE_CLASSES; cls++) {
+        if (cls != ANT_QUEUE_RESPONSE)
+            ant_queue_flush(ant, &ant->queues[chan][cls]);
+    }
 
-    return 0;
-err:
-    if (msg)
-        ant_message_destroy(msg);
-    return -1;
+    /* keep responses which the batch in progress will check */
+    q = &ant->queues[chan][ANT_QUEUE_RESPONSE];
+    for (qmsg = q->head; qmsg; qmsg = next) {
+        next = qmsg->next;
+        if (ant_response_pending(ant, chan, qmsg->msg.data[1]))
+            prev = qmsg;
+        else
+            ant_queue_unlink(ant, q, prev, qmsg);
+    }
 }
 
-int ant_set_channel_freq(ant_t *ant, uint8_t chan, uint8_t freq)
+static void ant_queue_flush_all(ant_t *ant)
 {
-    ant_message_t *msg = NULL;
+    int chan;
 
-    CHAINERR_NULL(msg, ant_message_create(0x45, 2), err);
-    msg->data[0] = chan;
-    msg->data[1] = freq;
+    for (chan = 0; chan < ANT_MAX_CHANNELS; chan++)
+        ant_queue_flush_channel(ant, chan);
+    ant_queue_flush(ant, &ant->queue_global);
+}
 
-    CHAINERR_LTZ(ant_send_message(ant, msg), err);
-    ant_message_destroy(msg);
-    msg = NULL;
-    CHAINERR_LTZ(ant_check_ok(ant, 0x45), err);
+static ant_queue_t *ant_queue_longest(ant_t *ant)
+{
+    ant_queue_t *q, *longest = &ant->queue_global;
+    int chan, cls;
+
+    for (chan = 0; chan < ANT_MAX_CHANNELS; chan++) {
+        for (cls = 0; cls < ANT_QUEUE_CLASSES; cls++) {
+            q = &ant->queues[chan][cls];
+            if (q->len > longest->len)
+                longest = q;
+        }
+    }
 
-    return 0;
-err:
-    if (msg)
-        ant_message_destroy(msg);
-    return -1;
+    return longest;
 }
 
-int ant_set_network_key(ant_t *ant, uint8_t net, uint8_t key[8])
+static ant_qmsg_t *ant_queue_alloc(ant_t *ant)
 {
-    ant_message_t *msg = NULL;
+    ant_queue_t *q;
+    ant_qmsg_t *qmsg;
+
+    if (!ant->qfree) {
+        /*
+         * no free slots, drop the oldest message from the longest queue so
+         * that a channel nobody is reading can't starve the others
+         */
+        q = ant_queue_longest(ant);
+        qmsg = q->head;
+        DBG("queue full, dropping message 0x%02x\n", qmsg->msg.id);
+        ant_queue_unlink(ant, q, NULL, qmsg);
+        ant->qdropped++;
+    }
 
-    CHAINERR_NULL(msg, ant_message_create(0x46, 9), err);
-    msg->data[0] = net;
-    memcpy(&msg->data[1], key, 8);
+    qmsg = ant->qfree;
+    ant->qfree = qmsg->next;
+    return qmsg;
+}
 
-    CHAINERR_LTZ(ant_send_message(ant, msg), err);
-    ant_message_destroy(msg);
-    msg = NULL;
-    CHAINERR_LTZ(ant_check_ok(ant, 0x46), err);
+static void ant_queue_push(ant_t *ant, ant_qmsg_t *qmsg)
+{
+    ant_queue_t *q;
+
+    qmsg->seq = ant->qseq++;
+    qmsg->next = NULL;
+
+    q = ant_queue_for(ant, &qmsg->msg);
+    if (q->tail)
+        q->tail->next = qmsg;
+    else
+        q->head = qmsg;
+    q->tail = qmsg;
+    q->len++;
+}
 
-    return 0;
-err:
-    if (msg)
-        ant_message_destroy(msg);
-    return -1;
+/*
+ * Decode a message from data which has already been received, straight into
+ * the queue slot it will be handed out from. Returns NULL once the received
+ * data is used up, any partial message stays in ant->rxmsg.
+ */
+static ant_qmsg_t *ant_decode_message(ant_t *ant)
+{
+    ant_qmsg_t *qmsg;
+    size_t used, off, span;
+    bool complete;
+
+    while (ant_recvbuf_used(ant)) {
+        if (!ant->rxmsg)
+            ant->rxmsg = ant_queue_alloc(ant);
+
+        off = ant->recv_head & (ANT_RECVBUF_SZ - 1);
+        span = MIN(ant_recvbuf_used(ant), ANT_RECVBUF_SZ - off);
+
+        complete = ant_decoder_feed(&ant->decoder, &ant->recvbuf[off], span, &used, &ant->rxmsg->msg);
+        ant->recv_head += used;
+        if (complete) {
+            qmsg = ant->rxmsg;
+            ant->rxmsg = NULL;
+            return qmsg;
+        }
+    }
+
+    return NULL;
 }
 
-int ant_set_tx_power(ant_t *ant, uint8_t pwr)
+static int ant_queue_take(ant_t *ant, ant_queue_t *q, ant_match_fn *match, void *arg, ant_message_t *msg)
 {
-    ant_message_t *msg = NULL;
+    ant_qmsg_t *qmsg, *prev = NULL;
 
-    CHAINERR_NULL(msg, ant_message_create(0x47, 2), err);
-    msg->data[0] = 0x00;
-    msg->data[1] = pwr;
+    for (qmsg = q->head; qmsg; prev = qmsg, qmsg = qmsg->next) {
+        if (match && !match(&qmsg->msg, arg))
+            continue;
 
-    CHAINERR_LTZ(ant_send_message(ant, msg), err);
-    ant_message_destroy(msg);
-    msg = NULL;
-    CHAINERR_LTZ(ant_check_ok(ant, 0x47), err);
+        if (msg)
+            memcpy(msg, &qmsg->msg, offsetof(ant_message_t, data) + qmsg->msg.len);
+        ant_queue_unlink(ant, q, prev, qmsg);
+        return 0;
+    }
 
-    return 0;
-err:
-    if (msg)
-        ant_message_destroy(msg);
     return -1;
 }
 
-int ant_reset(ant_t *ant)
+/*
+ * Read from the device for up to timeout_ms & sort the received messages into
+ * the queues. Returns the number of messages received. If another thread is
+ * already reading then wait for it to dispatch instead. Called with the lock
+ * held, which is released whilst waiting.
+ */
+static int ant_dispatch(ant_t *ant, int timeout_ms)
 {
-    ant_message_t *msg = NULL;
+    struct timespec deadline;
+    ant_qmsg_t *qmsg;
+    ssize_t bytes;
+    size_t off, span;
+    uint64_t wake_us, now_us;
+    int count = 0;
 
-    CHAINERR_NULL(msg, ant_message_create(0x4a, 1), err);
-    msg->data[0] = 0x00;
+    if (ant->reading ||
+        (ant->io_running && !pthread_equal(ant->io_thread, pthread_self()))) {
+        if (timeout_ms) {
+            ant_deadline_set(&deadline, timeout_ms);
+            pthread_cond_timedwait(&ant->cond, &ant->lock, &deadline);
+        }
+        return 0;
+    }
 
-    CHAINERR_LTZ(ant_send_message(ant, msg), err);
-    ant_message_destroy(msg);
-    msg = NULL;
+    /* read into the contiguous free space following the tail */
+    off = ant->recv_tail & (ANT_RECVBUF_SZ - 1);
+    span = MIN(ant_recvbuf_free(ant), ANT_RECVBUF_SZ - off);
+
+    ant->reading = true;
+    pthread_mutex_unlock(&ant->lock);
+    wake_us = ant_now_us() + (uint64_t)timeout_ms * 1000;
+    bytes = ant->read(ant, &ant->recvbuf[off], span, timeout_ms);
+    now_us = ant_now_us();
+    pthread_mutex_lock(&ant->lock);
+    ant->reading = false;
+
+    /*
+     * a read which timed out should have returned at the deadline, anything
+     * later is how long the reader waited to be scheduled
+     */
+    if (bytes <= 0 && timeout_ms && !ant->dead)
+        ant_histogram_add(&ant->jitter, MAX(now_us, wake_us) - wake_us);
+
+    if (bytes > 0) {
+        if (ant->capture)
+            ant_capture_record(ant->capture, ant->name, ANT_CAPTURE_RX, &ant->recvbuf[off], bytes);
+        else
+            dump_buffer("<<", &ant->recvbuf[off], bytes);
+        ant->recv_tail += bytes;
+    }
 
-    ant->recvbuf_sz = 0;
+    while ((qmsg = ant_decode_message(ant))) {
+        ant_queue_push(ant, qmsg);
+        count++;
+    }
 
-    return 0;
-err:
-    if (msg)
-        ant_message_destroy(msg);
-    return -1;
+    /* let waiting threads look for their messages */
+    pthread_cond_broadcast(&ant->cond);
+
+    return count;
 }
 
-int ant_open_channel(ant_t *ant, uint8_t chan)
+/*
+ * Take a message matching match from q, waiting until deadline for one to
+ * arrive. Returns as soon as a matching message has been received.
+ */
+static int ant_queue_wait(ant_t *ant, ant_queue_t *q, ant_match_fn *match, void *arg, ant_message_t *msg, const struct timespec *deadline)
 {
-    ant_message_t *msg = NULL;
+    int remaining;
+
+    /* whatever is being waited for may depend upon batched messages */
+    if (ant_batch_owned(ant) && ant_batch_flush(ant))
+        return -1;
 
-    CHAINERR_NULL(msg, ant_message_create(0x4b, 1), err);
-    msg->data[0] = chan;
+    while (ant_queue_take(ant, q, match, arg, msg)) {
+        remaining = ant_deadline_remaining(deadline);
+        if (!remaining || ant->dead)
+            return -1;
 
-    CHAINERR_LTZ(ant_send_message(ant, msg), err);
-    ant_message_destroy(msg);
-    msg = NULL;
-    CHAINERR_LTZ(ant_check_ok(ant, 0x4b), err);
+        ant_dispatch(ant, remaining);
+    }
 
     return 0;
-err:
-    if (msg)
-        ant_message_destroy(msg);
-    return -1;
 }
 
-int ant_close_channel(ant_t *ant, uint8_t chan)
+static bool match_msg_id(ant_message_t *msg, void *arg)
 {
-    ant_message_t *msg = NULL;
+    return msg->id == *(uint8_t *)arg;
+}
 
-    CHAINERR_NULL(msg, ant_message_create(0x4c, 1), err);
-    msg->data[0] = chan;
+static bool match_response(ant_message_t *msg, void *arg)
+{
+    return msg->data[1] == *(uint8_t *)arg;
+}
 
-    CHAINERR_LTZ(ant_send_message(ant, msg), err);
-    ant_message_destroy(msg);
-    msg = NULL;
-    CHAINERR_LTZ(ant_check_ok(ant, 0x4c), err);
+static bool match_transfer_event(ant_message_t *msg, void *arg)
+{
+    /* EVENT_TRANSFER_TX_COMPLETED or EVENT_TRANSFER_TX_FAILED */
+    return msg->data[2] == 5 || msg->data[2] == 6;
+}
 
-    return 0;
-err:
-    if (msg)
-        ant_message_destroy(msg);
-    return -1;
+static bool match_burst_tx_event(ant_message_t *msg, void *arg)
+{
+    switch (msg->data[2]) {
+    case 0x05: /* EVENT_TRANSFER_TX_COMPLETED */
+    case 0x06: /* EVENT_TRANSFER_TX_FAILED */
+    case 0x34: /* EVENT_SERIAL_QUE_OVERFLOW */
+    case 0x35: /* EVENT_QUE_OVERFLOW */
+        return true;
+    }
+    return false;
 }
 
-int ant_send_acked_data(ant_t *ant, uint8_t chan, uint8_t data[8])
+static bool match_burst(ant_message_t *msg, void *arg)
 {
-    ant_message_t *msg = NULL;
-    uint8_t response_code;
-    int attempts;
-    struct timespec ts;
+    return msg->id == 0x4f || msg->id == 0x50 || msg->id == 0x72;
+}
 
-    CHAINERR_NULL(msg, ant_message_create(0x4f, 9), err);
-    msg->data[0] = chan;
-    memcpy(&msg->data[1], data, 8);
+static bool match_burst_packet(ant_message_t *msg, void *arg)
+{
+    return msg->id == 0x50 || msg->id == 0x72;
+}
 
-    CHAINERR_LTZ(ant_send_message(ant, msg), err);
-    ant_message_destroy(msg);
-    msg = NULL;
+static ant_queue_t *ant_queue(ant_t *ant, uint8_t chan, ant_queue_class_t cls)
+{
+    if (chan >= ANT_MAX_CHANNELS)
+        return &ant->queue_global;
+    return &ant->queues[chan][cls];
+}
 
-    attempts = 20;
-    memset(&ts, 0, sizeof(ts));
-    ts.tv_nsec = 100 * 1000000; /* 100ms */
-    while (attempts--) {
-        if (ant_read_response(ant, 0x1, &response_code)) {
-            nanosleep(&ts, NULL);
-            continue;
-        }
+static int ant_check_response(ant_t *ant, uint8_t chan, uint8_t msg_id, uint64_t sent_us, const struct timespec *deadline)
+{
+    ant_message_t msg;
 
-        if (response_code == 5) {
-            /* TX complete */
-            DBG("acked data TX complete\n");
-            break;
-        }
+    if (ant_queue_wait(ant, ant_queue(ant, chan, ANT_QUEUE_RESPONSE),
+                       match_response, &msg_id, &msg, deadline)) {
+        ERR("no response to 0x%02x\n", msg_id);
+        ant->latency[msg_id].timeouts++;
+        ant_rto_backoff(ant, ANT_XCHG_COMMAND);
+        return -1;
+    }
+    ant_rto_update(ant, ANT_XCHG_COMMAND, ant_latency_record(ant, msg_id, sent_us));
 
-        if (response_code == 6) {
-            /* TX failed */
-            goto err;
-        }
+    if (msg.data[2]) {
+        ERR("response code %d\n", msg.data[2]);
+        return -1;
     }
 
     return 0;
-err:
-    if (msg)
-        ant_message_destroy(msg);
-    return -1;
 }
 
-int ant_receive_acked_response(ant_t *ant, uint8_t chan, uint8_t *data, size_t sz)
+/* check the responses to all commands sent within a batch */
+static int ant_check_pending(ant_t *ant)
 {
-    ant_message_t *msg = NULL;
-    int attempts = 20;
-    struct timespec ts;
-
-    memset(&ts, 0, sizeof(ts));
-    ts.tv_nsec = 100 * 1000000; /* 100ms */
+    struct timespec deadline;
+    int i, ret = 0;
 
-    while (attempts--) {
-        msg = ant_read_message(ant);
-        if (!msg)
-            goto err_attempt_next;
-
-        if (msg->id != 0x4f)
-            goto err_attempt_destroy;
-
-        memcpy(data, &msg->data[1], sz < (msg->len - 1) ? sz : (msg->len - 1));
-        ant_message_destroy(msg);
+    if (!ant->npending)
         return 0;
 
-err_attempt_destroy:
-        ant_message_destroy(msg);
-err_attempt_next:
-        nanosleep(&ts, NULL);
+    /* responses arrive in order, so each is allowed a timeout of its own */
+    for (i = 0; i < ant->npending; i++) {
+        ant_deadline_set(&deadline, ant->rto[ANT_XCHG_COMMAND].rto_ms);
+        if (ant_check_response(ant, ant->pending[i].chan, ant->pending[i].msg_id,
+                               ant->pending[i].sent_us, &deadline))
+            ret = -1;
     }
 
-    return -1;
+    ant->npending = 0;
+    return ret;
 }
 
-int ant_receive_burst(ant_t *ant, uint8_t chan, uint8_t *data, size_t sz, size_t *len)
+static int ant_check_ok(ant_t *ant, uint8_t chan, uint8_t msg_id, uint64_t sent_us)
 {
-    ant_message_t *msg = NULL;
-    int attempts;
-    struct timespec ts;
-    size_t cpy, datarem = sz;
+    struct timespec deadline;
 
-    memset(&ts, 0, sizeof(ts));
-    ts.tv_nsec = 1 * 1000000; /* 1ms */
+    if (ant_batch_owned(ant)) {
+        /* check the response when the batch ends */
+        if (ant->npending == ANT_MAX_PENDING && ant_check_pending(ant))
+            return -1;
 
-    while (true) {
-        attempts = 20;
-        while (attempts--) {
-            msg = ant_read_message(ant);
-            if (msg)
-                break;
-            nanosleep(&ts, NULL);
-        }
-        if (!msg)
-            goto err;
+        ant->pending[ant->npending].chan = chan;
+        ant->pending[ant->npending].msg_id = msg_id;
+        ant->pending[ant->npending].sent_us = sent_us;
+        ant->npending++;
+        return 0;
+    }
 
-        if (msg->id == 0x40) {
-            /* rf event */
-            if (msg->data[0] != chan) {
-                DBG("message for wrong channel\n");
-                goto nextmsg;
-            }
-            if (msg->data[2] == 6) {
-                DBG("burst TX failed\n");
-                goto err;
-            }
-        }
+    ant_deadline_set(&deadline, ant->rto[ANT_XCHG_COMMAND].rto_ms);
+    return ant_check_response(ant, chan, msg_id, sent_us, &deadline);
+}
 
-        if (msg->id == 0x4f) {
-            /* acked data */
-            cpy = MIN(datarem, msg->len - 1);
-            memcpy(data + (sz - datarem), &msg->data[1], cpy);
-            datarem -= cpy;
-            goto burst_done;
-        }
+static void ant_batch_enter(ant_t *ant)
+{
+    /* messages from different threads aren't mixed within a batch */
+    while (ant->batching && !ant_batch_owned(ant))
+        pthread_cond_wait(&ant->cond, &ant->lock);
 
-        if (msg->id == 0x50) {
-            /* burst data */
-            cpy = MIN(datarem, msg->len - 1);
-            memcpy(data + (sz - datarem), &msg->data[1], cpy);
-            datarem -= cpy;
-            if (msg->data[0] & 0x80) {
-                /* last packet */
-                goto burst_done;
-            }
-        }
+    ant->batch_owner = pthread_self();
+    ant->batching++;
+}
 
-nextmsg:
-        if (msg != NULL) {
-            ant_message_destroy(msg);
-            msg = NULL;
-        }
-        continue;
+static int ant_batch_leave(ant_t *ant)
+{
+    int ret;
+
+    ASSERT(ant_batch_owned(ant));
 
-burst_done:
-        DBG("burst complete\n");
-        ant_message_destroy(msg);
-        if (len)
-            *len = sz - datarem;
+    if (ant->batching > 1) {
+        ant->batching--;
         return 0;
     }
 
-err:
-    if (msg)
-        ant_message_destroy(msg);
-    return -1;
+    /* remain the owner until the responses have been checked */
+    ret = ant_batch_flush(ant);
+    if (ret)
+        ant->npending = 0;
+    else
+        ret = ant_check_pending(ant);
+
+    ant->batching = 0;
+    pthread_cond_broadcast(&ant->cond);
+    return ret;
 }
 
-int ant_send_burst(ant_t *ant, uint8_t chan, uint8_t *data, size_t sz)
+/* send a command & check the device accepted it */
+static int ant_command(ant_t *ant, ant_message_t *msg, uint8_t chan)
 {
-    ant_message_t *msg = NULL;
-    uint8_t seq = 0, *dataptr = data;
-    size_t currsz, rem = sz;
-    struct timespec ts;
+    uint64_t sent_us;
+    int ret;
 
-    CHAINERR_NULL(msg, ant_message_create(0x50, 9), err);
+    pthread_mutex_lock(&ant->lock);
+    sent_us = ant_now_us();
+    ret = ant_send_message(ant, msg);
+    if (!ret)
+        ret = ant_check_ok(ant, chan, msg->id, sent_us);
+    pthread_mutex_unlock(&ant->lock);
 
-    memset(&ts, 0, sizeof(ts));
-    ts.tv_nsec = 10 * 1000000; /* 10ms */
+    return ret;
+}
 
-    while (rem) {
-        currsz = MIN(rem, 8);
+void ant_init(ant_t *ant)
+{
+    pthread_condattr_t attr;
+    pthread_mutexattr_t mattr;
+    int i;
 
-        /* channel number */
-        msg->data[0] = chan;
+    /* waits are bounded by CLOCK_MONOTONIC deadlines */
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&ant->cond, &attr);
+    pthread_condattr_destroy(&attr);
 
-        /* packet sequence number */
-        msg->data[0] |= (seq++ << 5);
-        if (seq > 3)
-            seq = 1;
+    /* a SCHED_FIFO I/O thread mustn't be held up by a thread it preempts */
+    pthread_mutexattr_init(&mattr);
+    pthread_mutexattr_setprotocol(&mattr, PTHREAD_PRIO_INHERIT);
+    pthread_mutex_init(&ant->lock, &mattr);
+    pthread_mutexattr_destroy(&mattr);
 
-        /* mark last packet */
-        if (rem == currsz)
-            msg->data[0] |= 0x80;
+    ant->burst_gap_us = ANT_BURST_GAP_DEFAULT;
+    ant->burst_packet_sz = ANT_BURST_PACKET_LEGACY;
 
-        /* fill in data */
-        memcpy(&msg->data[1], dataptr, currsz);
-        if (currsz < 8)
-            memset(&msg->data[1+currsz], 0, 8 - currsz);
+    for (i = 0; i < ANT_XCHG_TYPES; i++)
+        ant->rto[i].rto_ms = ant_rto_bounds[i].initial;
 
-        /* send packet */
-        CHAINERR_LTZ(ant_send_message(ant, msg), err);
+    ant->qfree = NULL;
+    for (i = ANT_QUEUE_POOL_SZ - 1; i >= 0; i--) {
+        ant->qpool[i].next = ant->qfree;
+        ant->qfree = &ant->qpool[i];
+    }
+}
 
-        /* pause */
-        nanosleep(&ts, NULL);
+/* the context used by ant_find_nodes & ant_wait_for_nodes */
+static ant_context_t *default_ctx;
+static pthread_mutex_t default_ctx_lock = PTHREAD_MUTEX_INITIALIZER;
 
-        /* move along */
+ant_context_t *ant_context_create(void)
+{
+    ant_context_t *ctx;
+
+    ctx = calloc(1, sizeof(*ctx));
+    if (!ctx)
+        goto oom;
+
+    pthread_mutex_init(&ctx->lock, NULL);
+
+    /* a context without USB can still be used with other transports */
+    if (ant_usb_context_init(ctx))
+        ERR("failed to init USB\n");
+
+    return ctx;
+oom:
+    ERR("failed to alloc context\n");
+    return NULL;
+}
+
+/* all nodes found through ctx must have been destroyed */
+void ant_context_destroy(ant_context_t *ctx)
+{
+    ant_usb_context_fini(ctx);
+    pthread_mutex_destroy(&ctx->lock);
+    free(ctx);
+}
+
+int ant_context_next_id(ant_context_t *ctx)
+{
+    int id;
+
+    pthread_mutex_lock(&ctx->lock);
+    id = ctx->next_id++;
+    pthread_mutex_unlock(&ctx->lock);
+
+    return id;
+}
+
+int ant_context_find_nodes(ant_context_t *ctx, ant_cb_foundnode *found_node, void *user)
+{
+    int count = 0;
+
+    count += ant_usb_find_nodes(ctx, found_node, user);
+
+    return count;
+}
+
+/*
+ * Wait up to timeout_ms for new nodes to become available. Returns 1 if they
+ * may have, in which case ant_context_find_nodes should be called, else 0.
+ */
+int ant_context_wait_for_nodes(ant_context_t *ctx, unsigned timeout_ms)
+{
+    return ant_usb_wait_for_nodes(ctx, timeout_ms) > 0;
+}
+
+static ant_context_t *ant_default_context(void)
+{
+    pthread_mutex_lock(&default_ctx_lock);
+    if (!default_ctx)
+        default_ctx = ant_context_create();
+    pthread_mutex_unlock(&default_ctx_lock);
+
+    return default_ctx;
+}
+
+int ant_find_nodes(ant_cb_foundnode *found_node, void *user)
+{
+    ant_context_t *ctx = ant_default_context();
+
+    if (!ctx)
+        return 0;
+
+    return ant_context_find_nodes(ctx, found_node, user);
+}
+
+int ant_wait_for_nodes(unsigned timeout_ms)
+{
+    ant_context_t *ctx = ant_default_context();
+
+    if (!ctx)
+        return 0;
+
+    return ant_context_wait_for_nodes(ctx, timeout_ms);
+}
+
+static void *ant_io_thread(void *arg)
+{
+    ant_t *ant = arg;
+
+    pthread_mutex_lock(&ant->lock);
+    while (!ant->io_stop && !ant->dead)
+        ant_dispatch(ant, ANT_IO_PERIOD);
+
+    /* wake anyone waiting, who'll find the device dead or read themselves */
+    pthread_cond_broadcast(&ant->cond);
+    ant->io_running = false;
+    pthread_mutex_unlock(&ant->lock);
+
+    return NULL;
+}
+
+/*
+ * Read from the device on a dedicated thread, so that it's drained promptly
+ * however long the threads exchanging messages take to get around to waiting.
+ * If rt_priority is non-zero the thread runs with SCHED_FIFO at that priority,
+ * or at the default priority if that isn't permitted.
+ */
+int ant_start_io_thread(ant_t *ant, int rt_priority)
+{
+    struct sched_param param;
+    pthread_attr_t attr;
+    int ret = 0;
+
+    pthread_mutex_lock(&ant->lock);
+    if (ant->io_created)
+        goto out;
+
+    pthread_attr_init(&attr);
+    if (rt_priority) {
+        param.sched_priority = rt_priority;
+        pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+        if (pthread_attr_setschedparam(&attr, &param)) {
+            ERR("invalid real time priority %d\n", rt_priority);
+            ret = -1;
+            goto out_attr;
+        }
+    }
+
+    /* the thread blocks on the lock until io_thread & io_running are set */
+    ant->io_stop = false;
+    ret = pthread_create(&ant->io_thread, &attr, ant_io_thread, ant);
+    if (ret == EPERM && rt_priority) {
+        ERR("not permitted to use SCHED_FIFO, I/O thread runs at default priority\n");
+        pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+        ret = pthread_create(&ant->io_thread, &attr, ant_io_thread, ant);
+    }
+    if (ret) {
+        ERR("failed to create I/O thread\n");
+        ret = -1;
+        goto out_attr;
+    }
+
+    ant->io_created = ant->io_running = true;
+    DBG("%s I/O thread started\n", ant->name);
+out_attr:
+    pthread_attr_destroy(&attr);
+out:
+    pthread_mutex_unlock(&ant->lock);
+    return ret;
+}
+
+/* return to reading from whichever thread is waiting for messages */
+void ant_stop_io_thread(ant_t *ant)
+{
+    pthread_mutex_lock(&ant->lock);
+    if (!ant->io_created) {
+        pthread_mutex_unlock(&ant->lock);
+        return;
+    }
+    ant->io_stop = true;
+    pthread_mutex_unlock(&ant->lock);
+
+    /* joined even if it already exited on a dead device */
+    pthread_join(ant->io_thread, NULL);
+
+    pthread_mutex_lock(&ant->lock);
+    ant->io_created = ant->io_running = false;
+    pthread_cond_broadcast(&ant->cond);
+    pthread_mutex_unlock(&ant->lock);
+}
+
+void ant_destroy(ant_t *ant)
+{
+    ant_stop_io_thread(ant);
+    pthread_cond_destroy(&ant->cond);
+    pthread_mutex_destroy(&ant->lock);
+    ant->destroy(ant);
+}
+
+bool ant_is_dead(ant_t *ant)
+{
+    return ant->dead;
+}
+
+int ant_receive(ant_t *ant, uint8_t *msg_id, uint8_t *len, uint8_t *buf, size_t sz)
+{
+    ant_message_t msg;
+    ant_qmsg_t *oldest;
+    ant_queue_t *q;
+
+    pthread_mutex_lock(&ant->lock);
+
+    oldest = ant_queue_oldest(ant, &q);
+    if (!oldest) {
+        ant_dispatch(ant, ANT_TIMEOUT_RECEIVE);
+        oldest = ant_queue_oldest(ant, &q);
+        if (!oldest) {
+            pthread_mutex_unlock(&ant->lock);
+            return -1;
+        }
+    }
+
+    memcpy(&msg, &oldest->msg, offsetof(ant_message_t, data) + oldest->msg.len);
+    ant_queue_unlink(ant, q, NULL, oldest);
+
+    pthread_mutex_unlock(&ant->lock);
+
+    DBG("received message 0x%02x\n", msg.id);
+
+    if (msg_id)
+        *msg_id = msg.id;
+    if (len)
+        *len = msg.len;
+    if (buf)
+        memcpy(buf, msg.data, sz < msg.len ? sz : msg.len);
+
+    return 0;
+}
+
+/*
+ * Receive a message with the given ID, waiting up to timeout_ms for it to
+ * arrive. Data messages are taken from the queue for chan, others from the
+ * queue of messages not tied to a channel.
+ */
+int ant_receive_message(ant_t *ant, int chan, uint8_t msg_id, uint8_t *len, uint8_t *buf, size_t sz, unsigned timeout_ms)
+{
+    struct timespec deadline;
+    ant_message_t msg;
+    ant_queue_t *q;
+    int ret;
+
+    if (chan < 0 || ((msg_id < 0x4e || msg_id > 0x50) && msg_id != 0x72))
+        q = &ant->queue_global;
+    else
+        q = ant_queue(ant, chan, ANT_QUEUE_DATA);
+
+    ant_deadline_set(&deadline, timeout_ms);
+    pthread_mutex_lock(&ant->lock);
+    ret = ant_queue_wait(ant, q, match_msg_id, &msg_id, &msg, &deadline);
+    pthread_mutex_unlock(&ant->lock);
+    if (ret)
+        return -1;
+
+    if (len)
+        *len = msg.len;
+    if (buf)
+        memcpy(buf, msg.data, sz < msg.len ? sz : msg.len);
+
+    return 0;
+}
+
+int ant_poll(ant_t *ant)
+{
+    int count = 0;
+
+    while (!ant_receive(ant, NULL, NULL, NULL, 0))
+        count++;
+
+    return count;
+}
+
+/*
+ * Fill fds with up to nfds descriptors to poll for the device's I/O. Returns
+ * the number of descriptors, which may exceed nfds, or -1 on error. The set
+ * may change, so should be fetched again after each ant_process.
+ */
+int ant_get_pollfds(ant_t *ant, struct pollfd *fds, int nfds)
+{
+    if (!ant->get_pollfds)
+        return 0;
+    return ant->get_pollfds(ant, fds, nfds);
+}
+
+/*
+ * Returns the ms after which ant_process should be called even if none of the
+ * pollfds are ready, or -1 if there's no need to.
+ */
+int ant_get_timeout(ant_t *ant)
+{
+    /* without pollfds the device can only be polled */
+    if (!ant->get_pollfds || !ant->get_timeout)
+        return ANT_TIMEOUT_RECEIVE;
+    if (ant->dead)
+        return 0;
+    return ant->get_timeout(ant);
+}
+
+/*
+ * Handle pending I/O without blocking, queueing whatever messages have been
+ * received so that ant_receive & friends return them immediately. Returns the
+ * number of messages received or -1 if the device is dead.
+ */
+int ant_process(ant_t *ant)
+{
+    int count;
+
+    pthread_mutex_lock(&ant->lock);
+    count = ant_dispatch(ant, 0);
+    if (ant->dead)
+        count = -1;
+    pthread_mutex_unlock(&ant->lock);
+
+    return count;
+}
+
+/*
+ * Record everything read from & written to the device in cap, or stop if cap
+ * is NULL. cap must remain open until the device is destroyed or it's unset.
+ */
+void ant_set_capture(ant_t *ant, ant_capture_t *cap)
+{
+    pthread_mutex_lock(&ant->lock);
+    ant->capture = cap;
+    pthread_mutex_unlock(&ant->lock);
+}
+
+void ant_batch_begin(ant_t *ant)
+{
+    pthread_mutex_lock(&ant->lock);
+    ant_batch_enter(ant);
+    pthread_mutex_unlock(&ant->lock);
+}
+
+/*
+ * Write all messages sent since ant_batch_begin in a single transfer, then
+ * check the responses to any commands amongst them.
+ */
+int ant_batch_end(ant_t *ant)
+{
+    int ret;
+
+    pthread_mutex_lock(&ant->lock);
+    ret = ant_batch_leave(ant);
+    pthread_mutex_unlock(&ant->lock);
+
+    return ret;
+}
+
+int ant_unassign_channel(ant_t *ant, uint8_t chan)
+{
+    ant_message_t msg;
+
+    ant_message_init(&msg, 0x41, 1);
+    msg.data[0] = chan;
+
+    CHAINERR_LTZ(ant_command(ant, &msg, chan), err);
+
+    /* discard anything left over from the previous use of the channel */
+    pthread_mutex_lock(&ant->lock);
+    ant_queue_flush_channel(ant, chan);
+    pthread_mutex_unlock(&ant->lock);
+
+    return 0;
+err:
+    return -1;
+}
+
+int ant_assign_channel(ant_t *ant, uint8_t chan, uint8_t type, uint8_t net)
+{
+    ant_message_t msg;
+
+    ant_message_init(&msg, 0x42, 4);
+    msg.data[0] = chan;
+    msg.data[1] = type;
+    msg.data[2] = net;
+    msg.data[3] = 0x00; /* extended */
+
+    return ant_command(ant, &msg, chan);
+}
+
+int ant_set_channel_period(ant_t *ant, uint8_t chan, uint8_t period[2])
+{
+    ant_message_t msg;
+
+    ant_message_init(&msg, 0x43, 3);
+    msg.data[0] = chan;
+    memcpy(&msg.data[1], period, 2);
+
+    return ant_command(ant, &msg, chan);
+}
+
+int ant_set_channel_search_timeout(ant_t *ant, uint8_t chan, uint8_t timeout)
+{
+    ant_message_t msg;
+
+    ant_message_init(&msg, 0x44, 2);
+    msg.data[0] = chan;
+    msg.data[1] = timeout;
+
+    return ant_command(ant, &msg, chan);
+}
+
+int ant_set_channel_freq(ant_t *ant, uint8_t chan, uint8_t freq)
+{
+    ant_message_t msg;
+
+    ant_message_init(&msg, 0x45, 2);
+    msg.data[0] = chan;
+    msg.data[1] = freq;
+
+    return ant_command(ant, &msg, chan);
+}
+
+int ant_set_network_key(ant_t *ant, uint8_t net, uint8_t key[8])
+{
+    ant_message_t msg;
+
+    ant_message_init(&msg, 0x46, 9);
+    msg.data[0] = net;
+    memcpy(&msg.data[1], key, 8);
+
+    return ant_command(ant, &msg, net);
+}
+
+int ant_set_tx_power(ant_t *ant, uint8_t pwr)
+{
+    ant_message_t msg;
+
+    ant_message_init(&msg, 0x47, 2);
+    msg.data[0] = 0x00;
+    msg.data[1] = pwr;
+
+    return ant_command(ant, &msg, 0);
+}
+
+int ant_reset(ant_t *ant)
+{
+    ant_message_t msg;
+
+    ant_message_init(&msg, 0x4a, 1);
+    msg.data[0] = 0x00;
+
+    pthread_mutex_lock(&ant->lock);
+
+    CHAINERR_LTZ(ant_send_message(ant, &msg), err);
+
+    ant->recv_head = ant->recv_tail;
+    ant_decoder_reset(&ant->decoder);
+    ant_queue_flush_all(ant);
+
+    /* advanced bursts must be enabled again */
+    ant->burst_packet_sz = ANT_BURST_PACKET_LEGACY;
+
+    pthread_mutex_unlock(&ant->lock);
+    return 0;
+err:
+    pthread_mutex_unlock(&ant->lock);
+    return -1;
+}
+
+int ant_open_channel(ant_t *ant, uint8_t chan)
+{
+    ant_message_t msg;
+
+    ant_message_init(&msg, 0x4b, 1);
+    msg.data[0] = chan;
+
+    CHAINERR_LTZ(ant_command(ant, &msg, chan), err);
+
+    /* discard anything left over from the previous use of the channel */
+    pthread_mutex_lock(&ant->lock);
+    ant_queue_flush_channel(ant, chan);
+    pthread_mutex_unlock(&ant->lock);
+
+    return 0;
+err:
+    return -1;
+}
+
+static bool match_channel_closed(ant_message_t *msg, void *arg)
+{
+    /* EVENT_CHANNEL_CLOSED */
+    return msg->data[2] == 0x07;
+}
+
+int ant_close_channel(ant_t *ant, uint8_t chan)
+{
+    struct timespec deadline;
+    ant_message_t msg;
+
+    ant_message_init(&msg, 0x4c, 1);
+    msg.data[0] = chan;
+
+    CHAINERR_LTZ(ant_command(ant, &msg, chan), err);
+
+    pthread_mutex_lock(&ant->lock);
+
+    /*
+     * the channel only closes once the device has accepted the command,
+     * wait for that so it can be reopened or unassigned straight away
+     */
+    ant_deadline_set(&deadline, ANT_TIMEOUT_CLOSE + ant_link_ms(ant));
+    if (ant_queue_wait(ant, ant_queue(ant, chan, ANT_QUEUE_EVENT),
+                       match_channel_closed, NULL, NULL, &deadline))
+        DBG("no channel closed event\n");
+
+    /* discard anything left over from the previous use of the channel */
+    ant_queue_flush_channel(ant, chan);
+
+    pthread_mutex_unlock(&ant->lock);
+
+    return 0;
+err:
+    return -1;
+}
+
+int ant_send_acked_data(ant_t *ant, uint8_t chan, uint8_t data[8])
+{
+    struct timespec deadline;
+    ant_message_t msg;
+    uint64_t sent_us;
+
+    ant_message_init(&msg, 0x4f, 9);
+    msg.data[0] = chan;
+    memcpy(&msg.data[1], data, 8);
+
+    pthread_mutex_lock(&ant->lock);
+
+    /*
+     * discard transfer events left over from previous transfers, along with
+     * any burst packets which can't be a reply to this message
+     */
+    ant_queue_flush(ant, ant_queue(ant, chan, ANT_QUEUE_EVENT));
+    while (!ant_queue_take(ant, ant_queue(ant, chan, ANT_QUEUE_DATA),
+                           match_burst_packet, NULL, NULL));
+
+    sent_us = ant_now_us();
+    CHAINERR_LTZ(ant_send_message(ant, &msg), err);
+
+    ant_deadline_set(&deadline, ant->rto[ANT_XCHG_TRANSFER].rto_ms);
+    if (ant_queue_wait(ant, ant_queue(ant, chan, ANT_QUEUE_EVENT),
+                       match_transfer_event, NULL, &msg, &deadline)) {
+        /* no event, assume the data was sent */
+        ant->latency[0x4f].timeouts++;
+        ant_rto_backoff(ant, ANT_XCHG_TRANSFER);
+        goto out;
+    }
+    ant_rto_update(ant, ANT_XCHG_TRANSFER, ant_latency_record(ant, 0x4f, sent_us));
+
+    if (msg.data[2] == 6) {
+        /* TX failed */
+        goto err;
+    }
+
+    /* TX complete */
+    DBG("acked data TX complete\n");
+out:
+    pthread_mutex_unlock(&ant->lock);
+    return 0;
+err:
+    pthread_mutex_unlock(&ant->lock);
+    return -1;
+}
+
+int ant_receive_acked_response(ant_t *ant, uint8_t chan, uint8_t *data, size_t sz)
+{
+    struct timespec deadline;
+    ant_message_t msg;
+    uint8_t msg_id = 0x4f;
+    uint64_t start_us;
+    int ret;
+
+    pthread_mutex_lock(&ant->lock);
+    start_us = ant_now_us();
+    ant_deadline_set(&deadline, ant->rto[ANT_XCHG_ACKED].rto_ms);
+    ret = ant_queue_wait(ant, ant_queue(ant, chan, ANT_QUEUE_DATA),
+                         match_msg_id, &msg_id, &msg, &deadline);
+    if (ret)
+        ant_rto_backoff(ant, ANT_XCHG_ACKED);
+    else
+        ant_rto_update(ant, ANT_XCHG_ACKED, ant_now_us() - start_us);
+    pthread_mutex_unlock(&ant->lock);
+    if (ret)
+        return -1;
+
+    memcpy(data, &msg.data[1], sz < (msg.len - 1) ? sz : (msg.len - 1));
+    return 0;
+}
+
+/* copy sz bytes from src to offset off within iov, returning the bytes copied */
+static size_t ant_iov_copy(const struct iovec *iov, int iovcnt, size_t off, const uint8_t *src, size_t sz)
+{
+    size_t cpy, done = 0;
+    int i;
+
+    for (i = 0; i < iovcnt && done < sz; i++) {
+        if (off >= iov[i].iov_len) {
+            off -= iov[i].iov_len;
+            continue;
+        }
+
+        cpy = MIN(sz - done, iov[i].iov_len - off);
+        memcpy((uint8_t *)iov[i].iov_base + off, &src[done], cpy);
+        done += cpy;
+        off = 0;
+    }
+
+    return done;
+}
+
+static int ant_do_receive_burst(ant_t *ant, uint8_t chan, const struct iovec *iov, int iovcnt, size_t *len, ant_burst_stats_t *stats)
+{
+    struct timespec deadline;
+    ant_message_t msg;
+    size_t received = 0, first_sz = 0;
+    uint64_t wait_us, first_us = 0;
+    int seq, expected = 0, last = -1;
+    ant_exchange_t xchg;
+
+    while (true) {
+        if (!ant_queue_take(ant, ant_queue(ant, chan, ANT_QUEUE_EVENT),
+                            match_transfer_event, NULL, &msg) &&
+            msg.data[2] == 6) {
+            DBG("burst TX failed\n");
+            goto err;
+        }
+
+        /* the wait for the first packet includes the tracker's channel period */
+        xchg = stats->packets ? ANT_XCHG_BURST : ANT_XCHG_BURST_START;
+
+        wait_us = ant_now_us();
+        ant_deadline_set(&deadline, ant->rto[xchg].rto_ms);
+        if (ant_queue_wait(ant, ant_queue(ant, chan, ANT_QUEUE_DATA),
+                           match_burst, NULL, &msg, &deadline)) {
+            ant->latency[0x50].timeouts++;
+            ant_rto_backoff(ant, xchg);
+            goto err;
+        }
+        ant_rto_update(ant, xchg, ant_now_us() - wait_us);
+
+        if (msg.id != 0x4f) {
+            /*
+             * legacy & advanced burst packets are numbered 0 for the first then cycle through
+             * 1, 2 & 3, so any other sequence means packets were lost
+             */
+            seq = (msg.data[0] >> 5) & 0x3;
+            if (seq == last) {
+                DBG("duplicate burst packet seq %d\n", seq);
+                stats->duplicated++;
+                continue;
+            }
+            if (seq != expected && !expected) {
+                /* left over from a burst which was abandoned part way */
+                DBG("stale burst packet seq %d\n", seq);
+                continue;
+            }
+            if (seq != expected) {
+                stats->lost += seq ? (seq + 3 - expected) % 3 : 1;
+                ERR("burst sequence error, expected %d got %d\n", expected, seq);
+
+                /* discard the rest of the burst */
+                ant_queue_flush(ant, ant_queue(ant, chan, ANT_QUEUE_DATA));
+                return ANT_ERR_BURST_SEQ;
+            }
+            last = seq;
+            expected = (seq % 3) + 1;
+        }
+
+        stats->packets++;
+        stats->packet_sz = MAX(stats->packet_sz, msg.len - 1U);
+        if (stats->packets == 1) {
+            first_us = ant_now_us();
+            first_sz = msg.len - 1;
+        }
+
+        /* data goes straight to its destination within iov */
+        received += ant_iov_copy(iov, iovcnt, received, &msg.data[1], msg.len - 1);
+
+        if (msg.id == 0x4f) {
+            /* acked data */
+            break;
+        }
+
+        /* burst data */
+        if (msg.data[0] & 0x80) {
+            /* last packet */
+            break;
+        }
+    }
+
+    /* the first packet's arrival starts the clock, so it isn't counted */
+    stats->bytes = received;
+    stats->duration_us = ant_now_us() - first_us;
+    if (stats->duration_us)
+        stats->bytes_per_sec = (received - first_sz) * 1000000ULL / stats->duration_us;
+
+    DBG("burst complete, %lu bytes at %lu bytes/s\n", stats->bytes, stats->bytes_per_sec);
+    if (len)
+        *len = received;
+    return 0;
+
+err:
+    return -1;
+}
+
+int ant_receive_burstv(ant_t *ant, uint8_t chan, const struct iovec *iov, int iovcnt, size_t *len)
+{
+    ant_burst_stats_t stats;
+    uint64_t start_us;
+    int ret;
+
+    memset(&stats, 0, sizeof(stats));
+
+    pthread_mutex_lock(&ant->lock);
+    start_us = ant_now_us();
+    ret = ant_do_receive_burst(ant, chan, iov, iovcnt, len, &stats);
+    if (!ret)
+        ant_latency_record(ant, 0x50, start_us);
+    if (chan < ANT_MAX_CHANNELS)
+        memcpy(&ant->burst_stats[chan], &stats, sizeof(stats));
+    pthread_mutex_unlock(&ant->lock);
+
+    return ret;
+}
+
+int ant_receive_burst(ant_t *ant, uint8_t chan, uint8_t *data, size_t sz, size_t *len)
+{
+    struct iovec iov;
+
+    iov.iov_base = data;
+    iov.iov_len = sz;
+
+    return ant_receive_burstv(ant, chan, &iov, 1, len);
+}
+
+void ant_get_burst_stats(ant_t *ant, uint8_t chan, ant_burst_stats_t *stats)
+{
+    if (chan >= ANT_MAX_CHANNELS) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+
+    pthread_mutex_lock(&ant->lock);
+    memcpy(stats, &ant->burst_stats[chan], sizeof(*stats));
+    pthread_mutex_unlock(&ant->lock);
+}
+
+/*
+ * Handle events relating to a burst being transmitted on chan. Returns 1 if
+ * the burst has completed, 0 if it's still in progress or -1 if it failed.
+ */
+static int ant_burst_tx_status(ant_t *ant, uint8_t chan, uint8_t msg_id)
+{
+    ant_message_t msg;
+
+    /* burst packets are only responded to if they're in error */
+    if (!ant_queue_take(ant, ant_queue(ant, chan, ANT_QUEUE_RESPONSE),
+                        match_response, &msg_id, &msg)) {
+        ERR("burst packet response code 0x%02x\n", msg.data[2]);
+        return -1;
+    }
+
+    if (ant_queue_take(ant, ant_queue(ant, chan, ANT_QUEUE_EVENT),
+                       match_burst_tx_event, NULL, &msg))
+        return 0;
+
+    switch (msg.data[2]) {
+    case 0x05:
+        return 1;
+
+    case 0x06:
+        DBG("burst TX failed\n");
+        return -1;
+
+    default:
+        /* the device couldn't keep up, pace the next few bursts */
+        ERR("burst overflowed device queue, pacing bursts\n");
+        ant->burst_paced = ANT_BURST_PACED;
+        return -1;
+    }
+}
+
+int ant_send_burst(ant_t *ant, uint8_t chan, uint8_t *data, size_t sz)
+{
+    ant_message_t msg;
+    uint8_t seq = 0, *dataptr = data, msg_id;
+    size_t currsz, rem = sz, packet_sz, queued, keep;
+    struct timespec ts, deadline;
+    int batched = 0, status = 0, remaining;
+    unsigned long gap_ns;
+#if DEBUG == 1
+    uint64_t start_us = ant_now_us(), elapsed_us;
+#endif
+
+    pthread_mutex_lock(&ant->lock);
+
+    /* advanced burst packets carry more data, but are otherwise the same */
+    packet_sz = ant->burst_packet_sz;
+    msg_id = (packet_sz > ANT_BURST_PACKET_LEGACY) ? 0x72 : 0x50;
+    ant_message_init(&msg, msg_id, 1 + packet_sz);
+
+    /* discard events & errors left over from previous transfers */
+    ant_queue_flush(ant, ant_queue(ant, chan, ANT_QUEUE_EVENT));
+    while (!ant_queue_take(ant, ant_queue(ant, chan, ANT_QUEUE_RESPONSE),
+                           match_response, &msg_id, NULL));
+
+    ant_batch_enter(ant);
+
+    /* messages batched before the burst, which are kept if it fails */
+    keep = ant->txbuf_sz;
+
+    while (rem) {
+        currsz = MIN(rem, packet_sz);
+
+        /* channel number */
+        msg.data[0] = chan;
+
+        /* packet sequence number */
+        msg.data[0] |= (seq++ << 5);
+        if (seq > 3)
+            seq = 1;
+
+        /* mark last packet */
+        if (rem == currsz)
+            msg.data[0] |= 0x80;
+
+        /* fill in data */
+        memcpy(&msg.data[1], dataptr, currsz);
+        if (currsz < packet_sz)
+            memset(&msg.data[1+currsz], 0, packet_sz - currsz);
+
+        /* queue packet, which writes out what's batched if there's no room */
+        queued = ant->txbuf_sz;
+        CHAINERR_LTZ(ant_send_message(ant, &msg), err);
+        if (ant->txbuf_sz < queued)
+            keep = 0;
+
+        /* move along */
         dataptr += currsz;
         rem -= currsz;
+
+        if (++batched < ANT_BURST_BATCH && rem)
+            continue;
+
+        keep = 0;
+        CHAINERR_LTZ(ant_batch_flush(ant), err);
+
+        if (ant->burst_paced && ant->burst_gap_us) {
+            gap_ns = (unsigned long)batched * ant->burst_gap_us * 1000;
+            ts.tv_sec = gap_ns / 1000000000;
+            ts.tv_nsec = gap_ns % 1000000000;
+            pthread_mutex_unlock(&ant->lock);
+            nanosleep(&ts, NULL);
+            pthread_mutex_lock(&ant->lock);
+        }
+        batched = 0;
+
+        /* pick up any errors without waiting */
+        ant_dispatch(ant, 0);
+        status = ant_burst_tx_status(ant, chan, msg_id);
+        if (status < 0)
+            goto err;
     }
 
-    ant_message_destroy(msg);
-    msg = NULL;
-    return 0;
+    ant_batch_leave(ant);
+
+    /* wait for the transfer to complete */
+    ant_deadline_set(&deadline, ANT_TIMEOUT_TRANSFER + ant_link_ms(ant));
+    while (!status) {
+        remaining = ant_deadline_remaining(&deadline);
+        if (!remaining || ant->dead) {
+            /* no event, assume the data was sent */
+            DBG("no burst completion event\n");
+            status = 1;
+            break;
+        }
+
+        ant_dispatch(ant, remaining);
+        status = ant_burst_tx_status(ant, chan, msg_id);
+    }
+
+    /* the device kept up, so pacing may no longer be needed */
+    if (status > 0 && ant->burst_paced)
+        ant->burst_paced--;
+
+    pthread_mutex_unlock(&ant->lock);
+
+#if DEBUG == 1
+    elapsed_us = ant_now_us() - start_us;
+    DBG("sent %d byte burst in %d byte packets at %lu bytes/s\n", (int)sz,
+        (int)packet_sz, elapsed_us ? (unsigned long)(sz * 1000000ULL / elapsed_us) : 0);
+#endif
+
+    return (status < 0) ? -1 : 0;
 
 err:
-    if (msg)
-        ant_message_destroy(msg);
+    /* don't send the remainder of a failed burst, only what was batched before */
+    ant->txbuf_sz = MIN(ant->txbuf_sz, keep);
+    ant_batch_leave(ant);
+    pthread_mutex_unlock(&ant->lock);
     return -1;
 }
 
+/* the timeout for an exchange of the given kind, in ms */
+unsigned ant_get_rto(ant_t *ant, ant_exchange_t xchg)
+{
+    unsigned rto_ms;
+
+    pthread_mutex_lock(&ant->lock);
+    rto_ms = ant->rto[xchg].rto_ms;
+    pthread_mutex_unlock(&ant->lock);
+
+    return rto_ms;
+}
+
+/* for exchanges timed outside libant, report how long one took... */
+void ant_rto_sample(ant_t *ant, ant_exchange_t xchg, unsigned long rtt_us)
+{
+    pthread_mutex_lock(&ant->lock);
+    ant_rto_update(ant, xchg, rtt_us);
+    pthread_mutex_unlock(&ant->lock);
+}
+
+/* ...or that it timed out */
+void ant_rto_expired(ant_t *ant, ant_exchange_t xchg)
+{
+    pthread_mutex_lock(&ant->lock);
+    ant_rto_backoff(ant, xchg);
+    pthread_mutex_unlock(&ant->lock);
+}
+
+/*
+ * Config commands are keyed by their own message ID, acknowledged data by 0x4f,
+ * received bursts by 0x50 & requests by 0x4d.
+ */
+void ant_get_latency(ant_t *ant, uint8_t msg_id, ant_latency_t *lat)
+{
+    pthread_mutex_lock(&ant->lock);
+    memcpy(lat, &ant->latency[msg_id], sizeof(*lat));
+    pthread_mutex_unlock(&ant->lock);
+}
+
+/* how late reads from the device have woken after timing out */
+void ant_get_jitter(ant_t *ant, ant_latency_t *jitter)
+{
+    pthread_mutex_lock(&ant->lock);
+    memcpy(jitter, &ant->jitter, sizeof(*jitter));
+    pthread_mutex_unlock(&ant->lock);
+}
+
+void ant_reset_latency(ant_t *ant)
+{
+    pthread_mutex_lock(&ant->lock);
+    memset(ant->latency, 0, sizeof(ant->latency));
+    memset(&ant->jitter, 0, sizeof(ant->jitter));
+    pthread_mutex_unlock(&ant->lock);
+}
+
+/* exchanges are retried by the caller, so retries are counted by it */
+void ant_count_retry(ant_t *ant, uint8_t msg_id)
+{
+    pthread_mutex_lock(&ant->lock);
+    ant->latency[msg_id].retries++;
+    pthread_mutex_unlock(&ant->lock);
+}
+
+/*
+ * Enable advanced bursts of up to packet_sz bytes per packet if the device
+ * supports them, for bursts sent from now on. Bursts are received either way.
+ * Returns the packet size bursts will be sent with, which is
+ * ANT_BURST_PACKET_LEGACY if advanced bursts aren't available.
+ */
+int ant_enable_advanced_burst(ant_t *ant, unsigned packet_sz)
+{
+    ant_message_t msg;
+    uint8_t caps[8], len;
+
+    packet_sz = MIN(packet_sz, ANT_BURST_PACKET_MAX) & ~7;
+    if (packet_sz <= ANT_BURST_PACKET_LEGACY)
+        goto legacy;
+
+    /* advanced options 3 bit 0 indicates advanced burst support */
+    memset(caps, 0, sizeof(caps));
+    if (ant_request_message(ant, 0, 0x54, &len, caps, sizeof(caps))) {
+        if (ant_is_dead(ant))
+            goto err;
+        INFO("base capabilities unknown, using legacy bursts\n");
+        goto legacy;
+    }
+    if (len < 7 || !(caps[6] & 0x01)) {
+        INFO("advanced burst unsupported\n");
+        goto legacy;
+    }
+
+    ant_message_init(&msg, 0x78, 9);
+    memset(msg.data, 0, msg.len);
+    msg.data[1] = 1;                    /* enable */
+    msg.data[2] = packet_sz / 8;        /* max packet length, 8 byte units */
+    if (ant_command(ant, &msg, 0)) {
+        if (ant_is_dead(ant))
+            goto err;
+        INFO("advanced burst config rejected\n");
+        goto legacy;
+    }
+
+    DBG("advanced burst enabled, %d byte packets\n", packet_sz);
+    goto out;
+legacy:
+    packet_sz = ANT_BURST_PACKET_LEGACY;
+out:
+    pthread_mutex_lock(&ant->lock);
+    ant->burst_packet_sz = packet_sz;
+    pthread_mutex_unlock(&ant->lock);
+    return packet_sz;
+err:
+    return -1;
+}
+
+void ant_set_burst_pacing(ant_t *ant, unsigned gap_us)
+{
+    pthread_mutex_lock(&ant->lock);
+    ant->burst_gap_us = gap_us;
+    pthread_mutex_unlock(&ant->lock);
+}
+
 int ant_set_channel_id(ant_t *ant, uint8_t chan, uint8_t dev_num[2], uint8_t dev_type, uint8_t trans_type)
 {
-    ant_message_t *msg = NULL;
+    ant_message_t msg;
+
+    ant_message_init(&msg, 0x51, 5);
+    msg.data[0] = chan;
+    memcpy(&msg.data[1], dev_num, 2);
+    msg.data[3] = dev_type;
+    msg.data[4] = trans_type;
+
+    return ant_command(ant, &msg, chan);
+}
+
+typedef struct {
+    uint8_t chan;
+    uint8_t msg_id;
+} ant_request_t;
+
+static bool match_request(ant_message_t *msg, void *arg)
+{
+    ant_request_t *req = arg;
+
+    if (msg->id != req->msg_id)
+        return false;
+
+    /* capabilities aren't tied to a channel */
+    if (msg->id == 0x54)
+        return true;
+
+    return msg->len >= 1 && msg->data[0] == req->chan;
+}
+
+/*
+ * Ask the device to send the message msg_id about chan, & receive it. Fails
+ * if the device doesn't reply, which only happens if it's unresponsive or
+ * doesn't support the request.
+ */
+int ant_request_message(ant_t *ant, uint8_t chan, uint8_t msg_id, uint8_t *len, uint8_t *buf, size_t sz)
+{
+    struct timespec deadline;
+    ant_message_t msg;
+    ant_request_t req;
+    uint64_t sent_us;
+
+    ant_message_init(&msg, 0x4d, 2);
+    msg.data[0] = chan;
+    msg.data[1] = msg_id;
+
+    req.chan = chan;
+    req.msg_id = msg_id;
 
-    CHAINERR_NULL(msg, ant_message_create(0x51, 5), err);
-    msg->data[0] = chan;
-    memcpy(&msg->data[1], dev_num, 2);
-    msg->data[3] = dev_type;
-    msg->data[4] = trans_type;
+    pthread_mutex_lock(&ant->lock);
+
+    /* discard replies to earlier requests which timed out */
+    while (!ant_queue_take(ant, &ant->queue_global, match_request, &req, NULL))
+        ;
+
+    sent_us = ant_now_us();
+    CHAINERR_LTZ(ant_send_message(ant, &msg), err);
+
+    ant_deadline_set(&deadline, ant->rto[ANT_XCHG_REQUEST].rto_ms);
+    if (ant_queue_wait(ant, &ant->queue_global, match_request, &req, &msg, &deadline)) {
+        ERR("no reply to request for 0x%02x\n", msg_id);
+        ant->latency[0x4d].timeouts++;
+        ant_rto_backoff(ant, ANT_XCHG_REQUEST);
+        goto err;
+    }
+    ant_rto_update(ant, ANT_XCHG_REQUEST, ant_latency_record(ant, 0x4d, sent_us));
+
+    pthread_mutex_unlock(&ant->lock);
+
+    if (len)
+        *len = msg.len;
+    if (buf)
+        memcpy(buf, msg.data, MIN(sz, msg.len));
+
+    return 0;
+err:
+    pthread_mutex_unlock(&ant->lock);
+    return -1;
+}
+
+int ant_get_channel_status(ant_t *ant, uint8_t chan, ant_channel_status_t *status)
+{
+    uint8_t buf[2], len;
+
+    CHAINERR_LTZ(ant_request_message(ant, chan, 0x52, &len, buf, sizeof(buf)), err);
+    if (len < 2) {
+        ERR("short channel status\n");
+        return -1;
+    }
+
+    status->state = buf[1] & 0x03;
+    status->net = (buf[1] >> 2) & 0x03;
+    status->type = buf[1] >> 4;
+
+    return 0;
+err:
+    return -1;
+}
+
+int ant_get_channel_id(ant_t *ant, uint8_t chan, uint8_t dev_num[2], uint8_t *dev_type, uint8_t *trans_type)
+{
+    uint8_t buf[5], len;
+
+    CHAINERR_LTZ(ant_request_message(ant, chan, 0x51, &len, buf, sizeof(buf)), err);
+    if (len < 5) {
+        ERR("short channel ID\n");
+        return -1;
+    }
 
-    CHAINERR_LTZ(ant_send_message(ant, msg), err);
-    ant_message_destroy(msg);
-    msg = NULL;
-    CHAINERR_LTZ(ant_check_ok(ant, 0x51), err);
+    memcpy(dev_num, &buf[1], 2);
+    if (dev_type)
+        *dev_type = buf[3];
+    if (trans_type)
+        *trans_type = buf[4];
 
     return 0;
 err:
-    if (msg)
-        ant_message_destroy(msg);
     return -1;
 }
@@ -19,17 +19,99 @@
 #define __ant_h__
 
 #include <stdbool.h>
+#include <poll.h>
 #include <stdint.h>
+#include <sys/uio.h>
 
 typedef struct ant_s ant_t;
+typedef struct ant_context_s ant_context_t;
+typedef struct ant_capture_s ant_capture_t;
+
+/* a burst was abandoned because of a gap in its sequence numbers */
+#define ANT_ERR_BURST_SEQ -2
+
+/* bytes carried by each burst packet, advanced bursts carry up to 24 */
+#define ANT_BURST_PACKET_LEGACY 8
+#define ANT_BURST_PACKET_MAX    24
+
+typedef struct {
+    unsigned long packets;
+    unsigned long lost;
+    unsigned long duplicated;
+
+    /* throughput, measured from the first packet to the last */
+    unsigned long bytes;
+    unsigned long duration_us;
+    unsigned long bytes_per_sec;
+    unsigned packet_sz;
+} ant_burst_stats_t;
+
+/*
+ * Round trip times of exchanges with a base, kept per message ID. Bucket i
+ * counts exchanges taking under ANT_LATENCY_BUCKET0_US << i, the last bucket
+ * anything longer. Also used for how late reads wake after timing out, see
+ * ant_get_jitter, which leaves timeouts & retries at 0.
+ */
+#define ANT_LATENCY_BUCKETS     16
+#define ANT_LATENCY_BUCKET0_US  128
+
+typedef struct {
+    unsigned long count;
+    unsigned long timeouts;
+    unsigned long retries;
+    unsigned long long total_us;
+    unsigned long max_us;
+    unsigned long buckets[ANT_LATENCY_BUCKETS];
+} ant_latency_t;
+
+/*
+ * Kinds of exchange whose timeouts are derived from how long they've taken on
+ * each base, like TCP's retransmission timeout.
+ */
+typedef enum {
+    ANT_XCHG_COMMAND = 0,       /* command until its response */
+    ANT_XCHG_TRANSFER,          /* acknowledged data until its transfer event */
+    ANT_XCHG_ACKED,             /* waiting for acknowledged data */
+    ANT_XCHG_BURST,             /* between packets of a received burst */
+    ANT_XCHG_BURST_START,       /* waiting for the first packet of a burst */
+    ANT_XCHG_REQUEST,           /* request until its reply */
+    ANT_XCHG_STARTUP,           /* reset until the startup message */
+    ANT_XCHG_BEACON,            /* opening a channel until a broadcast */
+    ANT_XCHG_TYPES,
+} ant_exchange_t;
+
+/* channel states reported by the channel status message */
+#define ANT_CHANNEL_UNASSIGNED  0
+#define ANT_CHANNEL_ASSIGNED    1
+#define ANT_CHANNEL_SEARCHING   2
+#define ANT_CHANNEL_TRACKING    3
+
+typedef struct {
+    uint8_t state;
+    uint8_t net;
+    uint8_t type;
+} ant_channel_status_t;
 
 typedef void (ant_cb_foundnode)(ant_t *ant, void *user);
 
+ant_context_t *ant_context_create(void);
+void ant_context_destroy(ant_context_t *ctx);
+int ant_context_find_nodes(ant_context_t *ctx, ant_cb_foundnode *found_node, void *user);
+int ant_context_wait_for_nodes(ant_context_t *ctx, unsigned timeout_ms);
+
 int ant_find_nodes(ant_cb_foundnode *found_node, void *user);
+int ant_wait_for_nodes(unsigned timeout_ms);
 void ant_destroy(ant_t *ant);
 bool ant_is_dead(ant_t *ant);
 int ant_receive(ant_t *ant, uint8_t *msg_id, uint8_t *len, uint8_t *buf, size_t sz);
+int ant_receive_message(ant_t *ant, int chan, uint8_t msg_id, uint8_t *len, uint8_t *buf, size_t sz, unsigned timeout_ms);
 int ant_poll(ant_t *ant);
+int ant_get_pollfds(ant_t *ant, struct pollfd *fds, int nfds);
+int ant_get_timeout(ant_t *ant);
+int ant_process(ant_t *ant);
+
+void ant_batch_begin(ant_t *ant);
+int ant_batch_end(ant_t *ant);
 
 int ant_unassign_channel(ant_t *ant, uint8_t chan);
 int ant_assign_channel(ant_t *ant, uint8_t chan, uint8_t type, uint8_t net);
@@ -44,7 +126,26 @@ int ant_close_channel(ant_t *ant, uint8_t chan);
 int ant_send_acked_data(ant_t *ant, uint8_t chan, uint8_t data[8]);
 int ant_receive_acked_response(ant_t *ant, uint8_t chan, uint8_t *data, size_t sz);
 int ant_receive_burst(ant_t *ant, uint8_t chan, uint8_t *data, size_t sz, size_t *len);
+int ant_receive_burstv(ant_t *ant, uint8_t chan, const struct iovec *iov, int iovcnt, size_t *len);
+void ant_get_burst_stats(ant_t *ant, uint8_t chan, ant_burst_stats_t *stats);
 int ant_send_burst(ant_t *ant, uint8_t chan, uint8_t *data, size_t sz);
+void ant_set_burst_pacing(ant_t *ant, unsigned gap_us);
+int ant_enable_advanced_burst(ant_t *ant, unsigned packet_sz);
 int ant_set_channel_id(ant_t *ant, uint8_t chan, uint8_t dev_num[2], uint8_t dev_type, uint8_t trans_type);
+ant_capture_t *ant_capture_open(const char *filename);
+void ant_capture_close(ant_capture_t *cap);
+void ant_set_capture(ant_t *ant, ant_capture_t *cap);
+unsigned ant_get_rto(ant_t *ant, ant_exchange_t xchg);
+void ant_rto_sample(ant_t *ant, ant_exchange_t xchg, unsigned long rtt_us);
+void ant_rto_expired(ant_t *ant, ant_exchange_t xchg);
+void ant_get_latency(ant_t *ant, uint8_t msg_id, ant_latency_t *lat);
+void ant_get_jitter(ant_t *ant, ant_latency_t *jitter);
+void ant_reset_latency(ant_t *ant);
+int ant_start_io_thread(ant_t *ant, int rt_priority);
+void ant_stop_io_thread(ant_t *ant);
+void ant_count_retry(ant_t *ant, uint8_t msg_id);
+int ant_request_message(ant_t *ant, uint8_t chan, uint8_t msg_id, uint8_t *len, uint8_t *buf, size_t sz);
+int ant_get_channel_status(ant_t *ant, uint8_t chan, ant_channel_status_t *status);
+int ant_get_channel_id(ant_t *ant, uint8_t chan, uint8_t dev_num[2], uint8_t *dev_type, uint8_t *trans_type);
 
 #endif /* __ant_h__ */
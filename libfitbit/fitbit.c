@@ -15,6 +15,7 @@
  * along with fitbitd.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -27,6 +28,14 @@
 #define LOG_TAG "fitbit"
 #include "log.h"
 
+/*
+ * Maximum number of trackers synced at once, each on a channel of its own.
+ * The base's channel is kept for discovering trackers.
+ */
+#define FITBIT_MAX_SESSIONS 7
+
+typedef struct fitbit_session_s fitbit_session_t;
+
 struct fitbit_s {
     ant_t *ant;
     uint8_t chan;
@@ -35,6 +44,40 @@ struct fitbit_s {
 
     uint8_t curr_dev_num[2];
     uint8_t skipped_setups, max_skipped_setups;
+
+    /* the network key & tx power have been set since the base was reset */
+    bool configured;
+
+    /* send the channel configuration without waiting for each response */
+    bool pipelined_setup;
+
+    /* use advanced bursts if the base supports them, once negotiated */
+    bool advanced_burst;
+    bool burst_negotiated;
+
+    /* trackers being synced, protected by lock & signalled via cond */
+    fitbit_session_t *sessions;
+    int max_sessions;
+
+    /* sessions the base has channels for, 0 until its capabilities are known */
+    int base_sessions;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+/*
+ * A tracker being synced by its own thread. fb shares the base's ant_t but
+ * uses a different channel.
+ */
+struct fitbit_session_s {
+    fitbit_t fb;
+    fitbit_t *base;
+    fitbit_cb_sync *do_sync;
+    void *user;
+
+    pthread_t thread;
+    bool active, done;
+    int ret;
 };
 
 typedef struct {
@@ -43,13 +86,144 @@ typedef struct {
     int found;
 } fitbit_ant_state_t;
 
-static int fitbit_init_ant_channel(fitbit_t *fb, uint8_t dev_num[2])
+static unsigned long fitbit_elapsed_us(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000 + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/* configure & open fb->chan, which must be unassigned */
+static int fitbit_config_ant_channel(fitbit_t *fb, uint8_t dev_num[2])
 {
-    uint8_t net_key[8] = { 0 };
     uint8_t period[2] = { 0x00, 0x10 };
-    uint8_t msg_id;
-    struct timespec ts;
-    int attempts;
+
+    CHAINERR_LTZ(ant_assign_channel(fb->ant, fb->chan, 0, 0), err);
+    CHAINERR_LTZ(ant_set_channel_period(fb->ant, fb->chan, period), err);
+    CHAINERR_LTZ(ant_set_channel_freq(fb->ant, fb->chan, 2), err);
+    CHAINERR_LTZ(ant_set_channel_search_timeout(fb->ant, fb->chan, 0xff), err);
+    CHAINERR_LTZ(ant_set_channel_id(fb->ant, fb->chan, dev_num, 1, 1), err);
+    CHAINERR_LTZ(ant_open_channel(fb->ant, fb->chan), err);
+
+    return 0;
+err:
+    return -1;
+}
+
+/* configure the base following a reset, then open fb->chan */
+static int fitbit_config_ant(fitbit_t *fb, uint8_t dev_num[2])
+{
+    uint8_t net_key[8] = { 0 };
+
+    CHAINERR_LTZ(ant_set_network_key(fb->ant, 0, net_key), err);
+    CHAINERR_LTZ(ant_set_tx_power(fb->ant, 3), err);
+    CHAINERR_LTZ(fitbit_config_ant_channel(fb, dev_num), err);
+
+    return 0;
+err:
+    return -1;
+}
+
+/*
+ * Bring fb->chan to dev_num from whatever state the base reports it to be in,
+ * only changing what differs. Fails if the base doesn't answer, or the
+ * changes fail, in which case it needs resetting.
+ */
+static int fitbit_probe_ant_channel(fitbit_t *fb, uint8_t dev_num[2])
+{
+    ant_channel_status_t status;
+    uint8_t curr[2], dev_type, trans_type;
+    bool open;
+
+    CHAINERR_LTZ(ant_get_channel_status(fb->ant, fb->chan, &status), err);
+    DBG("channel %d state %d net %d type %d\n", fb->chan, status.state,
+        status.net, status.type);
+
+    if (status.state != ANT_CHANNEL_UNASSIGNED) {
+        open = status.state != ANT_CHANNEL_ASSIGNED;
+
+        if (fb->configured && status.net == 0 && status.type == 0) {
+            /* the channel is as we left it, check who it's looking for */
+            CHAINERR_LTZ(ant_get_channel_id(fb->ant, fb->chan, curr, &dev_type, &trans_type), err);
+
+            if (!memcmp(curr, dev_num, sizeof(curr)) && dev_type == 1 && trans_type == 1) {
+                DBG("channel ID unchanged\n");
+                if (!open)
+                    CHAINERR_LTZ(ant_open_channel(fb->ant, fb->chan), err);
+                return 0;
+            }
+
+            if (open)
+                CHAINERR_LTZ(ant_close_channel(fb->ant, fb->chan), err);
+            CHAINERR_LTZ(ant_set_channel_id(fb->ant, fb->chan, dev_num, 1, 1), err);
+            CHAINERR_LTZ(ant_open_channel(fb->ant, fb->chan), err);
+            return 0;
+        }
+
+        /* configured by someone else, start over */
+        if (open)
+            CHAINERR_LTZ(ant_close_channel(fb->ant, fb->chan), err);
+        CHAINERR_LTZ(ant_unassign_channel(fb->ant, fb->chan), err);
+    }
+
+    if (fb->configured)
+        return fitbit_config_ant_channel(fb, dev_num);
+
+    CHAINERR_LTZ(fitbit_config_ant(fb, dev_num), err);
+    fb->configured = true;
+
+    return 0;
+err:
+    return -1;
+}
+
+/* run setup, with the responses checked at the end if pipelined */
+static int fitbit_setup_ant_channel(fitbit_t *fb, uint8_t dev_num[2],
+                                    int (*setup)(fitbit_t *fb, uint8_t dev_num[2]))
+{
+    int ret;
+
+    if (fb->pipelined_setup)
+        ant_batch_begin(fb->ant);
+    ret = setup(fb, dev_num);
+    if (fb->pipelined_setup && ant_batch_end(fb->ant))
+        ret = -1;
+
+    return ret;
+}
+
+/* reset the base & configure it from scratch */
+static int fitbit_reset_ant_channel(fitbit_t *fb, uint8_t dev_num[2])
+{
+    struct timespec start;
+
+    fb->configured = false;
+    fb->burst_negotiated = false;
+
+    CHAINERR_LTZ(ant_reset(fb->ant), err);
+
+    /* wait for the startup message, reset takes around 500ms */
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (ant_receive_message(fb->ant, -1, 0x6f, NULL, NULL, 0,
+                            ant_get_rto(fb->ant, ANT_XCHG_STARTUP))) {
+        DBG("no startup message\n");
+        ant_rto_expired(fb->ant, ANT_XCHG_STARTUP);
+    } else {
+        ant_rto_sample(fb->ant, ANT_XCHG_STARTUP, fitbit_elapsed_us(&start));
+    }
+
+    CHAINERR_LTZ(fitbit_setup_ant_channel(fb, dev_num, fitbit_config_ant), err);
+    fb->configured = true;
+
+    return 0;
+err:
+    return -1;
+}
+
+static int fitbit_init_ant_channel(fitbit_t *fb, uint8_t dev_num[2])
+{
+    struct timespec start, end;
 
     if (!memcmp(dev_num, fb->curr_dev_num, sizeof(fb->curr_dev_num))) {
         if (fb->skipped_setups++ < fb->max_skipped_setups) {
@@ -60,39 +234,29 @@ static int fitbit_init_ant_channel(fitbit_t *fb, uint8_t dev_num[2])
     DBG("init ANT channel %d dev_num 0x%02x 0x%02x\n", fb->chan,
         dev_num[0], dev_num[1]);
 
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
     /* ensure failure will cause a retry */
     memset(fb->curr_dev_num, 0, sizeof(fb->curr_dev_num));
 
-    /* reset the base */
-    CHAINERR_LTZ(ant_reset(fb->ant), err);
-
-    /* reset takes 500ms */
-    memset(&ts, 0, sizeof(ts));
-    ts.tv_nsec = 500 * 1000000; /* 500ms */
-    nanosleep(&ts, NULL);
+    /* only reset the base if it can't be brought into shape otherwise */
+    if (fitbit_setup_ant_channel(fb, dev_num, fitbit_probe_ant_channel)) {
+        INFO("ANT channel probe failed, resetting base\n");
+        CHAINERR_LTZ(fitbit_reset_ant_channel(fb, dev_num), err);
+    }
 
-    /* startup message */
-    attempts = 10;
-    ts.tv_nsec = 100 * 1000000; /* 100ms */
-    while (attempts--) {
-        if (!ant_receive(fb->ant, &msg_id, NULL, NULL, 0)) {
-            if (msg_id == 0x6f) {
-                /* got startup message */
-                break;
-            }
-        }
-        nanosleep(&ts, NULL);
+    /* outside of any batch, so a base which refuses can be fallen back from */
+    if (!fb->burst_negotiated) {
+        CHAINERR_LTZ(ant_enable_advanced_burst(fb->ant, fb->advanced_burst ?
+                                               ANT_BURST_PACKET_MAX :
+                                               ANT_BURST_PACKET_LEGACY), err);
+        fb->burst_negotiated = true;
     }
 
-    /* channel init */
-    CHAINERR_LTZ(ant_set_network_key(fb->ant, fb->chan, net_key), err);
-    CHAINERR_LTZ(ant_assign_channel(fb->ant, fb->chan, 0, 0), err);
-    CHAINERR_LTZ(ant_set_channel_period(fb->ant, fb->chan, period), err);
-    CHAINERR_LTZ(ant_set_channel_freq(fb->ant, fb->chan, 2), err);
-    CHAINERR_LTZ(ant_set_tx_power(fb->ant, 3), err);
-    CHAINERR_LTZ(ant_set_channel_search_timeout(fb->ant, fb->chan, 0xff), err);
-    CHAINERR_LTZ(ant_set_channel_id(fb->ant, fb->chan, dev_num, 1, 1), err);
-    CHAINERR_LTZ(ant_open_channel(fb->ant, fb->chan), err);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    DBG("ANT channel setup took %ldms%s\n",
+        (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000,
+        fb->pipelined_setup ? " (pipelined)" : "");
 
     /* all done, record dev num */
     memcpy(fb->curr_dev_num, dev_num, sizeof(fb->curr_dev_num));
@@ -105,26 +269,20 @@ err:
 
 static int fitbit_find_tracker_beacon(fitbit_t *fb)
 {
-    struct timespec ts;
-    int attempts;
-    uint8_t msg_id = 0;
+    struct timespec start;
 
-    /* look for tracker beacon */
-    attempts = 50;
-    memset(&ts, 0, sizeof(ts));
-    ts.tv_nsec = 100 * 1000000; /* 100ms */
-    while (attempts--) {
-        if (!ant_receive(fb->ant, &msg_id, NULL, NULL, 0)) {
-            if (msg_id == 0x4e) {
-                /* broadcast from tracker */
-                return 0;
-            }
-        }
-        nanosleep(&ts, NULL);
-    }
+    /* look for a broadcast from the tracker */
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (ant_receive_message(fb->ant, fb->chan, 0x4e, NULL, NULL, 0,
+                            ant_get_rto(fb->ant, ANT_XCHG_BEACON)))
+        return -1;
 
-    /* no tracker beacon */
-    return -1;
+    /*
+     * only successes are sampled, as no broadcast usually means there's no
+     * tracker in range rather than that it took too long to arrive
+     */
+    ant_rto_sample(fb->ant, ANT_XCHG_BEACON, fitbit_elapsed_us(&start));
+    return 0;
 }
 
 static uint8_t fitbit_packet_id(fitbit_t *fb)
@@ -138,22 +296,38 @@ static uint8_t fitbit_packet_id(fitbit_t *fb)
 
 static int fitbit_tracker_receive_burst(fitbit_t *fb, uint8_t *buf, size_t sz, size_t *len)
 {
-    uint8_t burstbuf[0xffff + 8];
+    uint8_t hdr[8];
+    struct iovec iov[2];
     size_t burstlen, datalen;
+    int ret;
+
+    /* the header & data are received directly into their destinations */
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = buf;
+    iov[1].iov_len = sz;
 
-    CHAINERR_LTZ(ant_receive_burst(fb->ant, fb->chan, burstbuf, sizeof(burstbuf), &burstlen), err);
+    ret = ant_receive_burstv(fb->ant, fb->chan, iov, 2, &burstlen);
+    if (ret < 0)
+        return ret;
 
-    if (burstlen < 1 || burstbuf[1] != 0x81) {
+    if (burstlen < sizeof(hdr) || hdr[1] != 0x81) {
         ERR("not a tracker burst\n");
         goto err;
     }
 
-    datalen = (burstbuf[3] << 8) | burstbuf[2];
+    datalen = (hdr[3] << 8) | hdr[2];
+    burstlen -= sizeof(hdr);
     DBG("tracker burst %d bytes\n", (int)datalen);
 
-    memcpy(buf, &burstbuf[8], MIN(datalen, sz));
+    /* a burst which filled buf is truncated to fit, otherwise it ended early */
+    if (datalen > burstlen && burstlen < sz) {
+        ERR("short tracker burst, %d of %d bytes\n", (int)burstlen, (int)datalen);
+        goto err;
+    }
+
     if (len)
-        *len = MIN(datalen, sz);
+        *len = MIN(datalen, burstlen);
 
     return 0;
 err:
@@ -199,6 +373,7 @@ oom:
 static int fitbit_get_data_bank(fitbit_t *fb, uint8_t *buf, size_t sz, size_t *bank_len)
 {
     uint8_t data[8];
+    int ret;
 
     DBG("reading data bank\n");
 
@@ -214,7 +389,9 @@ static int fitbit_get_data_bank(fitbit_t *fb, uint8_t *buf, size_t sz, size_t *b
     CHAINERR_LTZ(ant_send_acked_data(fb->ant, fb->chan, data), err);
 
     /* read data */
-    CHAINERR_LTZ(fitbit_tracker_receive_burst(fb, buf, sz, bank_len), err);
+    ret = fitbit_tracker_receive_burst(fb, buf, sz, bank_len);
+    if (ret < 0)
+        return ret;
     DBG("got whole data bank\n");
     return 0;
 
@@ -227,6 +404,7 @@ int fitbit_run_op(fitbit_t *fb, uint8_t op[7], uint8_t *payload, size_t payload_
     uint8_t data[8];
     int attempts = 10;
     size_t len;
+    int ret;
 
     if (response_len)
         *response_len = 0;
@@ -257,7 +435,13 @@ int fitbit_run_op(fitbit_t *fb, uint8_t op[7], uint8_t *payload, size_t payload_
 
         if (data[1] == 0x42) {
             /* use banked data */
-            CHAINERR_LTZ(fitbit_get_data_bank(fb, response, response_sz, response_len), err_attempt);
+            ret = fitbit_get_data_bank(fb, response, response_sz, response_len);
+            if (ret == ANT_ERR_BURST_SEQ) {
+                /* lost part of the bank, no point waiting for the rest */
+                DBG("bank incomplete, retrying op\n");
+                goto err_attempt;
+            }
+            CHAINERR_LTZ(ret, err_attempt);
             return 0;
         }
 
@@ -284,16 +468,17 @@ int fitbit_run_op(fitbit_t *fb, uint8_t op[7], uint8_t *payload, size_t payload_
         /* unknown */
 
 err_attempt:
-        continue;
+        if (attempts)
+            ant_count_retry(fb->ant, 0x4f);
     }
 
     return -1;
 }
 
+/* sync a tracker which has been moved to fb's channel */
 static int fitbit_sync_single_tracker(fitbit_t *fb, fitbit_cb_sync *do_sync, void *user)
 {
     uint8_t data[8];
-    uint8_t dev_num[2];
     uint8_t op[7];
     uint8_t info[12];
     fitbit_tracker_info_t tracker;
@@ -301,32 +486,6 @@ static int fitbit_sync_single_tracker(fitbit_t *fb, fitbit_cb_sync *do_sync, voi
     /* begin at packet ID 0x39 */
     fb->packet_id_counter = 1;
 
-    /* reset tracker */
-    memset(data, 0, sizeof(data));
-    data[0] = 0x78;
-    data[1] = 0x01;
-    CHAINERR_LTZ(ant_send_acked_data(fb->ant, fb->chan, data), err);
-
-    /* generate a device number to use for sync */
-    dev_num[0] = rand() % 0xff;
-    dev_num[1] = rand() % 0xff;
-
-    DBG("sync tracker using device number 0x%02x 0x%02x\n", dev_num[0], dev_num[1]);
-
-    /* inform tracker of new device number */
-    memset(data, 0, sizeof(data));
-    data[0] = 0x78;
-    data[1] = 0x02;
-    data[2] = dev_num[0];
-    data[3] = dev_num[1];
-    CHAINERR_LTZ(ant_send_acked_data(fb->ant, fb->chan, data), err);
-
-    /* close channel used to find tracker */
-    CHAINERR_LTZ(ant_close_channel(fb->ant, fb->chan), err);
-
-    /* reinitialise channel with new device number */
-    CHAINERR_LTZ(fitbit_init_ant_channel(fb, dev_num), err);
-
     /* wait for the tracker beacon */
     CHAINERR_LTZ(fitbit_find_tracker_beacon(fb), err);
 
@@ -367,26 +526,232 @@ err:
     return -1;
 }
 
-static void fitbit_found_ant_node(ant_t *ant, void *user)
+static void *fitbit_session_main(void *arg)
+{
+    fitbit_session_t *session = arg;
+    fitbit_t *fb = &session->fb;
+    fitbit_t *base = session->base;
+    int ret;
+
+    ret = fitbit_sync_single_tracker(fb, session->do_sync, session->user);
+
+    /* free the channel for the next session */
+    ant_close_channel(fb->ant, fb->chan);
+    ant_unassign_channel(fb->ant, fb->chan);
+
+    pthread_mutex_lock(&base->lock);
+    session->ret = ret;
+    session->done = true;
+    pthread_cond_signal(&base->cond);
+    pthread_mutex_unlock(&base->lock);
+
+    return NULL;
+}
+
+/*
+ * Join sessions which have finished, returning the number which synced a
+ * tracker. Called with fb->lock held.
+ */
+static int fitbit_session_reap(fitbit_t *fb)
+{
+    fitbit_session_t *session;
+    int i, count = 0;
+
+    for (i = 0; i < FITBIT_MAX_SESSIONS; i++) {
+        session = &fb->sessions[i];
+        if (!session->active || !session->done)
+            continue;
+
+        pthread_join(session->thread, NULL);
+        session->active = false;
+        if (!session->ret)
+            count++;
+    }
+
+    return count;
+}
+
+/* wait for a session to be free, adding synced trackers to *count */
+static fitbit_session_t *fitbit_session_get(fitbit_t *fb, int *count)
+{
+    fitbit_session_t *session = NULL;
+    int i;
+
+    pthread_mutex_lock(&fb->lock);
+
+    while (true) {
+        *count += fitbit_session_reap(fb);
+
+        for (i = 0; i < fb->max_sessions; i++) {
+            if (!fb->sessions[i].active) {
+                session = &fb->sessions[i];
+                break;
+            }
+        }
+        if (session)
+            break;
+
+        pthread_cond_wait(&fb->cond, &fb->lock);
+    }
+
+    pthread_mutex_unlock(&fb->lock);
+    return session;
+}
+
+/* wait for all sessions to finish, returning the number which synced */
+static int fitbit_session_wait_all(fitbit_t *fb)
+{
+    int i, active, count = 0;
+
+    pthread_mutex_lock(&fb->lock);
+
+    while (true) {
+        count += fitbit_session_reap(fb);
+
+        for (i = active = 0; i < FITBIT_MAX_SESSIONS; i++)
+            active += fb->sessions[i].active;
+        if (!active)
+            break;
+
+        pthread_cond_wait(&fb->cond, &fb->lock);
+    }
+
+    pthread_mutex_unlock(&fb->lock);
+    return count;
+}
+
+/* true if dev_num is in use by an active session */
+static bool fitbit_session_dev_num_used(fitbit_t *fb, uint8_t dev_num[2])
+{
+    int i;
+
+    for (i = 0; i < FITBIT_MAX_SESSIONS; i++) {
+        if (fb->sessions[i].active &&
+            !memcmp(fb->sessions[i].fb.curr_dev_num, dev_num, 2))
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * Move the tracker found on the discovery channel to a device number & channel
+ * of its own, then sync it from a new thread.
+ */
+static int fitbit_session_start(fitbit_t *fb, fitbit_session_t *session, fitbit_cb_sync *do_sync, void *user)
+{
+    fitbit_t *tfb = &session->fb;
+    uint8_t data[8];
+    uint8_t dev_num[2];
+    int ret;
+
+    /* reset tracker */
+    memset(data, 0, sizeof(data));
+    data[0] = 0x78;
+    data[1] = 0x01;
+    CHAINERR_LTZ(ant_send_acked_data(fb->ant, fb->chan, data), err);
+
+    /* generate a device number to use for sync, unique amongst sessions */
+    do {
+        dev_num[0] = rand() % 0xff;
+        dev_num[1] = rand() % 0xff;
+    } while (fitbit_session_dev_num_used(fb, dev_num));
+
+    /* inform tracker of new device number */
+    memset(data, 0, sizeof(data));
+    data[0] = 0x78;
+    data[1] = 0x02;
+    data[2] = dev_num[0];
+    data[3] = dev_num[1];
+    CHAINERR_LTZ(ant_send_acked_data(fb->ant, fb->chan, data), err);
+
+    /* restart the search for trackers */
+    CHAINERR_LTZ(ant_close_channel(fb->ant, fb->chan), err);
+    CHAINERR_LTZ(ant_open_channel(fb->ant, fb->chan), err);
+
+    /* setup the session's channel with the new device number */
+    tfb->ant = fb->ant;
+    tfb->chan = fb->chan + 1 + (session - fb->sessions);
+    tfb->pipelined_setup = fb->pipelined_setup;
+
+    DBG("sync tracker on channel %d using device number 0x%02x 0x%02x\n",
+        tfb->chan, dev_num[0], dev_num[1]);
+
+    if (tfb->pipelined_setup)
+        ant_batch_begin(tfb->ant);
+    ret = fitbit_config_ant_channel(tfb, dev_num);
+    if (tfb->pipelined_setup && ant_batch_end(tfb->ant))
+        ret = -1;
+    if (ret)
+        goto err;
+    memcpy(tfb->curr_dev_num, dev_num, sizeof(tfb->curr_dev_num));
+
+    session->base = fb;
+    session->do_sync = do_sync;
+    session->user = user;
+    session->done = false;
+
+    pthread_mutex_lock(&fb->lock);
+    ret = pthread_create(&session->thread, NULL, fitbit_session_main, session);
+    if (!ret)
+        session->active = true;
+    pthread_mutex_unlock(&fb->lock);
+
+    if (ret) {
+        ERR("pthread_create failure %d\n", ret);
+        ant_close_channel(tfb->ant, tfb->chan);
+        ant_unassign_channel(tfb->ant, tfb->chan);
+        goto err;
+    }
+
+    return 0;
+err:
+    return -1;
+}
+
+/* create a base using ant, which is destroyed along with it */
+fitbit_t *fitbit_create(ant_t *ant)
 {
-    fitbit_ant_state_t *state = user;
     fitbit_t *fb;
 
     fb = calloc(1, sizeof(*fb));
     if (!fb) {
         ERR("failed to malloc fitbit\n");
-        return;
+        return NULL;
+    }
+
+    fb->sessions = calloc(FITBIT_MAX_SESSIONS, sizeof(*fb->sessions));
+    if (!fb->sessions) {
+        ERR("failed to malloc fitbit sessions\n");
+        free(fb);
+        return NULL;
     }
 
     fb->ant = ant;
     fb->packet_id_counter = 1;
     fb->max_skipped_setups = 10;
+    fb->pipelined_setup = true;
+    fb->max_sessions = 1;
+    pthread_mutex_init(&fb->lock, NULL);
+    pthread_cond_init(&fb->cond, NULL);
+
+    return fb;
+}
+
+static void fitbit_found_ant_node(ant_t *ant, void *user)
+{
+    fitbit_ant_state_t *state = user;
+    fitbit_t *fb;
+
+    fb = fitbit_create(ant);
+    if (!fb)
+        return;
 
     state->found++;
     state->found_base(fb, state->user);
 }
 
-int fitbit_find_bases(fitbit_cb_foundbase *found_base, void *user)
+int fitbit_find_bases_ctx(ant_context_t *ctx, fitbit_cb_foundbase *found_base, void *user)
 {
     fitbit_ant_state_t state;
 
@@ -394,14 +759,37 @@ int fitbit_find_bases(fitbit_cb_foundbase *found_base, void *user)
     state.user = user;
     state.found = 0;
 
-    ant_find_nodes(fitbit_found_ant_node, &state);
+    if (ctx)
+        ant_context_find_nodes(ctx, fitbit_found_ant_node, &state);
+    else
+        ant_find_nodes(fitbit_found_ant_node, &state);
 
     return state.found;
 }
 
+int fitbit_find_bases(fitbit_cb_foundbase *found_base, void *user)
+{
+    return fitbit_find_bases_ctx(NULL, found_base, user);
+}
+
+int fitbit_wait_for_bases_ctx(ant_context_t *ctx, unsigned timeout_ms)
+{
+    if (ctx)
+        return ant_context_wait_for_nodes(ctx, timeout_ms);
+    return ant_wait_for_nodes(timeout_ms);
+}
+
+int fitbit_wait_for_bases(unsigned timeout_ms)
+{
+    return fitbit_wait_for_bases_ctx(NULL, timeout_ms);
+}
+
 void fitbit_destroy(fitbit_t *fb)
 {
     ant_destroy(fb->ant);
+    pthread_cond_destroy(&fb->cond);
+    pthread_mutex_destroy(&fb->lock);
+    free(fb->sessions);
     free(fb);
 }
 
@@ -410,32 +798,113 @@ void fitbit_set_max_setup_skip(fitbit_t *fb, uint8_t max_skip)
     fb->max_skipped_setups = max_skip;
 }
 
+void fitbit_set_capture(fitbit_t *fb, ant_capture_t *cap)
+{
+    ant_set_capture(fb->ant, cap);
+}
+
+void fitbit_get_latency(fitbit_t *fb, uint8_t msg_id, ant_latency_t *lat)
+{
+    ant_get_latency(fb->ant, msg_id, lat);
+}
+
+void fitbit_get_jitter(fitbit_t *fb, ant_latency_t *jitter)
+{
+    ant_get_jitter(fb->ant, jitter);
+}
+
+/* read from the base on its own thread, see ant_start_io_thread */
+int fitbit_start_io_thread(fitbit_t *fb, int rt_priority)
+{
+    return ant_start_io_thread(fb->ant, rt_priority);
+}
+
+void fitbit_set_pipelined_setup(fitbit_t *fb, bool pipelined)
+{
+    fb->pipelined_setup = pipelined;
+}
+
+/* off by default, as trackers may not support advanced bursts */
+void fitbit_set_advanced_burst(fitbit_t *fb, bool advanced)
+{
+    if (advanced != fb->advanced_burst)
+        fb->burst_negotiated = false;
+    fb->advanced_burst = advanced;
+}
+
+void fitbit_set_max_sessions(fitbit_t *fb, int max_sessions)
+{
+    pthread_mutex_lock(&fb->lock);
+    fb->max_sessions = MAX(1, MIN(max_sessions, FITBIT_MAX_SESSIONS));
+    if (fb->base_sessions)
+        fb->max_sessions = MIN(fb->max_sessions, fb->base_sessions);
+    pthread_mutex_unlock(&fb->lock);
+}
+
+/*
+ * Sessions use the channels following the base's own, so limit them to the
+ * number of channels the base has, which its capabilities give.
+ */
+static int fitbit_get_base_sessions(fitbit_t *fb)
+{
+    uint8_t caps[8], len;
+    int sessions = 1;
+
+    memset(caps, 0, sizeof(caps));
+    if (ant_request_message(fb->ant, 0, 0x54, &len, caps, sizeof(caps)) || len < 1) {
+        if (ant_is_dead(fb->ant))
+            return -1;
+        /* every base has at least the channel for a single session */
+        INFO("base capabilities unknown, syncing one tracker at a time\n");
+    } else {
+        sessions = MAX(1, MIN(caps[0] - fb->chan - 1, FITBIT_MAX_SESSIONS));
+        DBG("base has %d channels, %d sessions\n", caps[0], sessions);
+    }
+
+    pthread_mutex_lock(&fb->lock);
+    fb->base_sessions = sessions;
+    fb->max_sessions = MIN(fb->max_sessions, sessions);
+    pthread_mutex_unlock(&fb->lock);
+
+    return 0;
+}
+
+/*
+ * Sync all trackers in range. Trackers are found on the base's channel then
+ * synced on channels of their own, up to max_sessions at once, so the search
+ * continues whilst they sync.
+ */
 int fitbit_sync_trackers(fitbit_t *fb, fitbit_cb_sync *do_sync, void *user)
 {
+    fitbit_session_t *session;
     uint8_t dev_num[2];
-    int ret, count = 0;
+    int count = 0;
+
+    /* start on dev_num 0xffff to find trackers, no sessions are active */
+    dev_num[0] = dev_num[1] = 0xff;
+    CHAINERR_LTZ(fitbit_init_ant_channel(fb, dev_num), err);
+
+    if (!fb->base_sessions)
+        CHAINERR_LTZ(fitbit_get_base_sessions(fb), err);
 
     while (true) {
-        /* start on dev_num 0xffff to find trackers */
-        dev_num[0] = dev_num[1] = 0xff;
-        CHAINERR_LTZ(fitbit_init_ant_channel(fb, dev_num), err);
+        session = fitbit_session_get(fb, &count);
 
         /* look for tracker beacon */
-        ret = fitbit_find_tracker_beacon(fb);
-        if (ret < 0) {
+        if (fitbit_find_tracker_beacon(fb) < 0) {
             /* no beacon found */
             break;
         }
 
-        if (fitbit_sync_single_tracker(fb, do_sync, user)) {
-            /* sync failed */
+        if (fitbit_session_start(fb, session, do_sync, user)) {
+            /* failed to hand the tracker over */
+            memset(fb->curr_dev_num, 0, sizeof(fb->curr_dev_num));
             break;
         }
-
-        /* synced a tracker on this iteration */
-        count++;
     }
 
+    count += fitbit_session_wait_all(fb);
+
     /* it's possible we failed because the base disconnected/errored */
     if (ant_is_dead(fb->ant))
         goto err;
@@ -19,6 +19,7 @@
 #define __fitbit_h__
 
 #include <stdint.h>
+#include <ant.h>
 
 typedef struct fitbit_s fitbit_t;
 
@@ -34,9 +35,20 @@ typedef struct {
 typedef void (fitbit_cb_foundbase)(fitbit_t *fb, void *user);
 typedef void (fitbit_cb_sync)(fitbit_t *fb, fitbit_tracker_info_t *tracker, void *user);
 
+fitbit_t *fitbit_create(ant_t *ant);
 int fitbit_find_bases(fitbit_cb_foundbase *found_base, void *user);
+int fitbit_find_bases_ctx(ant_context_t *ctx, fitbit_cb_foundbase *found_base, void *user);
+int fitbit_wait_for_bases(unsigned timeout_ms);
+int fitbit_wait_for_bases_ctx(ant_context_t *ctx, unsigned timeout_ms);
 void fitbit_destroy(fitbit_t *fb);
 void fitbit_set_max_setup_skip(fitbit_t *fb, uint8_t max_skip);
+void fitbit_set_pipelined_setup(fitbit_t *fb, bool pipelined);
+void fitbit_set_advanced_burst(fitbit_t *fb, bool advanced);
+void fitbit_set_capture(fitbit_t *fb, ant_capture_t *cap);
+void fitbit_get_latency(fitbit_t *fb, uint8_t msg_id, ant_latency_t *lat);
+void fitbit_get_jitter(fitbit_t *fb, ant_latency_t *jitter);
+int fitbit_start_io_thread(fitbit_t *fb, int rt_priority);
+void fitbit_set_max_sessions(fitbit_t *fb, int max_sessions);
 int fitbit_sync_trackers(fitbit_t *fb, fitbit_cb_sync *do_sync, void *user);
 int fitbit_run_op(fitbit_t *fb, uint8_t op[7], uint8_t *payload, size_t payload_sz, uint8_t *response, size_t response_sz, size_t *response_len);
 int fitbit_tracker_sleep(fitbit_t *fb, uint32_t duration);
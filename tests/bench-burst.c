@@ -0,0 +1,112 @@
+/*
+ * This file is part of fitbitd.
+ *
+ * fitbitd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fitbitd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fitbitd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Compares the throughput of reading a tracker's data bank on the virtual
+ * base with legacy & advanced bursts. Each burst packet takes as long on air
+ * as a legacy packet at ANT's 20kbit/s burst rate, so the numbers show what
+ * libant makes of the link rather than what any real base manages.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <ant-private.h>
+#include <ant-virtual.h>
+#include <fitbit.h>
+#include "util.h"
+
+#define LOG_TAG "bench-burst"
+#include "log.h"
+
+#define BENCH_BANK_SZ 4000
+
+/* time taken by 8 bytes at 20kbit/s, in us */
+#define BENCH_PACKET_US 3200
+
+static int banks;
+
+static void do_sync(fitbit_t *fb, fitbit_tracker_info_t *tracker, void *user)
+{
+    uint8_t op[7] = { 0x22, 0, 0, 0, 0, 0, 0 };
+    uint8_t resp[2 * BENCH_BANK_SZ];
+    size_t len;
+
+    if (!fitbit_run_op(fb, op, NULL, 0, resp, sizeof(resp), &len) && len == BENCH_BANK_SZ)
+        banks++;
+
+    fitbit_tracker_sleep(fb, 900);
+}
+
+static int bench(bool advanced)
+{
+    ant_virtual_config_t cfg = {
+        .trackers = 1,
+        .latency_us = 1000,
+        .burst_packet_us = BENCH_PACKET_US,
+        .bank_sz = BENCH_BANK_SZ,
+        .seed = 1,
+        .advanced_burst = true,
+    };
+    ant_burst_stats_t stats;
+    fitbit_t *fb;
+    ant_t *ant;
+    int chan, ret = -1;
+
+    ant = ant_virtual_create(&cfg);
+    if (!ant)
+        return -1;
+
+    fb = fitbit_create(ant);
+    if (!fb)
+        return -1;
+    fitbit_set_advanced_burst(fb, advanced);
+
+    banks = 0;
+    if (fitbit_sync_trackers(fb, do_sync, NULL) != 1 || banks != 1)
+        goto out;
+
+    /* the bank is the largest burst received, on whichever channel it was */
+    for (chan = 0; chan < ANT_MAX_CHANNELS; chan++) {
+        ant_get_burst_stats(ant, chan, &stats);
+        if (stats.bytes < BENCH_BANK_SZ)
+            continue;
+
+        printf("%-10s %2u byte packets  %4lu packets  %6lu bytes/s\n",
+               advanced ? "advanced" : "legacy", stats.packet_sz,
+               stats.packets, stats.bytes_per_sec);
+        ret = 0;
+    }
+
+out:
+    fitbit_destroy(fb);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    if (bench(false) || bench(true)) {
+        ERR("failed to read bank\n");
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
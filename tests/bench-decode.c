@@ -0,0 +1,191 @@
+/*
+ * This file is part of fitbitd.
+ *
+ * fitbitd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fitbitd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fitbitd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Measures the throughput of the message decoder, by feeding it the data
+ * received in a capture taken with fitbitd --capture in the pieces it was
+ * read in. Without a capture, a stream of burst packets is made up instead.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <ant-capture.h>
+#include <ant-private.h>
+#include "util.h"
+
+#define LOG_TAG "bench-decode"
+#include "log.h"
+
+/* the data is decoded repeatedly until this much has been fed, in bytes */
+#define BENCH_BYTES (256 * 1024 * 1024)
+
+/* size of the made up stream & the pieces it's fed in, in bytes */
+#define BENCH_STREAM_SZ (64 * 1024)
+#define BENCH_CHUNK_SZ 64
+
+typedef struct {
+    uint8_t *data;
+    size_t len;
+} chunk_t;
+
+typedef struct {
+    chunk_t *chunks;
+    size_t nchunks;
+    size_t bytes;
+} stream_t;
+
+static int stream_add(stream_t *stream, uint8_t *data, size_t len)
+{
+    chunk_t *chunks;
+
+    chunks = realloc(stream->chunks, (stream->nchunks + 1) * sizeof(*chunks));
+    if (!chunks)
+        return -1;
+
+    stream->chunks = chunks;
+    stream->chunks[stream->nchunks].data = data;
+    stream->chunks[stream->nchunks++].len = len;
+    stream->bytes += len;
+    return 0;
+}
+
+/* gathers the data received from the first base in the capture */
+static int load_capture(const char *filename, stream_t *stream)
+{
+    ant_capture_record_t rec;
+    char base[sizeof(rec.name)] = "";
+    FILE *f;
+    int ret;
+
+    f = fopen(filename, "rb");
+    if (!f) {
+        ERR("failed to open %s\n", filename);
+        return -1;
+    }
+
+    CHAINERR_LTZ(ant_capture_read_header(f), err);
+
+    while (!(ret = ant_capture_read_record(f, &rec))) {
+        if (!base[0])
+            snprintf(base, sizeof(base), "%s", rec.name);
+
+        if (rec.dir != ANT_CAPTURE_RX || !rec.len || strcmp(rec.name, base)) {
+            free(rec.data);
+            continue;
+        }
+
+        if (stream_add(stream, rec.data, rec.len)) {
+            free(rec.data);
+            goto err;
+        }
+    }
+    if (ret < 0)
+        goto err;
+
+    fclose(f);
+    return 0;
+err:
+    fclose(f);
+    return -1;
+}
+
+/* makes up a stream of legacy burst packets, as received during a sync */
+static int make_stream(stream_t *stream)
+{
+    ant_message_t msg;
+    uint8_t *buf;
+    size_t len, off = 0;
+    int seq = 0, i;
+
+    buf = malloc(BENCH_STREAM_SZ);
+    if (!buf)
+        return -1;
+
+    while (off + 4 + 9 <= BENCH_STREAM_SZ) {
+        ant_message_init(&msg, 0x50, 9);
+        msg.data[0] = seq << 5;
+        for (i = 1; i < 9; i++)
+            msg.data[i] = rand();
+        seq = (seq % 3) + 1;
+
+        if (ant_message_encode(&msg, &buf[off], BENCH_STREAM_SZ - off, &len))
+            break;
+        off += len;
+    }
+
+    for (len = 0; len < off; len += BENCH_CHUNK_SZ) {
+        if (stream_add(stream, &buf[len], MIN((size_t)BENCH_CHUNK_SZ, off - len)))
+            return -1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    stream_t stream;
+    ant_decoder_t dec;
+    ant_message_t msg;
+    struct timespec start, end;
+    unsigned long messages = 0, passes = 0;
+    size_t i, off, used;
+    double secs;
+
+    memset(&stream, 0, sizeof(stream));
+
+    if (argc > 2) {
+        fprintf(stderr, "Usage: bench-decode [capture]\n");
+        return EXIT_FAILURE;
+    }
+
+    if (argc == 2 ? load_capture(argv[1], &stream) : make_stream(&stream))
+        return EXIT_FAILURE;
+    if (!stream.bytes) {
+        ERR("no data received in capture\n");
+        return EXIT_FAILURE;
+    }
+
+    memset(&dec, 0, sizeof(dec));
+    ant_decoder_reset(&dec);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (passes * stream.bytes < BENCH_BYTES) {
+        for (i = 0; i < stream.nchunks; i++) {
+            for (off = 0; off < stream.chunks[i].len; off += used) {
+                if (ant_decoder_feed(&dec, &stream.chunks[i].data[off],
+                                     stream.chunks[i].len - off, &used, &msg))
+                    messages++;
+            }
+        }
+        passes++;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%s: %zu bytes in %zu reads, decoded %lu times\n",
+           argc == 2 ? argv[1] : "burst stream", stream.bytes, stream.nchunks, passes);
+    printf("%.1f MB/s, %.2f M messages/s, %lu bad checksums, %lu bytes skipped\n",
+           passes * stream.bytes / secs / 1e6, messages / secs / 1e6,
+           dec.bad_cksum, dec.skipped);
+
+    return EXIT_SUCCESS;
+}
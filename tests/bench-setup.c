@@ -0,0 +1,128 @@
+/*
+ * This file is part of fitbitd.
+ *
+ * fitbitd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fitbitd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fitbitd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Compares syncing a tracker on the virtual base with the ANT channel setup
+ * pipelined & with one command at a time, over links of increasing latency.
+ * Each sync sets the channel up twice, once to find the tracker & once more
+ * after handing it a device number.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <ant-private.h>
+#include <ant-virtual.h>
+#include <fitbit.h>
+#include "util.h"
+
+#define LOG_TAG "bench-setup"
+#include "log.h"
+
+/* syncs timed for each latency & mode */
+#define BENCH_RUNS 3
+
+static const unsigned latencies_us[] = { 1000, 4000, 20000 };
+
+static ssize_t (*device_write)(ant_t *ant, uint8_t *buf, size_t sz);
+static unsigned long writes;
+
+static ssize_t counted_write(ant_t *ant, uint8_t *buf, size_t sz)
+{
+    writes++;
+    return device_write(ant, buf, sz);
+}
+
+static void do_sync(fitbit_t *fb, fitbit_tracker_info_t *tracker, void *user)
+{
+    fitbit_tracker_sleep(fb, 900);
+}
+
+/* returns the time taken by the sync in ms, or -1 if it failed */
+static long time_sync(unsigned latency_us, bool pipelined)
+{
+    ant_virtual_config_t cfg = {
+        .trackers = 1,
+        .latency_us = latency_us,
+        .burst_packet_us = 500,
+        .bank_sz = 100,
+        .seed = 1,
+    };
+    struct timespec start, end;
+    fitbit_t *fb;
+    ant_t *ant;
+    int synced;
+
+    ant = ant_virtual_create(&cfg);
+    if (!ant)
+        return -1;
+
+    device_write = ant->write;
+    ant->write = counted_write;
+
+    fb = fitbit_create(ant);
+    if (!fb)
+        return -1;
+    fitbit_set_pipelined_setup(fb, pipelined);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    synced = fitbit_sync_trackers(fb, do_sync, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    fitbit_destroy(fb);
+
+    if (synced != 1)
+        return -1;
+    return (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+}
+
+int main(int argc, char *argv[])
+{
+    long ms, total[2];
+    unsigned long mode_writes[2];
+    int i, run, mode;
+
+    printf("latency    one at a time          pipelined              saved\n");
+
+    for (i = 0; i < ARRAY_LENGTH(latencies_us); i++) {
+        for (mode = 0; mode < 2; mode++) {
+            total[mode] = 0;
+            writes = 0;
+
+            for (run = 0; run < BENCH_RUNS; run++) {
+                ms = time_sync(latencies_us[i], mode);
+                if (ms < 0) {
+                    ERR("sync failed\n");
+                    return EXIT_FAILURE;
+                }
+                total[mode] += ms;
+            }
+            mode_writes[mode] = writes / BENCH_RUNS;
+        }
+
+        printf("%5uus    %5ldms %3lu writes    %5ldms %3lu writes    %5ldms\n", latencies_us[i],
+               total[0] / BENCH_RUNS, mode_writes[0],
+               total[1] / BENCH_RUNS, mode_writes[1],
+               (total[0] - total[1]) / BENCH_RUNS);
+    }
+
+    return EXIT_SUCCESS;
+}
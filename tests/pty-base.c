@@ -0,0 +1,177 @@
+/*
+ * This file is part of fitbitd.
+ *
+ * fitbitd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fitbitd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fitbitd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <ant-private.h>
+#include "pty-base.h"
+#include "util.h"
+
+#define LOG_TAG "pty-base"
+#include "log.h"
+
+/* time to wait for either side before checking whether to stop, in ms */
+#define PTY_BASE_POLL 50
+
+struct pty_base_s {
+    ant_t *virt;
+    int master;
+    char path[64];
+
+    /* the threads relaying each way between the pty & virt */
+    pthread_t to_base, from_base;
+    volatile bool stop;
+};
+
+/* relays what the host writes to the tty to the virtual base */
+static void *pty_base_to_base(void *user)
+{
+    pty_base_t *pty = user;
+    struct pollfd pfd;
+    uint8_t buf[512];
+    ssize_t sz;
+
+    while (!pty->stop) {
+        pfd.fd = pty->master;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, PTY_BASE_POLL) <= 0)
+            continue;
+
+        sz = read(pty->master, buf, sizeof(buf));
+        if (sz > 0)
+            pty->virt->write(pty->virt, buf, sz);
+    }
+
+    return NULL;
+}
+
+/* relays what the virtual base sends to the tty */
+static void *pty_base_from_base(void *user)
+{
+    pty_base_t *pty = user;
+    struct pollfd pfd;
+    uint8_t buf[512];
+    ssize_t sz, done, ret;
+
+    while (!pty->stop) {
+        sz = pty->virt->read(pty->virt, buf, sizeof(buf), PTY_BASE_POLL);
+
+        for (done = 0; done < sz && !pty->stop; ) {
+            ret = write(pty->master, &buf[done], sz - done);
+            if (ret > 0) {
+                done += ret;
+                continue;
+            }
+            if (ret < 0 && errno != EAGAIN && errno != EINTR)
+                break;
+
+            pfd.fd = pty->master;
+            pfd.events = POLLOUT;
+            poll(&pfd, 1, PTY_BASE_POLL);
+        }
+    }
+
+    return NULL;
+}
+
+pty_base_t *pty_base_create(const ant_virtual_config_t *cfg)
+{
+    pty_base_t *pty;
+    char *path;
+
+    pty = calloc(1, sizeof(*pty));
+    if (!pty) {
+        ERR("failed to alloc pty base\n");
+        return NULL;
+    }
+    pty->master = -1;
+
+    pty->virt = ant_virtual_create(cfg);
+    if (!pty->virt)
+        goto err;
+
+    pty->master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (pty->master < 0 || grantpt(pty->master) || unlockpt(pty->master)) {
+        ERR("failed to create pty\n");
+        goto err;
+    }
+
+    path = ptsname(pty->master);
+    if (!path) {
+        ERR("failed to name pty\n");
+        goto err;
+    }
+    snprintf(pty->path, sizeof(pty->path), "%s", path);
+
+    if (pthread_create(&pty->to_base, NULL, pty_base_to_base, pty))
+        goto err;
+    if (pthread_create(&pty->from_base, NULL, pty_base_from_base, pty)) {
+        pty->stop = true;
+        pthread_join(pty->to_base, NULL);
+        goto err;
+    }
+
+    return pty;
+err:
+    if (pty->master >= 0)
+        close(pty->master);
+    if (pty->virt)
+        ant_destroy(pty->virt);
+    free(pty);
+    return NULL;
+}
+
+const char *pty_base_path(pty_base_t *pty)
+{
+    return pty->path;
+}
+
+ant_t *pty_base_virtual(pty_base_t *pty)
+{
+    return pty->virt;
+}
+
+/* stop relaying & close the master side, hanging up the tty */
+void pty_base_hangup(pty_base_t *pty)
+{
+    if (pty->master < 0)
+        return;
+
+    pty->stop = true;
+    pthread_join(pty->to_base, NULL);
+    pthread_join(pty->from_base, NULL);
+
+    close(pty->master);
+    pty->master = -1;
+}
+
+void pty_base_destroy(pty_base_t *pty)
+{
+    pty_base_hangup(pty);
+    ant_destroy(pty->virt);
+    free(pty);
+}
@@ -0,0 +1,35 @@
+/*
+ * This file is part of fitbitd.
+ *
+ * fitbitd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fitbitd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fitbitd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __pty_base_h__
+#define __pty_base_h__
+
+#include <ant-virtual.h>
+
+/*
+ * A virtual base served on a pty, so that it can be opened with
+ * ant_serial_open as if it were an ANT device attached through a tty.
+ */
+typedef struct pty_base_s pty_base_t;
+
+pty_base_t *pty_base_create(const ant_virtual_config_t *cfg);
+const char *pty_base_path(pty_base_t *pty);
+ant_t *pty_base_virtual(pty_base_t *pty);
+void pty_base_hangup(pty_base_t *pty);
+void pty_base_destroy(pty_base_t *pty);
+
+#endif /* __pty_base_h__ */
@@ -0,0 +1,218 @@
+/*
+ * This file is part of fitbitd.
+ *
+ * fitbitd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fitbitd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fitbitd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Syncs trackers on the virtual base, counting the allocations made by any
+ * thread whilst any is reading a data bank, as packets for one session may be
+ * dispatched by another or the I/O thread. Receiving shouldn't allocate at
+ * all, so any are a failure. Allocations made by the virtual base itself are
+ * not counted. This is done with & without an I/O thread.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ant-private.h>
+#include <ant-virtual.h>
+#include <fitbit.h>
+#include "util.h"
+
+#define LOG_TAG "test-alloc"
+#include "log.h"
+
+#define TEST_TRACKERS 3
+#define TEST_BANK_SZ 1000
+
+/* glibc's allocator, which the functions below count calls to */
+extern void *__libc_malloc(size_t sz);
+extern void *__libc_calloc(size_t n, size_t sz);
+extern void *__libc_realloc(void *ptr, size_t sz);
+extern void __libc_free(void *ptr);
+
+/* the number of threads receiving a bank */
+static int receiving;
+
+/* set whilst the calling thread is within the virtual base */
+static __thread int in_device;
+
+static unsigned long allocs, sync_allocs;
+static bool syncing;
+
+static ssize_t (*device_read)(ant_t *ant, uint8_t *buf, size_t sz, int timeout_ms);
+static ssize_t (*device_write)(ant_t *ant, uint8_t *buf, size_t sz);
+
+static int banks;
+
+static void count_alloc(void)
+{
+    if (in_device)
+        return;
+
+    if (__sync_fetch_and_add(&receiving, 0))
+        __sync_fetch_and_add(&allocs, 1);
+    if (syncing)
+        __sync_fetch_and_add(&sync_allocs, 1);
+}
+
+void *malloc(size_t sz)
+{
+    count_alloc();
+    return __libc_malloc(sz);
+}
+
+void *calloc(size_t n, size_t sz)
+{
+    count_alloc();
+    return __libc_calloc(n, sz);
+}
+
+void *realloc(void *ptr, size_t sz)
+{
+    count_alloc();
+    return __libc_realloc(ptr, sz);
+}
+
+void free(void *ptr)
+{
+    __libc_free(ptr);
+}
+
+static ssize_t counted_read(ant_t *ant, uint8_t *buf, size_t sz, int timeout_ms)
+{
+    ssize_t ret;
+
+    in_device++;
+    ret = device_read(ant, buf, sz, timeout_ms);
+    in_device--;
+    return ret;
+}
+
+static ssize_t counted_write(ant_t *ant, uint8_t *buf, size_t sz)
+{
+    ssize_t ret;
+
+    in_device++;
+    ret = device_write(ant, buf, sz);
+    in_device--;
+    return ret;
+}
+
+static void *idle(void *user)
+{
+    return NULL;
+}
+
+/*
+ * Session threads are started whilst other sessions receive. A thread on a
+ * fresh stack allocates its TLS, but glibc keeps the stacks of threads which
+ * have been joined, so start & join as many up front.
+ */
+static void warm_thread_stacks(void)
+{
+    pthread_t threads[TEST_TRACKERS + 1];
+    int i;
+
+    for (i = 0; i < ARRAY_LENGTH(threads); i++)
+        pthread_create(&threads[i], NULL, idle, NULL);
+    for (i = 0; i < ARRAY_LENGTH(threads); i++)
+        pthread_join(threads[i], NULL);
+}
+
+static void do_sync(fitbit_t *fb, fitbit_tracker_info_t *tracker, void *user)
+{
+    uint8_t op[7] = { 0x22, 0, 0, 0, 0, 0, 0 };
+    uint8_t resp[2 * TEST_BANK_SZ];
+    size_t len;
+    int ret;
+
+    __sync_fetch_and_add(&receiving, 1);
+    ret = fitbit_run_op(fb, op, NULL, 0, resp, sizeof(resp), &len);
+    __sync_fetch_and_sub(&receiving, 1);
+
+    if (!ret && len == TEST_BANK_SZ)
+        __sync_fetch_and_add(&banks, 1);
+
+    fitbit_tracker_sleep(fb, 900);
+}
+
+static int test(bool io_thread)
+{
+    ant_virtual_config_t cfg = {
+        .trackers = TEST_TRACKERS,
+        .latency_us = 500,
+        .burst_packet_us = 200,
+        .bank_sz = TEST_BANK_SZ,
+        .seed = 1,
+    };
+    fitbit_t *fb;
+    ant_t *ant;
+    int synced;
+
+    ant = ant_virtual_create(&cfg);
+    if (!ant)
+        return -1;
+
+    device_read = ant->read;
+    device_write = ant->write;
+    ant->read = counted_read;
+    ant->write = counted_write;
+
+    fb = fitbit_create(ant);
+    if (!fb) {
+        ant_destroy(ant);
+        return -1;
+    }
+    fitbit_set_max_sessions(fb, TEST_TRACKERS);
+    if (io_thread && fitbit_start_io_thread(fb, 0)) {
+        fitbit_destroy(fb);
+        return -1;
+    }
+
+    warm_thread_stacks();
+
+    banks = 0;
+    allocs = sync_allocs = 0;
+    syncing = true;
+    synced = fitbit_sync_trackers(fb, do_sync, NULL);
+    syncing = false;
+
+    fitbit_destroy(fb);
+
+    printf("synced %d of %d trackers%s, read %d banks\n", synced, TEST_TRACKERS,
+           io_thread ? " with I/O thread" : "", banks);
+    printf("%lu allocations whilst reading banks, %lu during the whole sync\n",
+           allocs, sync_allocs);
+
+    if (synced != TEST_TRACKERS || banks != TEST_TRACKERS || allocs)
+        return -1;
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (test(false) || test(true)) {
+        ERR("FAILED\n");
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,122 @@
+/*
+ * This file is part of fitbitd.
+ *
+ * fitbitd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fitbitd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fitbitd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Reads data banks from a tracker on the virtual base, checking that a whole
+ * bank is returned as sent, one truncated by the caller's buffer fills it &
+ * one which ends short of what its header says fails rather than returning
+ * whatever was in the buffer before.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ant-virtual.h>
+#include <fitbit.h>
+#include "util.h"
+
+#define LOG_TAG "test-bank"
+#include "log.h"
+
+#define TEST_BANK_SZ 1000
+
+/* what the virtual tracker's first bank holds */
+#define TEST_BANK_BYTE(i) ((i) & 0xff)
+
+typedef struct {
+    size_t sz;
+    int ret;
+    size_t len;
+    bool valid;
+} test_read_t;
+
+static void do_sync(fitbit_t *fb, fitbit_tracker_info_t *tracker, void *user)
+{
+    uint8_t op[7] = { 0x22, 0, 0, 0, 0, 0, 0 };
+    uint8_t resp[2 * TEST_BANK_SZ];
+    test_read_t *read = user;
+    size_t i;
+
+    /* anything not overwritten by the bank is left as 0xee */
+    memset(resp, 0xee, sizeof(resp));
+    read->ret = fitbit_run_op(fb, op, NULL, 0, resp, read->sz, &read->len);
+
+    read->valid = true;
+    for (i = 0; i < read->len; i++) {
+        if (resp[i] != TEST_BANK_BYTE(i))
+            read->valid = false;
+    }
+
+    fitbit_tracker_sleep(fb, 900);
+}
+
+/* read a bank into a buffer of sz, expecting len bytes or a failure if -1 */
+static int test(const char *name, bool short_banks, size_t sz, int len)
+{
+    ant_virtual_config_t cfg = {
+        .trackers = 1,
+        .latency_us = 500,
+        .burst_packet_us = 200,
+        .bank_sz = TEST_BANK_SZ,
+        .seed = 1,
+        .short_banks = short_banks,
+    };
+    test_read_t read = { .sz = sz };
+    fitbit_t *fb;
+    ant_t *ant;
+    int synced;
+
+    ant = ant_virtual_create(&cfg);
+    if (!ant)
+        return -1;
+
+    fb = fitbit_create(ant);
+    if (!fb) {
+        ant_destroy(ant);
+        return -1;
+    }
+
+    synced = fitbit_sync_trackers(fb, do_sync, &read);
+    fitbit_destroy(fb);
+
+    printf("%-10s synced %d, read returned %d with %d bytes%s\n", name, synced,
+           read.ret, (int)read.len, read.valid ? "" : " not as sent");
+    if (synced != 1 || !read.valid)
+        return -1;
+    if (len < 0)
+        return (read.ret && !read.len) ? 0 : -1;
+    return (!read.ret && read.len == len) ? 0 : -1;
+}
+
+int main(int argc, char *argv[])
+{
+    int ret = EXIT_SUCCESS;
+
+    if (test("whole", false, 2 * TEST_BANK_SZ, TEST_BANK_SZ))
+        ret = EXIT_FAILURE;
+    if (test("truncated", false, TEST_BANK_SZ / 4, TEST_BANK_SZ / 4))
+        ret = EXIT_FAILURE;
+    if (test("short", true, 2 * TEST_BANK_SZ, -1))
+        ret = EXIT_FAILURE;
+
+    if (ret != EXIT_SUCCESS)
+        ERR("FAILED\n");
+    return ret;
+}
@@ -0,0 +1,158 @@
+/*
+ * This file is part of fitbitd.
+ *
+ * fitbitd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fitbitd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fitbitd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Runs antbridge --serial on a pty serving the virtual base & syncs trackers
+ * through it with ant_net_connect over the loopback interface, then stops the
+ * bridge & checks that the base is seen to have gone. The antbridge binary is
+ * taken from $ANTBRIDGE.
+ */
+
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <ant-net.h>
+#include <fitbit.h>
+#include "pty-base.h"
+#include "util.h"
+
+#define LOG_TAG "test-bridge"
+#include "log.h"
+
+#define TEST_TRACKERS 2
+#define TEST_BANK_SZ 1000
+
+/* time given to the bridge to start listening, in 100ms attempts */
+#define TEST_CONNECT_TRIES 30
+
+static int banks;
+
+static void do_sync(fitbit_t *fb, fitbit_tracker_info_t *tracker, void *user)
+{
+    uint8_t op[7] = { 0x22, 0, 0, 0, 0, 0, 0 };
+    uint8_t resp[2 * TEST_BANK_SZ];
+    size_t len;
+
+    if (!fitbit_run_op(fb, op, NULL, 0, resp, sizeof(resp), &len) && len == TEST_BANK_SZ)
+        __sync_fetch_and_add(&banks, 1);
+
+    fitbit_tracker_sleep(fb, 900);
+}
+
+static pid_t start_bridge(const char *bridge, const char *tty, const char *port)
+{
+    pid_t pid;
+
+    pid = fork();
+    if (pid < 0) {
+        ERR("failed to fork\n");
+        return -1;
+    }
+
+    if (!pid) {
+        execl(bridge, bridge, "--serial", tty, "--listen", "127.0.0.1",
+              "--port", port, (char *)NULL);
+        ERR("failed to run %s\n", bridge);
+        _exit(EXIT_FAILURE);
+    }
+
+    return pid;
+}
+
+int main(int argc, char *argv[])
+{
+    ant_virtual_config_t cfg = {
+        .trackers = TEST_TRACKERS,
+        .latency_us = 500,
+        .burst_packet_us = 200,
+        .bank_sz = TEST_BANK_SZ,
+        .seed = 1,
+    };
+    const char *bridge;
+    char port[8];
+    pty_base_t *pty;
+    fitbit_t *fb = NULL;
+    ant_t *ant = NULL;
+    pid_t pid;
+    int i, synced, ret = EXIT_FAILURE;
+
+    bridge = getenv("ANTBRIDGE");
+    if (!bridge) {
+        ERR("ANTBRIDGE must give the path to antbridge\n");
+        return EXIT_FAILURE;
+    }
+
+    pty = pty_base_create(&cfg);
+    if (!pty)
+        return EXIT_FAILURE;
+
+    /* avoid clashing with the default port or other runs */
+    snprintf(port, sizeof(port), "%d", 20000 + getpid() % 10000);
+    pid = start_bridge(bridge, pty_base_path(pty), port);
+    if (pid < 0)
+        goto out;
+
+    for (i = 0; i < TEST_CONNECT_TRIES && !ant; i++) {
+        ant = ant_net_connect("127.0.0.1", port);
+        if (!ant)
+            usleep(100000);
+    }
+    if (!ant)
+        goto out;
+
+    fb = fitbit_create(ant);
+    if (!fb)
+        goto out;
+    fitbit_set_max_sessions(fb, TEST_TRACKERS);
+
+    synced = fitbit_sync_trackers(fb, do_sync, NULL);
+    printf("synced %d of %d trackers through port %s, read %d banks, rtt %luus\n",
+           synced, TEST_TRACKERS, port, banks, ant_net_get_rtt(ant));
+    if (synced != TEST_TRACKERS || banks != TEST_TRACKERS || ant_is_dead(ant))
+        goto out;
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    pid = -1;
+
+    synced = fitbit_sync_trackers(fb, do_sync, NULL);
+    printf("after stopping the bridge synced %d, base %s\n", synced,
+           ant_is_dead(ant) ? "dead" : "still alive");
+    if (synced > 0 || !ant_is_dead(ant))
+        goto out;
+
+    ret = EXIT_SUCCESS;
+out:
+    if (ret != EXIT_SUCCESS)
+        ERR("FAILED\n");
+    if (pid > 0) {
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+    }
+    if (fb)
+        fitbit_destroy(fb);
+    else if (ant)
+        ant_destroy(ant);
+    pty_base_destroy(pty);
+    return ret;
+}
@@ -0,0 +1,118 @@
+/*
+ * This file is part of fitbitd.
+ *
+ * fitbitd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fitbitd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fitbitd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Reads data banks from a tracker on the virtual base whilst burst packets
+ * are lost, duplicated & swapped. Duplicates should be dropped & the banks
+ * missing packets retried, so every bank read is exactly as sent.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ant-virtual.h>
+#include <fitbit.h>
+#include "util.h"
+
+#define LOG_TAG "test-burst"
+#include "log.h"
+
+/* small enough that most reads get through whole despite the loss */
+#define TEST_BANK_SZ 100
+#define TEST_READS 20
+
+/* what the virtual tracker's first bank holds */
+#define TEST_BANK_BYTE(i) ((i) & 0xff)
+
+static int reads, wrong;
+
+static void do_sync(fitbit_t *fb, fitbit_tracker_info_t *tracker, void *user)
+{
+    uint8_t op[7] = { 0x22, 0, 0, 0, 0, 0, 0 };
+    uint8_t resp[2 * TEST_BANK_SZ];
+    size_t len, i;
+    int n;
+
+    for (n = 0; n < TEST_READS; n++) {
+        /* anything not overwritten by the bank is left as 0xee */
+        memset(resp, 0xee, sizeof(resp));
+        if (fitbit_run_op(fb, op, NULL, 0, resp, sizeof(resp), &len))
+            continue;
+
+        reads++;
+        if (len != TEST_BANK_SZ) {
+            wrong++;
+            continue;
+        }
+        for (i = 0; i < len; i++) {
+            if (resp[i] != TEST_BANK_BYTE(i)) {
+                wrong++;
+                break;
+            }
+        }
+    }
+
+    fitbit_tracker_sleep(fb, 900);
+}
+
+int main(int argc, char *argv[])
+{
+    ant_virtual_config_t cfg = {
+        .trackers = 1,
+        .latency_us = 500,
+        .burst_packet_us = 200,
+        .loss_pct = 2,
+        .dup_pct = 10,
+        .reorder_pct = 5,
+        .bank_sz = TEST_BANK_SZ,
+        .seed = 1,
+    };
+    ant_virtual_stats_t stats;
+    fitbit_t *fb;
+    ant_t *ant;
+    int synced;
+
+    ant = ant_virtual_create(&cfg);
+    if (!ant)
+        return EXIT_FAILURE;
+
+    fb = fitbit_create(ant);
+    if (!fb) {
+        ant_destroy(ant);
+        return EXIT_FAILURE;
+    }
+
+    synced = fitbit_sync_trackers(fb, do_sync, NULL);
+    ant_virtual_get_stats(ant, &stats);
+    fitbit_destroy(fb);
+
+    printf("synced %d, read %d of %d banks, %d wrong\n", synced, reads, TEST_READS, wrong);
+    printf("%lu packets lost, %lu duplicated, %lu swapped\n",
+           stats.lost, stats.duplicated, stats.reordered);
+
+    /* each read makes 10 attempts, so should all get through eventually */
+    if (synced != 1 || reads != TEST_READS || wrong ||
+        !stats.lost || !stats.duplicated || !stats.reordered) {
+        ERR("FAILED\n");
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
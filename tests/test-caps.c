@@ -0,0 +1,104 @@
+/*
+ * This file is part of fitbitd.
+ *
+ * fitbitd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fitbitd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fitbitd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Syncs with advanced bursts asked for on a virtual base which doesn't answer
+ * capabilities requests, checking that trackers are still synced & their
+ * banks read in legacy burst packets.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ant-private.h>
+#include <ant-virtual.h>
+#include <fitbit.h>
+#include "util.h"
+
+#define LOG_TAG "test-caps"
+#include "log.h"
+
+#define TEST_TRACKERS 2
+#define TEST_BANK_SZ 1000
+
+static int banks;
+
+static void do_sync(fitbit_t *fb, fitbit_tracker_info_t *tracker, void *user)
+{
+    uint8_t op[7] = { 0x22, 0, 0, 0, 0, 0, 0 };
+    uint8_t resp[2 * TEST_BANK_SZ];
+    size_t len;
+
+    if (!fitbit_run_op(fb, op, NULL, 0, resp, sizeof(resp), &len) && len == TEST_BANK_SZ)
+        __sync_fetch_and_add(&banks, 1);
+
+    fitbit_tracker_sleep(fb, 900);
+}
+
+int main(int argc, char *argv[])
+{
+    ant_virtual_config_t cfg = {
+        .trackers = TEST_TRACKERS,
+        .latency_us = 500,
+        .burst_packet_us = 200,
+        .bank_sz = TEST_BANK_SZ,
+        .seed = 1,
+        .advanced_burst = true,
+        .no_capabilities = true,
+    };
+    ant_burst_stats_t stats;
+    fitbit_t *fb;
+    ant_t *ant;
+    int chan, synced, packet_sz = 0, ret = EXIT_FAILURE;
+
+    ant = ant_virtual_create(&cfg);
+    if (!ant)
+        return EXIT_FAILURE;
+
+    fb = fitbit_create(ant);
+    if (!fb) {
+        ant_destroy(ant);
+        return EXIT_FAILURE;
+    }
+    fitbit_set_advanced_burst(fb, true);
+    fitbit_set_max_sessions(fb, TEST_TRACKERS);
+
+    synced = fitbit_sync_trackers(fb, do_sync, NULL);
+
+    /* the largest packets any bank was received in */
+    for (chan = 0; chan < ANT_MAX_CHANNELS; chan++) {
+        ant_get_burst_stats(ant, chan, &stats);
+        if (stats.bytes >= TEST_BANK_SZ)
+            packet_sz = MAX(packet_sz, stats.packet_sz);
+    }
+
+    printf("synced %d of %d trackers, read %d banks in %d byte packets\n",
+           synced, TEST_TRACKERS, banks, packet_sz);
+    if (synced != TEST_TRACKERS || banks != TEST_TRACKERS ||
+        packet_sz != ANT_BURST_PACKET_LEGACY)
+        goto out;
+
+    ret = EXIT_SUCCESS;
+out:
+    if (ret != EXIT_SUCCESS)
+        ERR("FAILED\n");
+    fitbit_destroy(fb);
+    return ret;
+}
@@ -0,0 +1,138 @@
+/*
+ * This file is part of fitbitd.
+ *
+ * fitbitd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fitbitd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fitbitd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks each outcome of probing the base's channel before setting it up on
+ * the virtual base: a channel already configured is reused, one configured
+ * by someone else is set up again, and only a base which can't be probed is
+ * reset.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ant-virtual.h>
+#include <fitbit.h>
+#include "util.h"
+
+#define LOG_TAG "test-probe"
+#include "log.h"
+
+#define TEST_BANK_SZ 1000
+
+static int banks;
+
+static void do_sync(fitbit_t *fb, fitbit_tracker_info_t *tracker, void *user)
+{
+    uint8_t op[7] = { 0x22, 0, 0, 0, 0, 0, 0 };
+    uint8_t resp[2 * TEST_BANK_SZ];
+    size_t len;
+
+    if (!fitbit_run_op(fb, op, NULL, 0, resp, sizeof(resp), &len) && len == TEST_BANK_SZ)
+        banks++;
+
+    fitbit_tracker_sleep(fb, 900);
+}
+
+/*
+ * sync the trackers on a virtual base, with chan 0 first left by someone
+ * else as given by type & net if assigned is set. If resync is set the base
+ * is searched again once they're asleep, probing the channel as it was left.
+ */
+static int test(const char *name, ant_virtual_config_t *cfg, bool assigned,
+                uint8_t type, uint8_t net, bool resync, unsigned long resets)
+{
+    uint8_t dev_num[2] = { 0x12, 0x34 };
+    ant_channel_status_t status;
+    ant_virtual_stats_t stats;
+    fitbit_t *fb = NULL;
+    ant_t *ant;
+    int synced, ret = -1;
+
+    ant = ant_virtual_create(cfg);
+    if (!ant)
+        return -1;
+
+    if (assigned) {
+        CHAINERR_LTZ(ant_assign_channel(ant, 0, type, net), out);
+        CHAINERR_LTZ(ant_set_channel_id(ant, 0, dev_num, 2, 2), out);
+        CHAINERR_LTZ(ant_open_channel(ant, 0), out);
+    }
+
+    fb = fitbit_create(ant);
+    if (!fb)
+        goto out;
+
+    /* probe before every setup, not only after skipping several */
+    fitbit_set_max_setup_skip(fb, 0);
+    fitbit_set_pipelined_setup(fb, true);
+
+    banks = 0;
+    synced = fitbit_sync_trackers(fb, do_sync, NULL);
+    if (resync && fitbit_sync_trackers(fb, do_sync, NULL))
+        synced = -1;
+    ant_virtual_get_stats(ant, &stats);
+    memset(&status, 0, sizeof(status));
+    if (!cfg->no_channel_status)
+        ant_get_channel_status(ant, 0, &status);
+
+    printf("%-14s synced %d of %d trackers, read %d banks, %lu resets, chan 0 net %d type %d\n",
+           name, synced, cfg->trackers, banks, stats.resets, status.net, status.type);
+    if (synced != cfg->trackers || banks != cfg->trackers || stats.resets != resets ||
+        status.net || status.type)
+        goto out;
+
+    ret = 0;
+out:
+    if (fb)
+        fitbit_destroy(fb);
+    else
+        ant_destroy(ant);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    ant_virtual_config_t cfg = {
+        .trackers = 2,
+        .latency_us = 500,
+        .burst_packet_us = 200,
+        .bank_sz = TEST_BANK_SZ,
+        .seed = 1,
+    };
+    int ret = EXIT_SUCCESS;
+
+    /* the channel is set up once, then found as it was left */
+    if (test("configured", &cfg, false, 0, 0, true, 0))
+        ret = EXIT_FAILURE;
+
+    /* a shared channel on another network needs setting up from scratch */
+    if (test("misconfigured", &cfg, true, 0x10, 1, false, 0))
+        ret = EXIT_FAILURE;
+
+    /* without channel status there's no telling what state it's in */
+    cfg.no_channel_status = true;
+    if (test("probe failure", &cfg, false, 0, 0, false, 1))
+        ret = EXIT_FAILURE;
+
+    if (ret != EXIT_SUCCESS)
+        ERR("FAILED\n");
+    return ret;
+}
@@ -0,0 +1,112 @@
+/*
+ * This file is part of fitbitd.
+ *
+ * fitbitd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fitbitd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fitbitd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Syncs a tracker on a pty serving the virtual base, then closes the base &
+ * opens it again as a daemon restarting would, with pipelined setup on. The
+ * base keeps the channel configured in between, so bringing it back into
+ * shape should neither fail nor fall back to resetting the base.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ant-serial.h>
+#include <fitbit.h>
+#include "pty-base.h"
+#include "util.h"
+
+#define LOG_TAG "test-reopen"
+#include "log.h"
+
+#define TEST_BANK_SZ 1000
+
+static int banks;
+
+static void do_sync(fitbit_t *fb, fitbit_tracker_info_t *tracker, void *user)
+{
+    uint8_t op[7] = { 0x22, 0, 0, 0, 0, 0, 0 };
+    uint8_t resp[2 * TEST_BANK_SZ];
+    size_t len;
+
+    if (!fitbit_run_op(fb, op, NULL, 0, resp, sizeof(resp), &len) && len == TEST_BANK_SZ)
+        banks++;
+
+    fitbit_tracker_sleep(fb, 900);
+}
+
+/* open the base afresh & sync, returning the number of trackers synced */
+static int sync_once(pty_base_t *pty)
+{
+    fitbit_t *fb;
+    ant_t *ant;
+    int synced;
+
+    ant = ant_serial_open(pty_base_path(pty), ANT_SERIAL_BAUD_DEFAULT);
+    if (!ant)
+        return -1;
+
+    fb = fitbit_create(ant);
+    if (!fb) {
+        ant_destroy(ant);
+        return -1;
+    }
+    fitbit_set_pipelined_setup(fb, true);
+
+    synced = fitbit_sync_trackers(fb, do_sync, NULL);
+    fitbit_destroy(fb);
+
+    return synced;
+}
+
+int main(int argc, char *argv[])
+{
+    ant_virtual_config_t cfg = {
+        .trackers = 1,
+        .latency_us = 500,
+        .burst_packet_us = 200,
+        .bank_sz = TEST_BANK_SZ,
+        .seed = 1,
+    };
+    ant_virtual_stats_t stats;
+    pty_base_t *pty;
+    int first, second, ret = EXIT_FAILURE;
+
+    pty = pty_base_create(&cfg);
+    if (!pty)
+        return EXIT_FAILURE;
+
+    /* the tracker sleeps once synced, so only the base is found the second time */
+    first = sync_once(pty);
+    second = sync_once(pty);
+    ant_virtual_get_stats(pty_base_virtual(pty), &stats);
+
+    printf("synced %d then %d after reopening, read %d banks, %lu resets\n",
+           first, second, banks, stats.resets);
+    if (first != 1 || second != 0 || banks != 1 || stats.resets)
+        goto out;
+
+    ret = EXIT_SUCCESS;
+out:
+    if (ret != EXIT_SUCCESS)
+        ERR("FAILED\n");
+    pty_base_destroy(pty);
+    return ret;
+}
@@ -0,0 +1,118 @@
+/*
+ * This file is part of fitbitd.
+ *
+ * fitbitd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fitbitd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fitbitd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Syncs trackers through ant_serial_open on a pty serving the virtual base,
+ * then hangs the pty up & checks that the base is seen to have gone. This is
+ * done reading from the syncing threads, then from an I/O thread, which
+ * exits on its own once the base has gone.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ant-serial.h>
+#include <fitbit.h>
+#include "pty-base.h"
+#include "util.h"
+
+#define LOG_TAG "test-serial"
+#include "log.h"
+
+#define TEST_TRACKERS 2
+#define TEST_BANK_SZ 1000
+
+static int banks;
+
+static void do_sync(fitbit_t *fb, fitbit_tracker_info_t *tracker, void *user)
+{
+    uint8_t op[7] = { 0x22, 0, 0, 0, 0, 0, 0 };
+    uint8_t resp[2 * TEST_BANK_SZ];
+    size_t len;
+
+    if (!fitbit_run_op(fb, op, NULL, 0, resp, sizeof(resp), &len) && len == TEST_BANK_SZ)
+        __sync_fetch_and_add(&banks, 1);
+
+    fitbit_tracker_sleep(fb, 900);
+}
+
+static int test(bool io_thread)
+{
+    ant_virtual_config_t cfg = {
+        .trackers = TEST_TRACKERS,
+        .latency_us = 500,
+        .burst_packet_us = 200,
+        .bank_sz = TEST_BANK_SZ,
+        .seed = 1,
+    };
+    pty_base_t *pty;
+    fitbit_t *fb = NULL;
+    ant_t *ant;
+    int synced, ret = -1;
+
+    pty = pty_base_create(&cfg);
+    if (!pty)
+        return -1;
+
+    ant = ant_serial_open(pty_base_path(pty), ANT_SERIAL_BAUD_DEFAULT);
+    if (!ant)
+        goto out;
+
+    fb = fitbit_create(ant);
+    if (!fb)
+        goto out;
+    fitbit_set_max_sessions(fb, TEST_TRACKERS);
+    if (io_thread && fitbit_start_io_thread(fb, 0))
+        goto out;
+
+    banks = 0;
+    synced = fitbit_sync_trackers(fb, do_sync, NULL);
+    printf("synced %d of %d trackers on %s%s, read %d banks\n", synced,
+           TEST_TRACKERS, pty_base_path(pty), io_thread ? " with I/O thread" : "", banks);
+    if (synced != TEST_TRACKERS || banks != TEST_TRACKERS || ant_is_dead(ant))
+        goto out;
+
+    pty_base_hangup(pty);
+
+    synced = fitbit_sync_trackers(fb, do_sync, NULL);
+    printf("after hanging up synced %d, base %s\n", synced,
+           ant_is_dead(ant) ? "dead" : "still alive");
+    if (synced > 0 || !ant_is_dead(ant))
+        goto out;
+
+    ret = 0;
+out:
+    if (fb)
+        fitbit_destroy(fb);
+    else if (ant)
+        ant_destroy(ant);
+    pty_base_destroy(pty);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    if (test(false) || test(true)) {
+        ERR("FAILED\n");
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}